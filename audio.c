@@ -1,3 +1,5 @@
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -5,24 +7,722 @@
 
 #include "audio.h"
 #include "cpu.h"
+#include "mmu.h"
+
+// a channel's digital output (0-15) times the master volume (1-8) times this
+// is its contribution to the mix; all four at full volume is 30720
+#define AUDIO_LEVEL_SCALE  64
+
+// the blip kernel's taps sum to this, so the integrated buffer is in units of
+// 1/(1 << AUDIO_BLIP_KERNEL_BITS) of a level
+#define AUDIO_BLIP_KERNEL_BITS  15
+
+static int16_t audio_blip_kernel[AUDIO_BLIP_PHASES][AUDIO_BLIP_TAPS];
+static pthread_once_t audio_blip_kernel_once = PTHREAD_ONCE_INIT;
+
+// each phase is a blackman-windowed sinc (cut off a bit below nyquist)
+// centered at that phase's fractional position, scaled so its taps sum to
+// exactly 1 << AUDIO_BLIP_KERNEL_BITS
+static void audio_build_blip_kernel() {
+  int phase, tap;
+  for (phase = 0; phase < AUDIO_BLIP_PHASES; phase++) {
+    double taps[AUDIO_BLIP_TAPS], total = 0.0;
+    for (tap = 0; tap < AUDIO_BLIP_TAPS; tap++) {
+      double x = tap - (AUDIO_BLIP_TAPS / 2 - 1) - (double)phase / AUDIO_BLIP_PHASES;
+      double sinc = (x == 0.0) ? 1.0 : (sin(M_PI * x * 0.9) / (M_PI * x * 0.9));
+      double w = 2 * M_PI * x / AUDIO_BLIP_TAPS;
+      taps[tap] = sinc * (0.42 + 0.5 * cos(w) + 0.08 * cos(2 * w));
+      total += taps[tap];
+    }
+
+    int sum = 0;
+    for (tap = 0; tap < AUDIO_BLIP_TAPS; tap++) {
+      audio_blip_kernel[phase][tap] =
+          (int16_t)lrint(taps[tap] * (1 << AUDIO_BLIP_KERNEL_BITS) / total);
+      sum += audio_blip_kernel[phase][tap];
+    }
+    audio_blip_kernel[phase][AUDIO_BLIP_TAPS / 2 - 1] +=
+        (1 << AUDIO_BLIP_KERNEL_BITS) - sum;
+  }
+}
+
+static void audio_blip_add(struct audio* a, struct audio_blip* b,
+    uint64_t cycles, int32_t delta) {
+  uint64_t pos = a->blip_offset +
+      (cycles - a->blip_start_cycles) * a->samples_per_cycle;
+  uint64_t index = pos >> 32;
+  if (index >= AUDIO_BLIP_SIZE)
+    return; // can't happen unless the sequencer event is very late
+
+  const int16_t* kernel =
+      audio_blip_kernel[(pos >> (32 - AUDIO_BLIP_PHASE_BITS)) & (AUDIO_BLIP_PHASES - 1)];
+  int32_t* out = &b->buffer[index];
+  int tap;
+  for (tap = 0; tap < AUDIO_BLIP_TAPS; tap++)
+    out[tap] += kernel[tap] * delta;
+}
+
+// integrates the first num_samples samples of the buffer into every other
+// entry of out, removes them from the buffer, and runs them through a
+// high-pass filter like the one on the real hardware's output
+static void audio_blip_read(struct audio_blip* b, int16_t* out,
+    size_t num_samples) {
+  size_t x;
+  for (x = 0; x < num_samples; x++) {
+    b->sum += b->buffer[x];
+    int32_t level = b->sum >> AUDIO_BLIP_KERNEL_BITS;
+    b->highpass += (((int64_t)level << 16) - b->highpass) >> 9;
+    int32_t sample = level - (int32_t)(b->highpass >> 16);
+    out[x * 2] = (sample > 32767) ? 32767 : ((sample < -32768) ? -32768 : sample);
+  }
+
+  memmove(b->buffer, &b->buffer[num_samples],
+      (AUDIO_BLIP_SIZE + AUDIO_BLIP_TAPS - num_samples) * sizeof(b->buffer[0]));
+  memset(&b->buffer[AUDIO_BLIP_SIZE + AUDIO_BLIP_TAPS - num_samples], 0,
+      num_samples * sizeof(b->buffer[0]));
+}
+
+static inline int audio_synthesizing(struct audio* a) {
+  return a->sample_cb && (a->mode == AUDIO_MODE_FULL);
+}
+
+static void audio_update_samples_per_cycle(struct audio* a, int double_speed) {
+  uint64_t cycles_per_sec = CPU_CYCLES_PER_SEC;
+  if (double_speed)
+    cycles_per_sec *= 2;
+  a->samples_per_cycle = ((uint64_t)a->sample_rate << 32) / cycles_per_sec;
+  a->samples_per_cycle = a->samples_per_cycle * (1000000 + a->rate_adjust_ppm) /
+      1000000;
+}
+
+// makes the samples up to the given time available and passes them to the
+// callback
+static void audio_end_frame(struct audio* a, uint64_t cycles) {
+  a->blip_offset += (cycles - a->blip_start_cycles) * a->samples_per_cycle;
+  a->blip_start_cycles = cycles;
+
+  size_t num_samples = a->blip_offset >> 32;
+  if (num_samples > AUDIO_BLIP_SIZE)
+    num_samples = AUDIO_BLIP_SIZE;
+  audio_blip_read(&a->left, &a->samples[0], num_samples);
+  audio_blip_read(&a->right, &a->samples[1], num_samples);
+  a->blip_offset -= (uint64_t)num_samples << 32;
+
+  size_t num_skipped = (a->num_skipped_samples < num_samples) ?
+      a->num_skipped_samples : num_samples;
+  a->num_skipped_samples -= num_skipped;
+  if (num_samples > num_skipped)
+    a->sample_cb(a->sample_cb_arg, &a->samples[num_skipped * 2],
+        num_samples - num_skipped);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// channels
+
+// each channel's registers are NRx0-NRx4, 5 bytes apart starting at FF10
+#define NR(s, ch, reg) (((uint8_t*)(s))[(ch) * 5 + (reg)])
+
+static const uint8_t audio_duty_patterns[4][8] = {
+  {0, 0, 0, 0, 0, 0, 0, 1}, // 12.5%
+  {1, 0, 0, 0, 0, 0, 0, 1}, // 25%
+  {1, 0, 0, 0, 0, 1, 1, 1}, // 50%
+  {0, 1, 1, 1, 1, 1, 1, 0}, // 75%
+};
+
+static const int audio_wave_volume_shifts[4] = {4, 0, 1, 2};
+
+static int audio_channel_freq(struct audio_state* s, int ch) {
+  return NR(s, ch, 3) | ((NR(s, ch, 4) & 0x07) << 8);
+}
+
+// cycles between steps of the channel's waveform. the apu runs at the same
+// rate in double speed mode, so this is twice as many cpu cycles then
+static uint64_t audio_channel_period(struct audio* a, struct audio_state* s,
+    int ch) {
+  uint64_t period;
+  if (ch < 2)
+    period = (2048 - audio_channel_freq(s, ch)) * 4;
+  else if (ch == 2)
+    period = (2048 - audio_channel_freq(s, ch)) * 2;
+  else {
+    int divisor_code = s->ch4_poly_counter & 0x07;
+    period = (uint64_t)(divisor_code ? (divisor_code * 16) : 8) <<
+        (s->ch4_poly_counter >> 4);
+  }
+  return period << is_double_speed_mode(a->cpu);
+}
+
+static int audio_channel_dac_enabled(struct audio_state* s, int ch) {
+  if (ch == 2)
+    return !!(s->ch3_enable & 0x80);
+  return !!(NR(s, ch, 2) & 0xF8);
+}
+
+static int audio_channel_output(struct audio_state* s, int ch) {
+  struct audio_channel* c = &s->channels[ch];
+  if (!c->enabled)
+    return 0;
+
+  switch (ch) {
+    case 0:
+    case 1:
+      return audio_duty_patterns[NR(s, ch, 1) >> 6][c->position] ? c->volume : 0;
+    case 2: {
+      uint8_t sample = s->ch3_wave_data[c->position / 2];
+      sample = (c->position & 1) ? (sample & 0x0F) : (sample >> 4);
+      return sample >> audio_wave_volume_shifts[(s->ch3_volume >> 5) & 3];
+    }
+    default:
+      return (s->noise_lfsr & 1) ? 0 : c->volume;
+  }
+}
+
+// sets a channel's digital output and, for the synthesis state, adds any
+// resulting change in the mix to the output buffers
+static void audio_set_channel_output(struct audio* a, struct audio_state* s,
+    int ch, uint64_t cycles, int output) {
+  struct audio_channel* c = &s->channels[ch];
+  c->output = output;
+  if (!s->is_synth)
+    return;
+
+  int32_t left = 0, right = 0;
+  if (audio_channel_dac_enabled(s, ch)) {
+    if (s->channel_terminal & (0x10 << ch))
+      left = output * (((s->channel_control >> 4) & 7) + 1) * AUDIO_LEVEL_SCALE;
+    if (s->channel_terminal & (0x01 << ch))
+      right = output * ((s->channel_control & 7) + 1) * AUDIO_LEVEL_SCALE;
+  }
+  if (left != c->left_level) {
+    audio_blip_add(a, &a->left, cycles, left - c->left_level);
+    c->left_level = left;
+  }
+  if (right != c->right_level) {
+    audio_blip_add(a, &a->right, cycles, right - c->right_level);
+    c->right_level = right;
+  }
+}
+
+static void audio_disable_channel(struct audio* a, struct audio_state* s,
+    int ch, uint64_t cycles) {
+  s->channels[ch].enabled = 0;
+  audio_set_channel_output(a, s, ch, cycles, 0);
+}
+
+// moves a channel's waveform position up to the given time without making
+// any output. (the noise channel's lfsr isn't advanced, but nobody can tell)
+static void audio_skip_channel(struct audio* a, struct audio_state* s, int ch,
+    uint64_t cycles) {
+  struct audio_channel* c = &s->channels[ch];
+  if (c->next_step_cycles > cycles)
+    return;
+  uint64_t period = audio_channel_period(a, s, ch);
+  uint64_t steps = (cycles - c->next_step_cycles) / period + 1;
+  c->position = (c->position + steps) & ((ch == 2) ? 31 : 7);
+  c->next_step_cycles += steps * period;
+}
+
+// runs a channel's waveform up to the given time. this is only done for the
+// synthesis state; waveform positions aren't visible through any register
+static void audio_run_channel(struct audio* a, struct audio_state* s, int ch,
+    uint64_t cycles) {
+  struct audio_channel* c = &s->channels[ch];
+  if (c->next_step_cycles > cycles)
+    return;
+
+  // if it's off, just keep the waveform position up to date
+  if (!c->enabled) {
+    audio_skip_channel(a, s, ch, cycles);
+    return;
+  }
+
+  uint64_t period = audio_channel_period(a, s, ch);
+
+  for (; c->next_step_cycles <= cycles; c->next_step_cycles += period) {
+    if (ch < 2)
+      c->position = (c->position + 1) & 7;
+    else if (ch == 2)
+      c->position = (c->position + 1) & 31;
+    else {
+      int bit = (s->noise_lfsr ^ (s->noise_lfsr >> 1)) & 1;
+      s->noise_lfsr = (s->noise_lfsr >> 1) | (bit << 14);
+      if (s->ch4_poly_counter & 0x08) // 7-bit mode
+        s->noise_lfsr = (s->noise_lfsr & ~0x40) | (bit << 6);
+    }
+    audio_set_channel_output(a, s, ch, c->next_step_cycles,
+        audio_channel_output(s, ch));
+  }
+}
+
+static void audio_run_channels(struct audio* a, struct audio_state* s,
+    uint64_t cycles) {
+  int ch;
+  for (ch = 0; ch < 4; ch++)
+    audio_run_channel(a, s, ch, cycles);
+}
+
+static int audio_sweep_next_freq(struct audio_state* s) {
+  int delta = s->sweep_shadow_freq >> (s->ch1_sweep & 0x07);
+  return (s->ch1_sweep & 0x08) ? (s->sweep_shadow_freq - delta) :
+      (s->sweep_shadow_freq + delta);
+}
+
+static void audio_trigger_channel(struct audio* a, struct audio_state* s,
+    int ch, uint64_t cycles) {
+  struct audio_channel* c = &s->channels[ch];
+  c->enabled = audio_channel_dac_enabled(s, ch);
+  if (!c->length_counter)
+    c->length_counter = (ch == 2) ? 256 : 64;
+  c->next_step_cycles = cycles + audio_channel_period(a, s, ch);
+  if (ch != 2) {
+    c->volume = NR(s, ch, 2) >> 4;
+    c->envelope_timer = NR(s, ch, 2) & 0x07;
+  }
+
+  if (ch == 0) {
+    int period = (s->ch1_sweep >> 4) & 0x07;
+    s->sweep_shadow_freq = audio_channel_freq(s, 0);
+    s->sweep_timer = period ? period : 8;
+    s->sweep_enabled = period || (s->ch1_sweep & 0x07);
+    if ((s->ch1_sweep & 0x07) && (audio_sweep_next_freq(s) > 2047))
+      c->enabled = 0;
+  } else if (ch == 2)
+    c->position = 0;
+  else if (ch == 3)
+    s->noise_lfsr = 0x7FFF;
+
+  audio_set_channel_output(a, s, ch, cycles, audio_channel_output(s, ch));
+}
+
+static void audio_write_register(struct audio* a, struct audio_state* s,
+    uint8_t addr, uint8_t value, uint64_t cycles) {
+  if (addr >= 0x30) {
+    s->ch3_wave_data[addr - 0x30] = value;
+    return;
+  }
+
+  int ch;
+  if (addr == 0x26) {
+    if ((s->control & 0x80) && !(value & 0x80)) {
+      // powering off clears all the registers and stops all the channels
+      memset(s, 0, 0x16);
+      for (ch = 0; ch < 4; ch++)
+        audio_disable_channel(a, s, ch, cycles);
+    } else if (!(s->control & 0x80) && (value & 0x80))
+      s->frame_sequencer_step = 0;
+    s->control = value & 0x80;
+    return;
+  }
+
+  // nothing else can be written while the apu is off
+  if (!(s->control & 0x80) || (addr > 0x26))
+    return;
+  ((uint8_t*)s)[addr - 0x10] = value;
+
+  // master volume and panning affect every channel's level
+  if (addr >= 0x24) {
+    for (ch = 0; ch < 4; ch++)
+      audio_set_channel_output(a, s, ch, cycles, s->channels[ch].output);
+    return;
+  }
+
+  ch = (addr - 0x10) / 5;
+  struct audio_channel* c = &s->channels[ch];
+  switch ((addr - 0x10) % 5) {
+    case 1:
+      c->length_counter = (ch == 2) ? (256 - value) : (64 - (value & 0x3F));
+      break;
+    case 4:
+      if (value & 0x80)
+        audio_trigger_channel(a, s, ch, cycles);
+      break;
+  }
+
+  // turning off a channel's dac also turns off the channel
+  if (!audio_channel_dac_enabled(s, ch))
+    c->enabled = 0;
+  audio_set_channel_output(a, s, ch, cycles, audio_channel_output(s, ch));
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// frame sequencer
+
+static void audio_clock_lengths(struct audio* a, struct audio_state* s,
+    uint64_t cycles) {
+  int ch;
+  for (ch = 0; ch < 4; ch++) {
+    struct audio_channel* c = &s->channels[ch];
+    if ((NR(s, ch, 4) & 0x40) && c->length_counter) {
+      if (--c->length_counter == 0)
+        audio_disable_channel(a, s, ch, cycles);
+    }
+  }
+}
+
+static void audio_clock_sweep(struct audio* a, struct audio_state* s,
+    uint64_t cycles) {
+  if (--s->sweep_timer > 0)
+    return;
+
+  int period = (s->ch1_sweep >> 4) & 0x07;
+  s->sweep_timer = period ? period : 8;
+  if (!s->sweep_enabled || !period || !s->channels[0].enabled)
+    return;
+
+  int freq = audio_sweep_next_freq(s);
+  if (freq > 2047) {
+    audio_disable_channel(a, s, 0, cycles);
+    return;
+  }
+  if (s->ch1_sweep & 0x07) {
+    s->sweep_shadow_freq = freq;
+    s->ch1_freq_low = freq & 0xFF;
+    s->ch1_freq_high_control = (s->ch1_freq_high_control & 0xF8) | (freq >> 8);
+    if (audio_sweep_next_freq(s) > 2047)
+      audio_disable_channel(a, s, 0, cycles);
+  }
+}
+
+static void audio_clock_envelopes(struct audio* a, struct audio_state* s,
+    uint64_t cycles) {
+  static const int envelope_channels[3] = {0, 1, 3};
+  int x;
+  for (x = 0; x < 3; x++) {
+    int ch = envelope_channels[x];
+    struct audio_channel* c = &s->channels[ch];
+    int period = NR(s, ch, 2) & 0x07;
+    if (!period || (--c->envelope_timer > 0))
+      continue;
+
+    c->envelope_timer = period;
+    if ((NR(s, ch, 2) & 0x08) && (c->volume < 15))
+      c->volume++;
+    else if (!(NR(s, ch, 2) & 0x08) && (c->volume > 0))
+      c->volume--;
+    audio_set_channel_output(a, s, ch, cycles, audio_channel_output(s, ch));
+  }
+}
+
+// runs one frame sequencer step. envelopes are only clocked for the
+// synthesis state, since volume isn't readable
+static void audio_sequencer_step(struct audio* a, struct audio_state* s,
+    uint64_t cycles) {
+  if (!(s->control & 0x80))
+    return;
+
+  int step = s->frame_sequencer_step;
+  if (!(step & 1))
+    audio_clock_lengths(a, s, cycles);
+  if ((step == 2) || (step == 6))
+    audio_clock_sweep(a, s, cycles);
+  if ((step == 7) && s->is_synth)
+    audio_clock_envelopes(a, s, cycles);
+  s->frame_sequencer_step = (step + 1) & 7;
+}
+
+static uint64_t audio_sequencer_period(struct audio* a) {
+  return AUDIO_FRAME_SEQUENCER_CYCLES << is_double_speed_mode(a->cpu);
+}
+
+// the visible state's sequencer event only needs to run if a step could
+// change something visible in NR52: a length counter running out or the sweep
+// overflowing. length counters run even while their channels are off, since
+// a trigger doesn't reload them unless they've run out
+static int audio_sequencer_needed(struct audio* a) {
+  struct audio_state* s = &a->visible;
+  if (!(s->control & 0x80))
+    return 0;
+
+  int ch;
+  for (ch = 0; ch < 4; ch++) {
+    if ((NR(s, ch, 4) & 0x40) && s->channels[ch].length_counter)
+      return 1;
+  }
+  return s->channels[0].enabled && s->sweep_enabled && (s->ch1_sweep & 0x70);
+}
+
+static int audio_sequencer_scheduled(struct audio* a) {
+  return a->mem->sched.event_cycles[SCHEDULER_EVENT_AUDIO] != SCHEDULER_NEVER;
+}
+
+// brings the visible state's sequencer position up to date if its event
+// hasn't been running. none of the skipped steps could have done anything
+// visible, but the sweep timer still has to count them so the next sweep
+// happens at the right time
+static void audio_skip_sequencer_steps(struct audio* a, uint64_t cycles) {
+  struct audio_state* s = &a->visible;
+  if (audio_sequencer_scheduled(a) || (cycles < s->next_sequencer_cycles))
+    return;
+
+  uint64_t period = audio_sequencer_period(a);
+  uint64_t steps = (cycles - s->next_sequencer_cycles) / period + 1;
+  s->next_sequencer_cycles += steps * period;
+  if (!(s->control & 0x80))
+    return;
+
+  // the sweep is clocked on steps 2 and 6
+  uint64_t first_sweep = (2 - s->frame_sequencer_step) & 3;
+  if (steps > first_sweep) {
+    uint64_t sweeps = (steps - first_sweep - 1) / 4 + 1;
+    if (sweeps < (uint64_t)s->sweep_timer)
+      s->sweep_timer -= sweeps;
+    else {
+      int reload = ((s->ch1_sweep >> 4) & 0x07) ? ((s->ch1_sweep >> 4) & 0x07) : 8;
+      s->sweep_timer = reload - (sweeps - s->sweep_timer) % reload;
+    }
+  }
+  s->frame_sequencer_step = (s->frame_sequencer_step + steps) & 7;
+}
+
+static void audio_update_sequencer_event(struct audio* a) {
+  if (audio_sequencer_needed(a))
+    scheduler_schedule(&a->mem->sched, SCHEDULER_EVENT_AUDIO,
+        a->visible.next_sequencer_cycles);
+  else if (audio_sequencer_scheduled(a))
+    scheduler_cancel(&a->mem->sched, SCHEDULER_EVENT_AUDIO);
+}
+
+static void audio_frame_sequencer_event(void* context, uint64_t cycles) {
+  struct audio* a = (struct audio*)context;
+  audio_sequencer_step(a, &a->visible, cycles);
+  a->visible.next_sequencer_cycles = cycles + audio_sequencer_period(a);
+  audio_update_sequencer_event(a);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// synthesis
+
+// runs the synthesis state's channels and frame sequencer up to the given time
+static void audio_synth_advance(struct audio* a, uint64_t cycles) {
+  struct audio_state* s = &a->synth;
+  while (s->next_sequencer_cycles <= cycles) {
+    audio_run_channels(a, s, s->next_sequencer_cycles);
+    audio_sequencer_step(a, s, s->next_sequencer_cycles);
+    s->next_sequencer_cycles += audio_sequencer_period(a);
+  }
+  audio_run_channels(a, s, cycles);
+}
+
+// brings the synthesis state up to the given time, replaying logged writes
+// along the way, and passes the resulting samples to the callback
+static void audio_synthesize(struct audio* a, uint64_t cycles) {
+  size_t x;
+  for (x = 0; (x < a->num_logged_writes) && (a->write_log[x].cycles <= cycles); x++) {
+    const struct audio_write* w = &a->write_log[x];
+    audio_synth_advance(a, w->cycles);
+    audio_write_register(a, &a->synth, w->addr, w->value, w->cycles);
+  }
+  a->num_logged_writes -= x;
+  memmove(a->write_log, &a->write_log[x],
+      a->num_logged_writes * sizeof(a->write_log[0]));
+
+  audio_synth_advance(a, cycles);
+  audio_end_frame(a, cycles);
+  audio_update_samples_per_cycle(a, is_double_speed_mode(a->cpu));
+}
+
+static void audio_synthesis_event(void* context, uint64_t cycles) {
+  struct audio* a = (struct audio*)context;
+  audio_synthesize(a, cycles);
+  scheduler_schedule(&a->mem->sched, SCHEDULER_EVENT_AUDIO_SYNTH,
+      cycles + (AUDIO_SYNTH_INTERVAL_CYCLES << is_double_speed_mode(a->cpu)));
+}
+
+// starts a new output stream at the current time
+static void audio_reset_output(struct audio* a) {
+  a->blip_start_cycles = a->cpu->cycles;
+  a->blip_offset = 0;
+  memset(&a->left, 0, sizeof(a->left));
+  memset(&a->right, 0, sizeof(a->right));
+  audio_update_samples_per_cycle(a, is_double_speed_mode(a->cpu));
+
+  int ch;
+  for (ch = 0; ch < 4; ch++) {
+    a->synth.channels[ch].left_level = 0;
+    a->synth.channels[ch].right_level = 0;
+    audio_set_channel_output(a, &a->synth, ch, a->cpu->cycles,
+        a->synth.channels[ch].output);
+  }
+}
+
+// call before changing the mode or output. finishes off any pending synthesis
+static void audio_stop_synthesis(struct audio* a) {
+  if (!audio_synthesizing(a))
+    return;
+  audio_synthesize(a, a->cpu->cycles);
+  scheduler_cancel(&a->mem->sched, SCHEDULER_EVENT_AUDIO_SYNTH);
+}
+
+// call after changing the mode or output. the synthesis state starts out as a
+// copy of the visible state, with the waveforms moved forward to the present
+// (the visible state doesn't run them)
+static void audio_start_synthesis(struct audio* a) {
+  if (!audio_synthesizing(a))
+    return;
+
+  uint64_t cycles = a->cpu->cycles;
+  audio_skip_sequencer_steps(a, cycles);
+  a->synth = a->visible;
+  a->synth.is_synth = 1;
+  int ch;
+  for (ch = 0; ch < 4; ch++)
+    audio_skip_channel(a, &a->synth, ch, cycles);
+
+  audio_reset_output(a);
+  scheduler_schedule(&a->mem->sched, SCHEDULER_EVENT_AUDIO_SYNTH,
+      cycles + (AUDIO_SYNTH_INTERVAL_CYCLES << is_double_speed_mode(a->cpu)));
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// interface
+
+void audio_init(struct audio* a, struct regs* cpu, struct memory* m) {
+  pthread_once(&audio_blip_kernel_once, audio_build_blip_kernel);
 
-void audio_init(struct audio* a, struct regs* cpu) {
   memset(a, 0, sizeof(*a));
   a->cpu = cpu;
+  a->mem = m;
+
+  // these are the values the boot rom leaves behind (except that the boot
+  // sound has already finished)
+  static const uint8_t initial_regs[0x17] = {
+    0x80, 0xBF, 0xF3, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF,
+    0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF, 0x77, 0xF3, 0x80,
+  };
+  memcpy(&a->visible, initial_regs, sizeof(initial_regs));
+
+  a->sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+  a->mode = AUDIO_MODE_FULL;
+  a->visible.next_sequencer_cycles = cpu->cycles + AUDIO_FRAME_SEQUENCER_CYCLES;
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_AUDIO,
+      audio_frame_sequencer_event, a);
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_AUDIO_SYNTH,
+      audio_synthesis_event, a);
+}
+
+void audio_set_output(struct audio* a, unsigned int sample_rate,
+    void (*sample_cb)(void* arg, const int16_t* samples, size_t num_frames),
+    void* sample_cb_arg) {
+  audio_stop_synthesis(a);
+  a->sample_rate = sample_rate;
+  a->sample_cb = sample_cb;
+  a->sample_cb_arg = sample_cb_arg;
+  audio_start_synthesis(a);
 }
 
-void audio_update(struct audio* a, int cycles) {
-  // TODO
+void audio_set_mode(struct audio* a, int mode) {
+  audio_stop_synthesis(a);
+  a->mode = mode;
+  audio_start_synthesis(a);
+}
+
+void audio_flush(struct audio* a) {
+  if (audio_synthesizing(a))
+    audio_synthesize(a, a->cpu->cycles);
+}
+
+// a time that's still to come, after the cpu switches speed: the same real
+// time from now is twice as many cycles at double speed, or half as many at
+// normal speed
+static uint64_t audio_rescale_time(uint64_t time, uint64_t cycles,
+    int double_speed) {
+  if (time <= cycles)
+    return time;
+  return cycles + (double_speed ? (time - cycles) * 2 : (time - cycles) / 2);
+}
+
+void audio_speed_switch(struct audio* a) {
+  uint64_t cycles = a->cpu->cycles;
+  int double_speed = !is_double_speed_mode(a->cpu);
+
+  // everything up to now happened at the old speed
+  if (audio_synthesizing(a)) {
+    audio_synthesize(a, cycles);
+    struct audio_state* s = &a->synth;
+    s->next_sequencer_cycles = audio_rescale_time(s->next_sequencer_cycles,
+        cycles, double_speed);
+    int ch;
+    for (ch = 0; ch < 4; ch++)
+      s->channels[ch].next_step_cycles = audio_rescale_time(
+          s->channels[ch].next_step_cycles, cycles, double_speed);
+    audio_update_samples_per_cycle(a, double_speed);
+    scheduler_schedule(&a->mem->sched, SCHEDULER_EVENT_AUDIO_SYNTH,
+        cycles + (AUDIO_SYNTH_INTERVAL_CYCLES << double_speed));
+  }
+
+  audio_skip_sequencer_steps(a, cycles);
+  a->visible.next_sequencer_cycles = audio_rescale_time(
+      a->visible.next_sequencer_cycles, cycles, double_speed);
+  audio_update_sequencer_event(a);
+}
+
+void audio_set_rate_adjustment(struct audio* a, int ppm) {
+  a->rate_adjust_ppm = ppm;
+}
+
+void audio_skip_output(struct audio* a, uint64_t cycles) {
+  a->num_skipped_samples = 0;
+  if (!audio_synthesizing(a) || (cycles <= a->blip_start_cycles))
+    return;
+  a->num_skipped_samples = (a->blip_offset +
+      (cycles - a->blip_start_cycles) * a->samples_per_cycle) >> 32;
 }
 
 uint8_t read_audio_register(struct audio* a, uint8_t addr) {
-  if (addr < 0x10 || addr > 0x3F)
+  // unused and write-only bits read as 1
+  static const uint8_t read_masks[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF,
+    0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  };
+
+  if (addr < 0x10 || addr > 0x3F) {
     signal_debug_interrupt(a->cpu, "invalid audio reg read");
-  return ((uint8_t*)a)[addr - 0x10];
+    return 0xFF;
+  }
+
+  struct audio_state* s = &a->visible;
+  if (addr >= 0x30)
+    return s->ch3_wave_data[addr - 0x30];
+  if (addr == 0x26) {
+    audio_skip_sequencer_steps(a, a->cpu->cycles);
+    uint8_t ret = 0x70 | (s->control & 0x80);
+    int ch;
+    for (ch = 0; ch < 4; ch++)
+      if (s->channels[ch].enabled)
+        ret |= (1 << ch);
+    return ret;
+  }
+  return ((uint8_t*)s)[addr - 0x10] | read_masks[addr - 0x10];
 }
 
 void write_audio_register(struct audio* a, uint8_t addr, uint8_t value) {
-  if (addr < 0x10 || addr > 0x3F)
+  if (addr < 0x10 || addr > 0x3F) {
     signal_debug_interrupt(a->cpu, "invalid audio reg write");
-  ((uint8_t*)a)[addr - 0x10] = value;
+    return;
+  }
+
+  uint64_t cycles = a->cpu->cycles;
+  if (audio_synthesizing(a)) {
+    if (a->num_logged_writes == AUDIO_WRITE_LOG_SIZE)
+      audio_synthesize(a, cycles);
+    struct audio_write* w = &a->write_log[a->num_logged_writes++];
+    w->cycles = cycles;
+    w->addr = addr;
+    w->value = value;
+  }
+
+  audio_skip_sequencer_steps(a, cycles);
+  audio_write_register(a, &a->visible, addr, value, cycles);
+
+  // the write may have started or stopped something the sequencer affects
+  audio_update_sequencer_event(a);
 }
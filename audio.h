@@ -1,11 +1,57 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "cpu.h"
 
-struct audio {
+#define AUDIO_DEFAULT_SAMPLE_RATE  48000
+
+// in register-only mode, the apu only keeps track of what the cpu can see
+// through its registers (channel status bits and what turns them off), and
+// doesn't run the waveforms or make any samples. the frame sequencer event
+// then only runs while some channel's length counter or sweep could turn it
+// off, so a silent game costs nothing at all
+#define AUDIO_MODE_FULL            0
+#define AUDIO_MODE_REGISTERS_ONLY  1
+
+// the frame sequencer clocks lengths, sweep and envelopes at 512 Hz
+#define AUDIO_FRAME_SEQUENCER_CYCLES  8192
+
+// output is made with band-limited step synthesis: every time a channel's
+// level changes, a band-limited step of that size is added to the output
+// buffer at the (fractional) sample position where it happened, and the
+// buffer is integrated when samples are read out. this costs time per level
+// change and per output sample, not per cpu cycle. the step shape is a
+// windowed sinc with AUDIO_BLIP_TAPS taps, precomputed at AUDIO_BLIP_PHASES
+// fractional positions
+#define AUDIO_BLIP_PHASE_BITS  5
+#define AUDIO_BLIP_PHASES      (1 << AUDIO_BLIP_PHASE_BITS)
+#define AUDIO_BLIP_TAPS        16
+#define AUDIO_BLIP_SIZE        4096 // output samples
+
+struct audio_blip {
+  int32_t buffer[AUDIO_BLIP_SIZE + AUDIO_BLIP_TAPS];
+  int32_t sum; // integrator
+  int64_t highpass; // dc-blocking capacitor level (16.16 fixed-point)
+};
+
+struct audio_channel {
+  int enabled; // status bit in NR52
+  int length_counter;
+  int volume; // current envelope volume
+  int envelope_timer;
+  int position; // duty step (channels 1-2) or wave sample (channel 3)
+  int output; // digital output (0-15)
+  int32_t left_level; // output's current contribution to the mix
+  int32_t right_level;
+  uint64_t next_step_cycles;
+};
+
+// everything that determines what the apu does. there are two of these: one
+// that the cpu sees, and one that's used to make samples (see below)
+struct audio_state {
   uint8_t ch1_sweep;             // FF10
   uint8_t ch1_pattern_length;    // FF11
   uint8_t ch1_volume;            // FF12
@@ -32,12 +78,89 @@ struct audio {
   uint8_t unused3[0x09];         // FF27-FF2F; not readable, not writable
   uint8_t ch3_wave_data[0x10];   // FF30-FF3F
 
+  int is_synth; // this is the state that makes samples
+  struct audio_channel channels[4];
+  int frame_sequencer_step;
+  uint64_t next_sequencer_cycles;
+  int sweep_enabled; // channel 1 only
+  int sweep_timer;
+  int sweep_shadow_freq;
+  uint16_t noise_lfsr; // channel 4 only
+};
+
+// a register write waiting to be replayed into the synthesis state
+struct audio_write {
+  uint64_t cycles;
+  uint8_t addr;
+  uint8_t value;
+};
+
+// samples are made lazily. the cpu only ever touches the visible state, which
+// is kept up to date as in register-only mode (so reading NR52 is cheap), and
+// register writes are appended to a log. every AUDIO_SYNTH_INTERVAL_CYCLES
+// (or when the log fills up), the synthesis state catches up to the present
+// in one go, replaying the logged writes at the times they happened, and the
+// resulting samples are passed to the callback
+#define AUDIO_WRITE_LOG_SIZE          1024
+#define AUDIO_SYNTH_INTERVAL_CYCLES   65536 // must fit in AUDIO_BLIP_SIZE samples
+
+struct audio {
+  int mode;
+  struct audio_state visible;
+  struct audio_state synth;
+  struct audio_write write_log[AUDIO_WRITE_LOG_SIZE];
+  size_t num_logged_writes;
+
+  // output. if there's no callback (or in register-only mode), there's no
+  // synthesis state and nothing is logged
+  unsigned int sample_rate;
+  int rate_adjust_ppm; // makes slightly more or fewer samples than the rate
+  uint64_t samples_per_cycle; // 32.32 fixed-point
+  uint64_t blip_offset; // 32.32 sample position of blip_start_cycles
+  uint64_t blip_start_cycles;
+  struct audio_blip left;
+  struct audio_blip right;
+  int16_t samples[AUDIO_BLIP_SIZE * 2];
+  size_t num_skipped_samples; // made but not passed to the callback
+  void (*sample_cb)(void* arg, const int16_t* samples, size_t num_frames);
+  void* sample_cb_arg;
+
   struct regs* cpu;
+  struct memory* mem; // for scheduling the frame sequencer and synthesis
 };
 
-void audio_init(struct audio* a, struct regs* cpu);
+void audio_init(struct audio* a, struct regs* cpu, struct memory* m);
+void audio_set_output(struct audio* a, unsigned int sample_rate,
+    void (*sample_cb)(void* arg, const int16_t* samples, size_t num_frames),
+    void* sample_cb_arg);
+
+// makes samples up to the current time right away, instead of waiting for
+// the next synthesis interval. sinks that want samples at particular times
+// (e.g. once per video frame) can call this
+void audio_flush(struct audio* a);
+
+// switching out of register-only mode restarts each channel's waveform from
+// wherever it stopped, and envelope volumes from wherever they were at the
+// last trigger
+void audio_set_mode(struct audio* a, int mode);
+
+// called by the cpu just before it switches speed. the apu's timing is kept in
+// cpu cycles, so samples are made up to now at the old speed, and everything
+// still to come is moved to the same real time at the new speed
+void audio_speed_switch(struct audio* a);
+
+// speeds up (positive) or slows down (negative) sample production by this many
+// parts per million, starting at the next synthesis. this is for dynamic
+// rate control: small enough changes in pitch are inaudible, and it lets the
+// producer keep the output device's buffer at a steady level
+void audio_set_rate_adjustment(struct audio* a, int ppm);
+
+// drops the samples for times before the given cycle count instead of passing
+// them to the callback. after going back to an earlier state (e.g. restoring a
+// savestate), this keeps the samples that were already output from being
+// output again
+void audio_skip_output(struct audio* a, uint64_t cycles);
 
-void audio_update(struct audio* a, int cycles);
 uint8_t read_audio_register(struct audio* a, uint8_t addr);
 void write_audio_register(struct audio* a, uint8_t addr, uint8_t value);
 
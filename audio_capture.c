@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "audio_capture.h"
+
+#define AUDIO_CAPTURE_WAV_HEADER_SIZE  44
+
+static struct audio_capture_chunk* audio_capture_new_chunk() {
+  struct audio_capture_chunk* chunk = malloc(sizeof(*chunk));
+  if (chunk) {
+    atomic_init(&chunk->next, NULL);
+    chunk->size = 0;
+  }
+  return chunk;
+}
+
+static void put_le16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+  put_le16(p, v);
+  put_le16(p + 2, v >> 16);
+}
+
+// data_size is the number of bytes of samples following the header
+static void audio_capture_make_wav_header(uint8_t* header,
+    unsigned int sample_rate, uint64_t data_size) {
+  // sizes don't fit past 4GB; players generally handle the clamped value
+  if (data_size > 0xFFFFFFFFULL - 36)
+    data_size = 0xFFFFFFFFULL - 36;
+
+  memcpy(&header[0], "RIFF", 4);
+  put_le32(&header[4], 36 + data_size);
+  memcpy(&header[8], "WAVEfmt ", 8);
+  put_le32(&header[16], 16); // fmt chunk size
+  put_le16(&header[20], 1); // pcm
+  put_le16(&header[22], 2); // channels
+  put_le32(&header[24], sample_rate);
+  put_le32(&header[28], sample_rate * 4); // bytes per second
+  put_le16(&header[32], 4); // bytes per frame
+  put_le16(&header[34], 16); // bits per sample
+  memcpy(&header[36], "data", 4);
+  put_le32(&header[40], data_size);
+}
+
+// writes all chunks that have been published so far; returns 1 if any were
+static int audio_capture_write_chunks(struct audio_capture* c) {
+  int wrote = 0;
+  struct audio_capture_chunk* next;
+  while ((next = atomic_load_explicit(&c->head->next, memory_order_acquire))) {
+    if (!c->write_failed) {
+      if (fwrite(next->data, 1, next->size, c->file) != next->size) {
+        fprintf(stderr, "audio capture: write failed: %s\n", strerror(errno));
+        c->write_failed = 1;
+      } else
+        c->bytes_written += next->size;
+    }
+    free(c->head);
+    c->head = next;
+    wrote = 1;
+  }
+  return wrote;
+}
+
+static void* audio_capture_thread_fn(void* arg) {
+  struct audio_capture* c = (struct audio_capture*)arg;
+
+  // a chunk holds several seconds of audio even at full speed, so there's no
+  // need for anything fancier than polling
+  while (!atomic_load(&c->should_exit))
+    if (!audio_capture_write_chunks(c))
+      usleep(10000);
+
+  audio_capture_write_chunks(c);
+  return NULL;
+}
+
+int audio_capture_open(struct audio_capture* c, const char* filename,
+    unsigned int sample_rate) {
+  memset(c, 0, sizeof(*c));
+  c->sample_rate = sample_rate;
+  atomic_init(&c->should_exit, 0);
+
+  size_t name_len = strlen(filename);
+  c->format = ((name_len >= 4) && !strcasecmp(&filename[name_len - 4], ".wav")) ?
+      AUDIO_CAPTURE_WAV : AUDIO_CAPTURE_RAW;
+
+  c->file = fopen(filename, "wb");
+  if (!c->file) {
+    fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+
+  // the sizes in the header are filled in when the capture is closed
+  if (c->format == AUDIO_CAPTURE_WAV) {
+    uint8_t header[AUDIO_CAPTURE_WAV_HEADER_SIZE];
+    audio_capture_make_wav_header(header, sample_rate, 0);
+    fwrite(header, 1, sizeof(header), c->file);
+  }
+
+  c->head = audio_capture_new_chunk();
+  c->current = audio_capture_new_chunk();
+  if (!c->head || !c->current) {
+    fprintf(stderr, "failed to allocate audio capture buffers\n");
+    free(c->head);
+    free(c->current);
+    fclose(c->file);
+    return -1;
+  }
+  c->last_published = c->head;
+
+  if (pthread_create(&c->thread, NULL, audio_capture_thread_fn, c)) {
+    fprintf(stderr, "failed to create audio capture thread\n");
+    free(c->head);
+    free(c->current);
+    fclose(c->file);
+    return -1;
+  }
+  return 0;
+}
+
+static void audio_capture_publish(struct audio_capture* c) {
+  // release so the writer sees the chunk's contents when it sees the link
+  atomic_store_explicit(&c->last_published->next, c->current,
+      memory_order_release);
+  c->last_published = c->current;
+  c->current = audio_capture_new_chunk();
+}
+
+void audio_capture_write(struct audio_capture* c, const int16_t* samples,
+    size_t num_frames) {
+  size_t x;
+  for (x = 0; x < num_frames * 2; x++) {
+    if (!c->current)
+      return; // out of memory; nothing sensible to do but drop samples
+
+    put_le16(&c->current->data[c->current->size], samples[x]);
+    c->current->size += 2;
+    if (c->current->size == AUDIO_CAPTURE_CHUNK_SIZE)
+      audio_capture_publish(c);
+  }
+}
+
+void audio_capture_close(struct audio_capture* c) {
+  if (c->current && c->current->size)
+    audio_capture_publish(c);
+
+  atomic_store(&c->should_exit, 1);
+  pthread_join(c->thread, NULL);
+  free(c->head);
+  free(c->current);
+
+  if (c->format == AUDIO_CAPTURE_WAV) {
+    uint8_t header[AUDIO_CAPTURE_WAV_HEADER_SIZE];
+    audio_capture_make_wav_header(header, c->sample_rate, c->bytes_written);
+    fseek(c->file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), c->file);
+  }
+  fclose(c->file);
+
+  fprintf(stderr, "audio capture: %llu frames written\n",
+      (unsigned long long)(c->bytes_written / 4));
+}
@@ -0,0 +1,55 @@
+#ifndef AUDIO_CAPTURE_H
+#define AUDIO_CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// records everything the apu produces to a file. unlike the audio output
+// path, nothing is ever dropped or paced: samples are appended to large
+// chunks, and full chunks are handed to a writer thread through a lock-free
+// queue, so the emulation thread never waits on the disk no matter how fast
+// it runs. if the disk falls behind, chunks just pile up in memory.
+
+#define AUDIO_CAPTURE_RAW  0 // 16-bit little-endian stereo pcm, no header
+#define AUDIO_CAPTURE_WAV  1
+
+#define AUDIO_CAPTURE_CHUNK_SIZE  (1024 * 1024)
+
+struct audio_capture_chunk {
+  _Atomic(struct audio_capture_chunk*) next;
+  size_t size; // bytes of data used
+  uint8_t data[AUDIO_CAPTURE_CHUNK_SIZE];
+};
+
+struct audio_capture {
+  int format;
+  unsigned int sample_rate;
+  FILE* file;
+
+  // producer side. chunks are published by linking them after last_published
+  struct audio_capture_chunk* current;
+  struct audio_capture_chunk* last_published;
+
+  // writer side. head is the last chunk written (or the initial empty one);
+  // the writer frees it once it moves on to the next
+  struct audio_capture_chunk* head;
+  pthread_t thread;
+  atomic_int should_exit;
+  uint64_t bytes_written;
+  int write_failed;
+};
+
+// format is chosen from the file name: AUDIO_CAPTURE_WAV for names ending in
+// .wav, AUDIO_CAPTURE_RAW for anything else
+int audio_capture_open(struct audio_capture* c, const char* filename,
+    unsigned int sample_rate);
+void audio_capture_close(struct audio_capture* c);
+
+// called on the emulation thread
+void audio_capture_write(struct audio_capture* c, const int16_t* samples,
+    size_t num_frames);
+
+#endif // AUDIO_CAPTURE_H
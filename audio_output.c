@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "audio_output.h"
+
+static uint64_t audio_output_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// alsa
+
+#ifdef HAVE_ALSA
+
+// how much audio the device itself buffers
+#define AUDIO_OUTPUT_ALSA_LATENCY_USECS  40000
+
+static int audio_output_alsa_open(struct audio_output* o, const char* name) {
+  snd_pcm_t* pcm;
+  int err = snd_pcm_open(&pcm, name ? name : "default",
+      SND_PCM_STREAM_PLAYBACK, 0);
+  if (err < 0) {
+    fprintf(stderr, "failed to open audio device: %s\n", snd_strerror(err));
+    return -1;
+  }
+
+  err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+      2, o->sample_rate, 1, AUDIO_OUTPUT_ALSA_LATENCY_USECS);
+  if (err < 0) {
+    fprintf(stderr, "failed to configure audio device: %s\n", snd_strerror(err));
+    snd_pcm_close(pcm);
+    return -1;
+  }
+
+  o->pcm = pcm;
+  return 0;
+}
+
+// blocks until the device has taken the whole period
+static void audio_output_alsa_play(struct audio_output* o) {
+  const int16_t* samples = o->period;
+  snd_pcm_sframes_t remaining = AUDIO_OUTPUT_PERIOD_FRAMES;
+  while (remaining > 0) {
+    snd_pcm_sframes_t written = snd_pcm_writei((snd_pcm_t*)o->pcm, samples,
+        remaining);
+    if (written < 0) {
+      if (written == -EPIPE)
+        atomic_fetch_add(&o->device_underruns, 1);
+      if (snd_pcm_recover((snd_pcm_t*)o->pcm, written, 1) < 0)
+        return;
+      continue;
+    }
+    samples += written * 2;
+    remaining -= written;
+  }
+}
+
+static void audio_output_alsa_close(struct audio_output* o) {
+  snd_pcm_drop((snd_pcm_t*)o->pcm);
+  snd_pcm_close((snd_pcm_t*)o->pcm);
+}
+
+#endif
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// output thread
+
+static void* audio_output_thread_fn(void* arg) {
+  struct audio_output* o = (struct audio_output*)arg;
+
+  // the null and file sinks play a period every this many nanoseconds
+  uint64_t period_ns = (uint64_t)AUDIO_OUTPUT_PERIOD_FRAMES * 1000000000ULL /
+      o->sample_rate;
+  uint64_t next_period_time = audio_output_now();
+  int primed = 0;
+
+  while (!atomic_load(&o->should_exit)) {
+    // play silence until there's enough buffered to ride out some jitter in
+    // the producer; this is what sets the output latency
+    if (!primed && (audio_ring_fill(&o->ring) >= AUDIO_OUTPUT_TARGET_FRAMES))
+      primed = 1;
+    if (!primed)
+      memset(o->period, 0, sizeof(o->period));
+    else if (audio_ring_read(&o->ring, o->period, AUDIO_OUTPUT_PERIOD_FRAMES) <
+        AUDIO_OUTPUT_PERIOD_FRAMES)
+      primed = 0;
+
+#ifdef HAVE_ALSA
+    if (o->type == AUDIO_OUTPUT_ALSA)
+      audio_output_alsa_play(o);
+    else
+#endif
+    {
+      if (o->type == AUDIO_OUTPUT_FILE)
+        fwrite(o->period, sizeof(int16_t) * 2, AUDIO_OUTPUT_PERIOD_FRAMES,
+            o->file);
+
+      next_period_time += period_ns;
+      uint64_t t = audio_output_now();
+      if (t < next_period_time) {
+        struct timespec ts;
+        ts.tv_sec = (next_period_time - t) / 1000000000ULL;
+        ts.tv_nsec = (next_period_time - t) % 1000000000ULL;
+        while (nanosleep(&ts, &ts) && (errno == EINTR));
+      } else if (t > next_period_time + 4 * period_ns)
+        next_period_time = t; // don't try to make up a long stall
+    }
+
+    atomic_fetch_add(&o->device_clock_seq, 1);
+    atomic_fetch_add(&o->device_frames, AUDIO_OUTPUT_PERIOD_FRAMES);
+    atomic_store(&o->device_frames_time, audio_output_now());
+    atomic_fetch_add(&o->device_clock_seq, 1);
+  }
+  return NULL;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// interface
+
+int audio_output_open(struct audio_output* o, int type, const char* name,
+    unsigned int sample_rate) {
+  memset(o, 0, sizeof(*o));
+  o->type = type;
+  o->sample_rate = sample_rate;
+  atomic_init(&o->should_exit, 0);
+  atomic_init(&o->device_underruns, 0);
+  atomic_init(&o->device_clock_seq, 0);
+  atomic_init(&o->device_frames, 0);
+  atomic_init(&o->device_frames_time, audio_output_now());
+
+  if (audio_ring_init(&o->ring, AUDIO_OUTPUT_RING_FRAMES)) {
+    fprintf(stderr, "failed to allocate audio ring\n");
+    return -1;
+  }
+
+  if (type == AUDIO_OUTPUT_FILE) {
+    o->file = fopen(name, "wb");
+    if (!o->file) {
+      fprintf(stderr, "failed to open %s: %s\n", name, strerror(errno));
+      audio_ring_free(&o->ring);
+      return -1;
+    }
+  } else if (type == AUDIO_OUTPUT_ALSA) {
+#ifdef HAVE_ALSA
+    if (audio_output_alsa_open(o, name)) {
+      audio_ring_free(&o->ring);
+      return -1;
+    }
+#else
+    fprintf(stderr, "alsa audio output isn\'t available in this build\n");
+    audio_ring_free(&o->ring);
+    return -1;
+#endif
+  }
+
+  if (pthread_create(&o->thread, NULL, audio_output_thread_fn, o)) {
+    fprintf(stderr, "failed to create audio output thread\n");
+    audio_output_close(o);
+    return -1;
+  }
+  return 0;
+}
+
+void audio_output_close(struct audio_output* o) {
+  if (o->thread) {
+    atomic_store(&o->should_exit, 1);
+    pthread_join(o->thread, NULL);
+    o->thread = 0;
+  }
+
+  if (o->file) {
+    fclose(o->file);
+    o->file = NULL;
+  }
+#ifdef HAVE_ALSA
+  if (o->pcm) {
+    audio_output_alsa_close(o);
+    o->pcm = NULL;
+  }
+#endif
+  audio_ring_free(&o->ring);
+}
+
+void audio_output_write(void* arg, const int16_t* samples, size_t num_frames) {
+  struct audio_output* o = (struct audio_output*)arg;
+  audio_ring_write(&o->ring, samples, num_frames);
+}
+
+uint64_t audio_output_clock(void* arg) {
+  struct audio_output* o = (struct audio_output*)arg;
+
+  // retry if the output thread updated the clock while we were reading it
+  uint64_t seq, frames, time;
+  do {
+    seq = atomic_load(&o->device_clock_seq);
+    frames = atomic_load(&o->device_frames);
+    time = atomic_load(&o->device_frames_time);
+  } while ((seq & 1) || (seq != atomic_load(&o->device_clock_seq)));
+
+  // the device plays continuously, but the count only moves once per period,
+  // so fill in between with the monotonic clock (but never past the period,
+  // so the clock doesn't run backward if the next period is late)
+  uint64_t period_ns = (uint64_t)AUDIO_OUTPUT_PERIOD_FRAMES * 1000000000ULL /
+      o->sample_rate;
+  uint64_t since = audio_output_now() - time;
+  if (since > period_ns)
+    since = period_ns;
+  return frames * 1000000000ULL / o->sample_rate + since;
+}
+
+int audio_output_rate_adjustment(struct audio_output* o) {
+  // linear in the fill level's distance from the target: the full adjustment
+  // when the ring is empty or twice the target, none when it's on target
+  int64_t fill = audio_ring_fill(&o->ring);
+  if (fill > 2 * AUDIO_OUTPUT_TARGET_FRAMES)
+    fill = 2 * AUDIO_OUTPUT_TARGET_FRAMES;
+  return (int)((AUDIO_OUTPUT_TARGET_FRAMES - fill) *
+      AUDIO_OUTPUT_MAX_RATE_ADJUST_PPM / AUDIO_OUTPUT_TARGET_FRAMES);
+}
+
+void audio_output_print_stats(FILE* f, struct audio_output* o) {
+  fprintf(f, "audio output: %llu frames played, %llu underruns (%llu frames), "
+      "%llu overruns (%llu frames dropped), %llu device underruns\n",
+      (unsigned long long)atomic_load(&o->ring.read_pos),
+      (unsigned long long)atomic_load(&o->ring.num_underruns),
+      (unsigned long long)atomic_load(&o->ring.underrun_frames),
+      (unsigned long long)atomic_load(&o->ring.num_overruns),
+      (unsigned long long)atomic_load(&o->ring.overrun_frames),
+      (unsigned long long)atomic_load(&o->device_underruns));
+}
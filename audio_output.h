@@ -0,0 +1,73 @@
+#ifndef AUDIO_OUTPUT_H
+#define AUDIO_OUTPUT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "audio_ring.h"
+
+// samples from the apu go through a lock-free ring to a thread that feeds the
+// output device, so the emulation thread never waits on the device. the null
+// and file sinks consume samples at the same rate a real device would (the
+// file sink writes exactly what would have been played, including silence
+// from underruns), so the whole path can be exercised without a sound card.
+
+#define AUDIO_OUTPUT_NULL  0 // discards samples
+#define AUDIO_OUTPUT_FILE  1 // writes raw 16-bit native-endian stereo pcm
+#define AUDIO_OUTPUT_ALSA  2 // only available if built with -DHAVE_ALSA
+
+#define AUDIO_OUTPUT_PERIOD_FRAMES  512
+#define AUDIO_OUTPUT_RING_FRAMES    8192
+
+// how full the ring is kept. playback doesn't start (or restart after an
+// underrun) until the ring has this much in it, and dynamic rate control
+// steers the fill level back toward it
+#define AUDIO_OUTPUT_TARGET_FRAMES  2048
+
+// the most dynamic rate control will change the sample rate by
+#define AUDIO_OUTPUT_MAX_RATE_ADJUST_PPM  5000
+
+struct audio_output {
+  int type;
+  unsigned int sample_rate;
+  struct audio_ring ring;
+
+  pthread_t thread;
+  atomic_int should_exit;
+  FILE* file; // AUDIO_OUTPUT_FILE only
+  void* pcm; // snd_pcm_t*; AUDIO_OUTPUT_ALSA only
+  atomic_uint_fast64_t device_underruns; // reported by the device itself
+
+  // the device's clock: how many frames it has played (including silence)
+  // and the monotonic time when that count last changed. the sequence number
+  // is odd while they're being updated
+  atomic_uint_fast64_t device_clock_seq;
+  atomic_uint_fast64_t device_frames;
+  atomic_uint_fast64_t device_frames_time;
+
+  int16_t period[AUDIO_OUTPUT_PERIOD_FRAMES * 2]; // only used by the thread
+};
+
+// name is the file name for AUDIO_OUTPUT_FILE or the device name for
+// AUDIO_OUTPUT_ALSA (NULL means "default"); it's ignored for AUDIO_OUTPUT_NULL
+int audio_output_open(struct audio_output* o, int type, const char* name,
+    unsigned int sample_rate);
+void audio_output_close(struct audio_output* o);
+
+// called on the emulation thread; matches the apu's sample callback
+void audio_output_write(void* arg, const int16_t* samples, size_t num_frames);
+
+// returns the device's playback position in nanoseconds, interpolated between
+// periods. this can be used as a frame pacer clock to lock emulation speed to
+// the audio device's sample clock
+uint64_t audio_output_clock(void* arg);
+
+// returns how much the producer should adjust its sample rate (in parts per
+// million) to bring the ring back toward AUDIO_OUTPUT_TARGET_FRAMES
+int audio_output_rate_adjustment(struct audio_output* o);
+
+void audio_output_print_stats(FILE* f, struct audio_output* o);
+
+#endif // AUDIO_OUTPUT_H
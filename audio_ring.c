@@ -0,0 +1,109 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_ring.h"
+
+int audio_ring_init(struct audio_ring* r, size_t capacity) {
+  memset(r, 0, sizeof(*r));
+
+  r->capacity = 1;
+  while (r->capacity < capacity)
+    r->capacity <<= 1;
+  r->samples = calloc(r->capacity * 2, sizeof(int16_t));
+  if (!r->samples)
+    return -1;
+
+  atomic_init(&r->write_pos, 0);
+  atomic_init(&r->read_pos, 0);
+  atomic_init(&r->num_overruns, 0);
+  atomic_init(&r->overrun_frames, 0);
+  atomic_init(&r->num_underruns, 0);
+  atomic_init(&r->underrun_frames, 0);
+  return 0;
+}
+
+void audio_ring_free(struct audio_ring* r) {
+  free(r->samples);
+  r->samples = NULL;
+}
+
+size_t audio_ring_fill(struct audio_ring* r) {
+  uint64_t read_pos = atomic_load_explicit(&r->read_pos, memory_order_acquire);
+  uint64_t write_pos = atomic_load_explicit(&r->write_pos, memory_order_acquire);
+  return write_pos - read_pos;
+}
+
+// where frames at pos start in the ring, and how many of num_frames fit before
+// it wraps around
+static size_t audio_ring_first_part(const struct audio_ring* r, uint64_t pos,
+    size_t num_frames, size_t* offset) {
+  *offset = pos & (r->capacity - 1);
+  size_t first = r->capacity - *offset;
+  return (first > num_frames) ? num_frames : first;
+}
+
+// copies frames from a linear buffer into the ring, handling wraparound
+static void audio_ring_copy_in(struct audio_ring* r, uint64_t pos,
+    const int16_t* samples, size_t num_frames) {
+  size_t offset;
+  size_t first = audio_ring_first_part(r, pos, num_frames, &offset);
+  memcpy(&r->samples[offset * 2], samples, first * 2 * sizeof(int16_t));
+  memcpy(r->samples, &samples[first * 2],
+      (num_frames - first) * 2 * sizeof(int16_t));
+}
+
+// copies frames from the ring into a linear buffer, handling wraparound
+static void audio_ring_copy_out(const struct audio_ring* r, uint64_t pos,
+    int16_t* samples, size_t num_frames) {
+  size_t offset;
+  size_t first = audio_ring_first_part(r, pos, num_frames, &offset);
+  memcpy(samples, &r->samples[offset * 2], first * 2 * sizeof(int16_t));
+  memcpy(&samples[first * 2], r->samples,
+      (num_frames - first) * 2 * sizeof(int16_t));
+}
+
+size_t audio_ring_write(struct audio_ring* r, const int16_t* samples,
+    size_t num_frames) {
+  uint64_t write_pos = atomic_load_explicit(&r->write_pos, memory_order_relaxed);
+  uint64_t read_pos = atomic_load_explicit(&r->read_pos, memory_order_acquire);
+  size_t space = r->capacity - (write_pos - read_pos);
+
+  size_t count = num_frames;
+  if (count > space) {
+    count = space;
+    atomic_fetch_add_explicit(&r->num_overruns, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->overrun_frames, num_frames - count,
+        memory_order_relaxed);
+  }
+
+  // release so the consumer sees the samples before it sees the new position
+  audio_ring_copy_in(r, write_pos, samples, count);
+  atomic_store_explicit(&r->write_pos, write_pos + count, memory_order_release);
+  return count;
+}
+
+size_t audio_ring_read(struct audio_ring* r, int16_t* samples,
+    size_t num_frames) {
+  uint64_t read_pos = atomic_load_explicit(&r->read_pos, memory_order_relaxed);
+  uint64_t write_pos = atomic_load_explicit(&r->write_pos, memory_order_acquire);
+  size_t available = write_pos - read_pos;
+
+  size_t count = num_frames;
+  if (count > available) {
+    count = available;
+    memset(&samples[count * 2], 0, (num_frames - count) * 2 * sizeof(int16_t));
+
+    // running dry before the producer has started isn't an underrun
+    if (write_pos) {
+      atomic_fetch_add_explicit(&r->num_underruns, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&r->underrun_frames, num_frames - count,
+          memory_order_relaxed);
+    }
+  }
+
+  // release so the producer doesn't overwrite the frames until we're done
+  audio_ring_copy_out(r, read_pos, samples, count);
+  atomic_store_explicit(&r->read_pos, read_pos + count, memory_order_release);
+  return count;
+}
@@ -0,0 +1,45 @@
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// lock-free single-producer/single-consumer ring of interleaved stereo
+// samples. neither side ever blocks: if the producer writes more than fits,
+// the excess is dropped and counted as an overrun, and if the consumer asks
+// for more than is available, the rest is filled with silence and counted as
+// an underrun.
+
+struct audio_ring {
+  int16_t* samples;
+  size_t capacity; // in frames (stereo pairs); always a power of 2
+
+  // total frames ever written and read. each is only stored by its own side,
+  // so the difference is always the number of frames in the ring
+  atomic_uint_fast64_t write_pos;
+  atomic_uint_fast64_t read_pos;
+
+  atomic_uint_fast64_t num_overruns;
+  atomic_uint_fast64_t overrun_frames;
+  atomic_uint_fast64_t num_underruns;
+  atomic_uint_fast64_t underrun_frames;
+};
+
+// capacity is rounded up to a power of 2
+int audio_ring_init(struct audio_ring* r, size_t capacity);
+void audio_ring_free(struct audio_ring* r);
+
+// number of frames currently in the ring; callable from either side
+size_t audio_ring_fill(struct audio_ring* r);
+
+// producer side. returns the number of frames actually written
+size_t audio_ring_write(struct audio_ring* r, const int16_t* samples,
+    size_t num_frames);
+
+// consumer side. always fills all num_frames; returns how many of them came
+// from the ring
+size_t audio_ring_read(struct audio_ring* r, int16_t* samples,
+    size_t num_frames);
+
+#endif // AUDIO_RING_H
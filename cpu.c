@@ -3,9 +3,9 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "audio.h"
 #include "cpu.h"
 #include "debug.h"
-#include "terminal.h"
 
 
 
@@ -62,7 +62,7 @@ static inline uint8_t read_x_value(struct regs* r, struct memory* m, int x) {
   if (x == 5)
     return r->l;
   if (x == 6)
-    return read8(m, r->hl);
+    return cpu_read8(m, r->hl);
   if (x == 7)
     return r->a;
   return 0; // TODO: should probably fail here in some way
@@ -82,51 +82,51 @@ static inline void write_x_value(struct regs* r, struct memory* m, int x, uint8_
   else if (x == 5)
     r->l = value;
   else if (x == 6)
-    write8(m, r->hl, value);
+    cpu_write8(m, r->hl, value);
   else if (x == 7)
     r->a = value;
 }
 
 static inline uint8_t read_e_value(struct regs* r, struct memory* m, int e) {
   if (e == 0)
-    return read8(m, r->bc);
+    return cpu_read8(m, r->bc);
   if (e == 1)
-    return read8(m, r->de);
+    return cpu_read8(m, r->de);
   if (e == 2)
-    return read8(m, r->hl++);
+    return cpu_read8(m, r->hl++);
   if (e == 3)
-    return read8(m, r->hl--);
+    return cpu_read8(m, r->hl--);
   return 0; // TODO: should probably fail here in some way
 }
 
 static inline void write_e_value(struct regs* r, struct memory* m, int e, uint8_t value) {
   if (e == 0)
-    write8(m, r->bc, value);
+    cpu_write8(m, r->bc, value);
   else if (e == 1)
-    write8(m, r->de, value);
+    cpu_write8(m, r->de, value);
   else if (e == 2)
-    write8(m, r->hl++, value);
+    cpu_write8(m, r->hl++, value);
   else if (e == 3)
-    write8(m, r->hl--, value);
+    cpu_write8(m, r->hl--, value);
 }
 
 static inline uint8_t ifetch(struct regs* r, struct memory* m) {
-  return read8(m, r->pc++);
+  return cpu_read8(m, r->pc++);
 }
 
 static inline uint16_t ifetch_word(struct regs* r, struct memory* m) {
-  register int v = read16(m, r->pc);
+  register int v = cpu_read16(m, r->pc);
   r->pc += 2;
   return v;
 }
 
 static inline void stack_push(struct regs* r, struct memory* m, uint16_t value) {
   r->sp -= 2;
-  write16(m, r->sp, value);
+  cpu_write16(m, r->sp, value);
 }
 
 static inline uint16_t stack_pop(struct regs* r, struct memory* m) {
-  register uint16_t v = read16(m, r->sp);
+  register uint16_t v = cpu_read16(m, r->sp);
   r->sp += 2;
   return v;
 }
@@ -176,7 +176,7 @@ static inline int16_t sign_extend(uint8_t x) {
 void run_op_nop(struct regs* r, struct memory* m, uint8_t op) { }
 
 void run_op_ld_a16_sp(struct regs* r, struct memory* m, uint8_t op) {
-  write16(m, ifetch_word(r, m), r->sp);
+  cpu_write16(m, ifetch_word(r, m), r->sp);
 }
 
 void run_op_stop(struct regs* r, struct memory* m, uint8_t op) {
@@ -185,6 +185,9 @@ void run_op_stop(struct regs* r, struct memory* m, uint8_t op) {
     printf("warning: stopped with ime disabled\n");
 
   if (r->speed_switch & 0x01) {
+    struct audio* a = (struct audio*)m->devices[DEVICE_AUDIO];
+    if (a)
+      audio_speed_switch(a);
     r->speed_switch = (r->speed_switch ^ 0x80) & 0x80;
     r->stop = 0;
   }
@@ -386,7 +389,7 @@ void run_op_ret_y(struct regs* r, struct memory* m, uint8_t op) {
 }
 
 void run_op_ldh_ff00_a8_a(struct regs* r, struct memory* m, uint8_t op) {
-  write8(m, 0xFF00 + ifetch(r, m), r->a);
+  cpu_write8(m, 0xFF00 + ifetch(r, m), r->a);
 }
 
 void run_op_add_sp_r8(struct regs* r, struct memory* m, uint8_t op) {
@@ -408,7 +411,7 @@ void run_op_add_sp_r8(struct regs* r, struct memory* m, uint8_t op) {
 }
 
 void run_op_ldh_a_ff00_a8(struct regs* r, struct memory* m, uint8_t op) {
-  r->a = read8(m, 0xFF00 + ifetch(r, m));
+  r->a = cpu_read8(m, 0xFF00 + ifetch(r, m));
 }
 
 void run_op_ld_hl_sp_r8(struct regs* r, struct memory* m, uint8_t op) {
@@ -460,23 +463,23 @@ void run_op_jp_y_a16(struct regs* r, struct memory* m, uint8_t op) {
 }
 
 void run_op_ld_ff00_c_a(struct regs* r, struct memory* m, uint8_t op) {
-  write8(m, 0xFF00 + r->c, r->a);
+  cpu_write8(m, 0xFF00 + r->c, r->a);
 }
 
 void run_op_ld_a16_a(struct regs* r, struct memory* m, uint8_t op) {
-  write8(m, ifetch_word(r, m), r->a);
+  cpu_write8(m, ifetch_word(r, m), r->a);
 }
 
 void run_op_ld_a_ff00_c(struct regs* r, struct memory* m, uint8_t op) {
-  r->a = read8(m, 0xFF00 + r->c);
+  r->a = cpu_read8(m, 0xFF00 + r->c);
 }
 
 void run_op_ld_a_a16(struct regs* r, struct memory* m, uint8_t op) {
-  r->a = read8(m, ifetch_word(r, m));
+  r->a = cpu_read8(m, ifetch_word(r, m));
 }
 
 void run_op_jp_a16(struct regs* r, struct memory* m, uint8_t op) {
-  r->pc = read16(m, r->pc);
+  r->pc = cpu_read16(m, r->pc);
 }
 
 void run_op_di(struct regs* r, struct memory* m, uint8_t op) {
@@ -1298,11 +1301,12 @@ int run_cycle(struct regs* r, struct memory* m) {
 }
 
 int run_cycles(struct regs* cpu, struct memory* mem, uint64_t num_cycles) {
-  while (num_cycles && (!cpu->stop_after_cycles || (cpu->cycles < cpu->stop_after_cycles))) {
+  uint64_t end_cycles = cpu->cycles + num_cycles;
+  while ((cpu->cycles < end_cycles) &&
+         (!cpu->stop_after_cycles || (cpu->cycles < cpu->stop_after_cycles))) {
     int err = run_cycle(cpu, mem);
     if (err)
       return err;
-    num_cycles--;
   }
   return 0;
 }
@@ -1504,14 +1508,6 @@ static int print_opcode(FILE* f, const uint8_t* opcode_data, struct memory* m) {
   return ret;
 }
 
-#define setup_color_if_true(cond) \
-  do { \
-    if (cond) \
-      change_color(FORMAT_FG_MAGENTA, FORMAT_BOLD, FORMAT_END); \
-    else \
-      change_color(FORMAT_NORMAL, FORMAT_END); \
-  } while (0)
-
 #define print_reg_value(regname, format) \
   do { \
     printf(" " #regname "=" format, r->regname); \
@@ -1536,7 +1532,6 @@ void print_regs(const struct regs* r, struct memory* m) {
   print_reg_value(interrupt_enable, "%02X");
   print_reg_value(interrupt_flag, "%02X");
   print_reg_value(pc, "%04X");
-  change_color(FORMAT_NORMAL, FORMAT_END);
   printf(" code=%02X%02X%02X", code_data[0], code_data[1], code_data[2]);
 
   int x;
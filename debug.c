@@ -7,10 +7,14 @@
 #include "cpu.h"
 #include "debug.h"
 #include "display.h"
+#include "input.h"
 
 void debug_main(struct regs* r, struct memory* m) {
 
-  display_pause((struct display*)m->devices[DEVICE_DISPLAY]);
+  // the input thread may be reading the terminal, which the pager needs
+  struct input* inp = (struct input*)m->devices[DEVICE_INPUT];
+  if (inp)
+    input_pause_thread(inp);
 
   char filename[L_tmpnam];
   tmpnam(filename);
@@ -40,5 +44,6 @@ void debug_main(struct regs* r, struct memory* m) {
 
   unlink(filename);
 
-  display_resume((struct display*)m->devices[DEVICE_DISPLAY]);
+  if (inp)
+    input_resume_thread(inp);
 }
@@ -1,33 +1,78 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
-#ifdef MACOSX
-#include "OpenGL/gl.h"
-#include "OpenGL/glu.h"
-#include "GLUT/glut.h"
-#else
-#include "GL/gl.h"
-#include "GL/glu.h"
-#include "GL/glut.h"
-#endif
-
 #include "display.h"
 #include "cpu.h"
 #include "mmu.h"
-#include "util.h"
 
-void display_pause(struct display* d) {
-  d->pause_time = now();
+static uint32_t display_color_lut[2][0x8000];
+static pthread_once_t display_color_lut_once = PTHREAD_ONCE_INIT;
+
+static void display_build_color_luts() {
+  int color;
+  for (color = 0; color < 0x8000; color++) {
+    int r = color & 0x1F, g = (color >> 5) & 0x1F, b = (color >> 10) & 0x1F;
+
+    // uncorrected: just expand each 5-bit channel to 8 bits
+    display_color_lut[0][color] = DISPLAY_PIXEL((r << 3) | (r >> 2),
+        (g << 3) | (g >> 2), (b << 3) | (b >> 2));
+
+    // corrected: approximate the CGB LCD's channel mixing and lower contrast
+    int cr = r * 26 + g * 4 + b * 2;
+    int cg = g * 24 + b * 8;
+    int cb = r * 6 + g * 4 + b * 22;
+    display_color_lut[1][color] = DISPLAY_PIXEL((cr > 960 ? 960 : cr) >> 2,
+        (cg > 960 ? 960 : cg) >> 2, (cb > 960 ? 960 : cb) >> 2);
+  }
+}
+
+static void display_update_dmg_palette(uint32_t host_colors[4],
+    uint8_t palette) {
+  static const uint32_t shades[] = {
+    DISPLAY_PIXEL(0xFF, 0xFF, 0xFF),
+    DISPLAY_PIXEL(0xAA, 0xAA, 0xAA),
+    DISPLAY_PIXEL(0x55, 0x55, 0x55),
+    DISPLAY_PIXEL(0x00, 0x00, 0x00),
+  };
+
+  int x;
+  for (x = 0; x < 4; x++)
+    host_colors[x] = shades[(palette >> (x * 2)) & 3];
 }
 
-void display_resume(struct display* d) {
-  d->last_vblank_time += (now() - d->pause_time);
+// palette bytes come in pairs, so this updates the host color for the entry
+// containing the given byte
+static void display_update_cgb_color(const struct display* d,
+    uint32_t host_colors[8][4], const uint16_t* colors, int byte_index) {
+  int color_index = (byte_index & 0x3F) >> 1;
+  host_colors[color_index >> 2][color_index & 3] =
+      d->color_lut[colors[color_index] & 0x7FFF];
 }
 
+void display_set_color_correction(struct display* d, int enable) {
+  pthread_once(&display_color_lut_once, display_build_color_luts);
+  d->color_lut = display_color_lut[enable ? 1 : 0];
+
+  if (d->cgb_mode) {
+    int x;
+    for (x = 0; x < 0x40; x += 2) {
+      display_update_cgb_color(d, d->bg_host_colors, d->bg_colors, x);
+      display_update_cgb_color(d, d->sprite_host_colors, d->sprite_colors, x);
+    }
+  } else {
+    display_update_dmg_palette(d->bg_host_colors[0], d->bg_palette);
+    display_update_dmg_palette(d->sprite_host_colors[0], d->palette0);
+    display_update_dmg_palette(d->sprite_host_colors[1], d->palette1);
+  }
+}
+
+static void display_event(void* context, uint64_t cycles);
+
 void display_init(struct display* d, struct regs* cpu, struct memory* m,
     uint64_t render_freq, void (*display_cb)(struct display* d, void* param),
     void* display_cb_arg) {
@@ -35,26 +80,34 @@ void display_init(struct display* d, struct regs* cpu, struct memory* m,
   memset(d, 0, sizeof(*d));
   d->cpu = cpu;
   d->mem = m;
+  d->cgb_mode = !!(m->cart->header.cgb_flag & 0x80);
   d->render_freq = render_freq;
-  d->wait_vblank = 1;
-  d->last_vblank_time = now();
+  d->render_current_frame = (render_freq != 0);
   d->display_cb = display_cb;
   d->display_cb_arg = display_cb_arg;
 
+  // these are the values the boot rom leaves behind
+  d->bg_palette = 0xFC;
+  d->palette0 = 0xFF;
+  d->palette1 = 0xFF;
+
   int x;
   for (x = 0; x < 0x20; x++)
     d->bg_colors[x] = 0x7FFF;
+
+  display_set_color_correction(d, 0);
+
+  // the lcd starts out off, so nothing is scheduled until it's turned on
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_DISPLAY, display_event, d);
 }
 
-static void decode_tile(uint16_t* tile, uint8_t out[8][8]) {
-  int x, y;
-  for (y = 0; y < 8; y++) {
-    for (x = 0; x < 8; x++) {
-      int low_bit = ((tile[y] >> 8) >> (7 - x)) & 1;
-      int high_bit = (tile[y] >> (7 - x)) & 1;
-      int overall = (high_bit << 1) | low_bit;
-      out[y][x] = overall;
-    }
+// decodes one row of a tile (2 bytes) into 8 color ids
+static inline void decode_tile_row(const uint8_t* row, int xflip,
+    uint8_t out[8]) {
+  int x;
+  for (x = 0; x < 8; x++) {
+    int shift = xflip ? x : (7 - x);
+    out[x] = (((row[1] >> shift) & 1) << 1) | ((row[0] >> shift) & 1);
   }
 }
 
@@ -70,154 +123,419 @@ struct sprite_info {
 #define SPRITE_FLAG_XFLIP          0x20
 #define SPRITE_FLAG_USE_PALETTE1   0x10 // Non-CGB only
 #define SPRITE_FLAG_VRAM_BANK1     0x08 // CGB only
+#define SPRITE_FLAG_CGB_PALETTE    0x07 // CGB only
 
-static void display_update_line(struct display* d, int y) {
+// background map attributes (vram bank 1; CGB only)
+#define BG_ATTR_PRIORITY           0x80
+#define BG_ATTR_YFLIP              0x40
+#define BG_ATTR_XFLIP              0x20
+#define BG_ATTR_VRAM_BANK1         0x08
+#define BG_ATTR_PALETTE            0x07
+
+#ifndef DISPLAY_PIXEL_FIFO
+
+// register values used to draw (part of) a line
+struct display_line_regs {
+  uint8_t control;
+  uint8_t scy;
+  uint8_t scx;
+  uint8_t wx;
+  const uint32_t (*bg_host_colors)[4];
+  const uint32_t (*sprite_host_colors)[4];
+};
+
+// draws background or window pixels [x_start, x_end) from one row of a tile
+// map. map_x is the map pixel coordinate that corresponds to x_start, and
+// map_y is the pixel row within the map
+static void display_draw_tiles(struct display* d, int y, int x_start,
+    int x_end, const uint8_t* tile_map, int map_x, int map_y,
+    const struct display_line_regs* regs, uint8_t bg_priority[160]) {
+
+  uint32_t* line = d->image[y];
+  uint16_t* color_ids = d->image_color_ids[y];
+  const uint8_t* vram = d->mem->vram;
+  const uint8_t* tile_ids = tile_map + (map_y / 8) * 32;
+  const uint8_t* tile_attrs = tile_ids + 0x2000;
+  int unsigned_tile_ids = regs->control & LCD_CONTROL_BG_WINDOW_TILE_SELECT;
+  int bg_can_win = !d->cgb_mode || (regs->control & LCD_CONTROL_BG_DISPLAY);
+  uint8_t tile_row[8];
 
   int x;
+  for (x = x_start; x < x_end;) {
+    int tile_x = (map_x / 8) & 31;
+    int attrs = d->cgb_mode ? tile_attrs[tile_x] : 0;
+    int tile_id = tile_ids[tile_x];
+    int tile_offset = unsigned_tile_ids ? (tile_id * 16) :
+        (0x1000 + (int8_t)tile_id * 16);
+    if (attrs & BG_ATTR_VRAM_BANK1)
+      tile_offset += 0x2000;
+    int row = (attrs & BG_ATTR_YFLIP) ? (7 - (map_y & 7)) : (map_y & 7);
+    decode_tile_row(vram + tile_offset + row * 2, attrs & BG_ATTR_XFLIP,
+        tile_row);
 
-  // if disabled, draw nothing
-  if (!(d->control & 0x80)) {
-    for (x = 0; x < 160; x++) {
-      d->image_color_ids[y][x] = 0xFF;
-      d->image[y][x][0] = 1.0f;
-      d->image[y][x][1] = 1.0f;
-      d->image[y][x][2] = 1.0f;
+    const uint32_t* host_colors = regs->bg_host_colors[attrs & BG_ATTR_PALETTE];
+    int tile_pixel_x;
+    for (tile_pixel_x = map_x & 7; (tile_pixel_x < 8) && (x < x_end);
+         tile_pixel_x++, x++, map_x++) {
+      int color_id = tile_row[tile_pixel_x];
+      color_ids[x] = color_id;
+      line[x] = host_colors[color_id];
+      bg_priority[x] = bg_can_win ? (color_id && (attrs & BG_ATTR_PRIORITY)) : 0;
     }
-    return;
   }
+}
 
-  static float colors[][3] = {
-    {1.0f, 1.0f, 1.0f},
-    {0.3f, 0.3f, 0.3f},
-    {0.7f, 0.7f, 0.7f},
-    {0.0f, 0.0f, 0.0f},
-  };
+// returns 1 if any window pixels were drawn
+static int display_draw_line_segment(struct display* d, int y, int x_start,
+    int x_end, const struct display_line_regs* regs) {
 
-  int unsigned_tile_ids = d->control & LCD_CONTROL_BG_WINDOW_TILE_SELECT;
-  uint16_t* tile_data_map = (uint16_t*)(unsigned_tile_ids ?
-      ptr(d->mem, 0x8000) : ptr(d->mem, 0x9000));
-  uint8_t* tile_id_map = (uint8_t*)((d->control & LCD_CONTROL_BG_TILEMAP_SELECT) ?
-      ptr(d->mem, 0x9C00) : ptr(d->mem, 0x9800));
-
-  // draw background
-  int z;
-  int tile_y = ((y + d->scy) & 0xFF) / 8;
-  int tile_pixel_y = (y + d->scy) % 8;
-  int decoded_tile_id = -1;
-  uint8_t tile_data[8][8];
-
-  for (x = 0; x < 160; x++) {
-    int tile_x = ((x + d->scx) & 0xFF) / 8;
-    int tile_pixel_x = (x + d->scx) % 8;
-    int tile_id = tile_id_map[tile_y * 32 + tile_x];
-    if (!unsigned_tile_ids && tile_id > 127)
-      tile_id -= 256;
-
-    if (decoded_tile_id != tile_id) {
-      uint16_t* this_tile_data = tile_data_map + (8 * tile_id);
-      decode_tile(this_tile_data, tile_data);
-      decoded_tile_id = tile_id;
+  int x, z;
+  uint32_t* line = d->image[y];
+  uint16_t* color_ids = d->image_color_ids[y];
+
+  const uint8_t* vram = d->mem->vram;
+  uint8_t bg_priority[160];
+  uint8_t tile_row[8];
+
+  // draw background and window. on CGB, the bg display bit instead means that
+  // the background can be drawn over sprites (if 0, sprites are always on top)
+  int bg_can_win = !d->cgb_mode || (regs->control & LCD_CONTROL_BG_DISPLAY);
+  int window_x = regs->wx - 7, window_drawn = 0;
+  if (!d->cgb_mode && !(regs->control & LCD_CONTROL_BG_DISPLAY)) {
+    for (x = x_start; x < x_end; x++) {
+      color_ids[x] = 0;
+      line[x] = DISPLAY_PIXEL(0xFF, 0xFF, 0xFF);
+      bg_priority[x] = 0;
     }
 
-    int color_id = tile_data[tile_pixel_y][tile_pixel_x];
-    d->image_color_ids[y][x] = color_id;
-    d->image[y][x][0] = colors[color_id][0];
-    d->image[y][x][1] = colors[color_id][1];
-    d->image[y][x][2] = colors[color_id][2];
-  }
+  } else {
+    // the window covers everything from its x coordinate to the right edge
+    int bg_x_end = x_end;
+    if ((regs->control & LCD_CONTROL_WINDOW_ENABLE) && d->window_triggered &&
+        (window_x < x_end))
+      bg_x_end = (window_x > x_start) ? window_x : x_start;
 
-  // draw window
-  if (d->control & 0x20) {
-    // TODO
+    display_draw_tiles(d, y, x_start, bg_x_end, vram +
+        ((regs->control & LCD_CONTROL_BG_TILEMAP_SELECT) ? 0x1C00 : 0x1800),
+        (x_start + regs->scx) & 0xFF, (y + regs->scy) & 0xFF, regs,
+        bg_priority);
+
+    if (bg_x_end < x_end) {
+      display_draw_tiles(d, y, bg_x_end, x_end, vram +
+          ((regs->control & LCD_CONTROL_TILEMAP_SELECT) ? 0x1C00 : 0x1800),
+          bg_x_end - window_x, d->window_line, regs, bg_priority);
+      window_drawn = 1;
+    }
   }
 
   // draw sprites
-  if (d->control & 0x02) {
-    int sprite_ysize = (d->control & 0x04) ? 16 : 8;
-    uint16_t* tile_data_map = (uint16_t*)ptr(d->mem, 0x8000);
+  if (regs->control & LCD_CONTROL_SPRITES_ENABLE) {
+    int sprite_ysize = (regs->control & LCD_CONTROL_LARGE_SPRITES) ? 16 : 8;
+    const struct sprite_info* sprites = (const struct sprite_info*)d->mem->sprite_table;
 
-    const struct sprite_info* sprites = (struct sprite_info*)ptr(d->mem, 0xFE00);
-    for (z = 0; z < 40; z++) {
-      const struct sprite_info* sprite = &sprites[z];
-
-      int sprite_x = sprite->x - 8;
-      int sprite_y = sprite->y - 16;
-      int line_id = y - sprite_y;
-
-      // skip if not visible
-      if (line_id < 0 ||
-          line_id >= sprite_ysize ||
-          sprite_x < -7 ||
-          sprite_x >= 160)
-        continue;
+    // the hardware only draws the first 10 sprites in oam that are on this
+    // line, regardless of their x coordinates
+    const struct sprite_info* line_sprites[LCD_MAX_SPRITES_PER_LINE];
+    int num_line_sprites = 0;
+    for (z = 0; (z < 40) && (num_line_sprites < LCD_MAX_SPRITES_PER_LINE); z++) {
+      int line_id = y - (sprites[z].y - 16);
+      if (line_id >= 0 && line_id < sprite_ysize)
+        line_sprites[num_line_sprites++] = &sprites[z];
+    }
 
-      uint8_t tile_data[16][8];
-      if (sprite_ysize == 16) {
-        uint16_t* this_tile_data = tile_data_map + (8 * (sprite->tile_id & 0xFE));
-        decode_tile(this_tile_data, &tile_data[0]);
-        this_tile_data = tile_data_map + (8 * (sprite->tile_id | 0x01));
-        decode_tile(this_tile_data, &tile_data[8]);
-      } else {
-        uint16_t* this_tile_data = tile_data_map + (8 * sprite->tile_id);
-        decode_tile(this_tile_data, &tile_data[0]);
+    // on CGB, earlier sprites in oam have priority; on DMG, sprites with
+    // lower x coordinates do (ties go to the earlier one in oam). this sort is
+    // stable, so it preserves oam order for ties
+    if (!d->cgb_mode) {
+      for (z = 1; z < num_line_sprites; z++) {
+        const struct sprite_info* sprite = line_sprites[z];
+        int w;
+        for (w = z; (w > 0) && (line_sprites[w - 1]->x > sprite->x); w--)
+          line_sprites[w] = line_sprites[w - 1];
+        line_sprites[w] = sprite;
       }
+    }
 
-      if (sprite->flags & SPRITE_FLAG_USE_PALETTE1) {
-        fprintf(stderr, "lcd: warning: rendering sprite (%02X %02X %02X %02X) using palette1 not implemented\n",
-            sprite->y, sprite->x, sprite->tile_id, sprite->flags);
-      }
-      if (sprite->flags & SPRITE_FLAG_VRAM_BANK1) {
-        fprintf(stderr, "lcd: warning: rendering sprite (%02X %02X %02X %02X) from vram1 not implemented\n",
-            sprite->y, sprite->x, sprite->tile_id, sprite->flags);
-      }
+    // a sprite pixel hides lower-priority sprites' pixels even when the
+    // background ends up being drawn over it
+    uint8_t sprite_drawn[160];
+    memset(sprite_drawn, 0, sizeof(sprite_drawn));
+
+    for (z = 0; z < num_line_sprites; z++) {
+      const struct sprite_info* sprite = line_sprites[z];
+      int sprite_x = sprite->x - 8;
+      if (sprite_x >= x_end || sprite_x + 8 <= x_start)
+        continue;
 
+      int line_id = y - (sprite->y - 16);
       if (sprite->flags & SPRITE_FLAG_YFLIP)
         line_id = sprite_ysize - 1 - line_id;
-      if (sprite->flags & SPRITE_FLAG_XFLIP) {
-        for (x = 0; x < 4; x++) {
-          uint8_t t = tile_data[line_id][x];
-          tile_data[line_id][x] = tile_data[line_id][7 - x];
-          tile_data[line_id][7 - x] = t;
-        }
-      }
+
+      // in 8x16 mode the bottom tile immediately follows the top one, so
+      // line_id can just run past the end of the first tile
+      int tile_id = (sprite_ysize == 16) ? (sprite->tile_id & 0xFE) : sprite->tile_id;
+      int tile_offset = tile_id * 16 + line_id * 2;
+      const uint32_t* host_colors;
+      if (d->cgb_mode) {
+        if (sprite->flags & SPRITE_FLAG_VRAM_BANK1)
+          tile_offset += 0x2000;
+        host_colors = regs->sprite_host_colors[sprite->flags & SPRITE_FLAG_CGB_PALETTE];
+      } else
+        host_colors = regs->sprite_host_colors[(sprite->flags & SPRITE_FLAG_USE_PALETTE1) ? 1 : 0];
+      decode_tile_row(vram + tile_offset, sprite->flags & SPRITE_FLAG_XFLIP,
+          tile_row);
 
       for (x = 0; x < 8; x++) {
         int target_x = sprite_x + x;
-        if (target_x < 0 || target_x >= 160)
+        if (target_x < x_start || target_x >= x_end)
           continue;
 
-        if ((sprite->flags & SPRITE_FLAG_BEHIND_BG) && d->image_color_ids[y][target_x])
+        int color_id = tile_row[x];
+        if (!color_id || sprite_drawn[target_x])
           continue;
-        if (!tile_data[line_id][x])
+        sprite_drawn[target_x] = 1;
+
+        if (bg_priority[target_x] || (bg_can_win &&
+            (sprite->flags & SPRITE_FLAG_BEHIND_BG) && color_ids[target_x]))
           continue;
-        int color_id = tile_data[line_id][x];
-        d->image_color_ids[y][target_x] = color_id;
-        d->image[y][target_x][0] = d->highlight_sprites ? 1.0f : colors[color_id][0];
-        d->image[y][target_x][1] = colors[color_id][1];
-        d->image[y][target_x][2] = d->highlight_sprites ? 0.0f : colors[color_id][2];
+
+        color_ids[target_x] = color_id;
+        if (d->highlight_sprites)
+          line[target_x] = (host_colors[color_id] & 0xFF00FF00) | 0x000000FF;
+        else
+          line[target_x] = host_colors[color_id];
       }
     }
   }
+
+  return window_drawn;
 }
 
-void display_render_window_opengl(const struct display* d) {
+static void display_apply_logged_write(struct display_line_regs* regs,
+    uint32_t dmg_bg_colors[1][4], uint32_t dmg_sprite_colors[2][4],
+    int cgb_mode, uint8_t addr, uint8_t value) {
+  switch (addr) {
+    case 0x40:
+      regs->control = value;
+      break;
+    case 0x42:
+      regs->scy = value;
+      break;
+    case 0x43:
+      regs->scx = value;
+      break;
+    case 0x47:
+      if (!cgb_mode)
+        display_update_dmg_palette(dmg_bg_colors[0], value);
+      break;
+    case 0x48:
+      if (!cgb_mode)
+        display_update_dmg_palette(dmg_sprite_colors[0], value);
+      break;
+    case 0x49:
+      if (!cgb_mode)
+        display_update_dmg_palette(dmg_sprite_colors[1], value);
+      break;
+    case 0x4B:
+      regs->wx = value;
+      break;
+  }
+}
+
+static void display_update_line(struct display* d, int y) {
+
+  int x;
+
+  // if disabled, draw nothing
+  if (!(d->control & LCD_CONTROL_ENABLE)) {
+    for (x = 0; x < 160; x++) {
+      d->image_color_ids[y][x] = 0xFF;
+      d->image[y][x] = DISPLAY_PIXEL(0xFF, 0xFF, 0xFF);
+    }
+    return;
+  }
+
+  // the window starts on the first line where LY matches WY, and then draws
+  // its own lines consecutively no matter what happens to WY or WX
+  struct display_line_regs regs;
+  if (y == d->wy)
+    d->window_triggered = 1;
+
+  // fast path: nothing changed while the line was being drawn, so the current
+  // register values apply to the whole line
+  if (!d->num_reg_writes) {
+    regs.control = d->control;
+    regs.scy = d->scy;
+    regs.scx = d->scx;
+    regs.wx = d->wx;
+    regs.bg_host_colors = (const uint32_t (*)[4])d->bg_host_colors;
+    regs.sprite_host_colors = (const uint32_t (*)[4])d->sprite_host_colors;
+    if (display_draw_line_segment(d, y, 0, 160, &regs))
+      d->window_line++;
+    return;
+  }
+
+  // otherwise, start from the values at the beginning of the line and draw
+  // a segment up to each logged write
+  uint32_t dmg_bg_colors[1][4], dmg_sprite_colors[2][4];
+  regs.control = d->line_start_regs[0x00];
+  regs.scy = d->line_start_regs[0x02];
+  regs.scx = d->line_start_regs[0x03];
+  regs.wx = d->line_start_regs[0x0B];
+  if (d->cgb_mode) {
+    regs.bg_host_colors = (const uint32_t (*)[4])d->bg_host_colors;
+    regs.sprite_host_colors = (const uint32_t (*)[4])d->sprite_host_colors;
+  } else {
+    display_update_dmg_palette(dmg_bg_colors[0], d->line_start_regs[0x07]);
+    display_update_dmg_palette(dmg_sprite_colors[0], d->line_start_regs[0x08]);
+    display_update_dmg_palette(dmg_sprite_colors[1], d->line_start_regs[0x09]);
+    regs.bg_host_colors = (const uint32_t (*)[4])dmg_bg_colors;
+    regs.sprite_host_colors = (const uint32_t (*)[4])dmg_sprite_colors;
+  }
+
+  int z, segment_start = 0, window_drawn = 0;
+  for (z = 0; z < d->num_reg_writes; z++) {
+    const struct lcd_reg_write* w = &d->reg_writes[z];
+    if (w->x > segment_start) {
+      window_drawn |= display_draw_line_segment(d, y, segment_start, w->x, &regs);
+      segment_start = w->x;
+    }
+    display_apply_logged_write(&regs, dmg_bg_colors, dmg_sprite_colors,
+        d->cgb_mode, w->addr, w->value);
+  }
+  if (segment_start < 160)
+    window_drawn |= display_draw_line_segment(d, y, segment_start, 160, &regs);
+  if (window_drawn)
+    d->window_line++;
+
+  d->num_reg_writes = 0;
+}
+
+// called before a register that affects rendering is written. if the current
+// line is being drawn, the write is logged with the pixel it takes effect at
+static void display_log_reg_write(struct display* d, uint8_t addr,
+    uint8_t value) {
+
+  if (!d->render_current_frame || !(d->control & LCD_CONTROL_ENABLE) ||
+      (d->ly >= 144) || ((d->status & 0x03) == 0))
+    return;
+
+  int dot = d->cpu->cycles - d->line_start_cycles;
+  if (dot < LCD_PIXEL_TRANSFER_START_DOT)
+    return; // the new value applies to the whole line
+  int x = dot - LCD_PIXEL_TRANSFER_START_DOT;
+  if (x >= 160)
+    return; // the line is already done; the new value applies to the next one
+
+  if (!d->num_reg_writes)
+    memcpy(d->line_start_regs, &d->control, sizeof(d->line_start_regs));
+  if (d->num_reg_writes >= LCD_REG_WRITE_LOG_SIZE) {
+    // shouldn't happen (the log is larger than the number of writes that
+    // fit in a line), but if it does, the last write just takes effect early
+    d->num_reg_writes--;
+  }
 
-  static const int x_pixels = 160, y_pixels = 144;
-  static const float xfstep = (2.0f / x_pixels), yfstep = -(2.0f / y_pixels);
+  struct lcd_reg_write* w = &d->reg_writes[d->num_reg_writes++];
+  w->x = x;
+  w->addr = addr;
+  w->value = value;
+}
+
+#endif // DISPLAY_PIXEL_FIFO
+
+void display_set_line_callback(struct display* d,
+    void (*line_cb)(struct display* d, int y, void* param), void* cb_arg) {
+  d->line_cb = line_cb;
+  d->line_cb_arg = cb_arg;
+}
+
+void display_request_render(struct display* d) {
+  // before line 0's pixel transfer nothing has been drawn yet, so a caller
+  // that stops right at the end of a frame can still get the one that follows.
+  // (the pixel fifo renderer stays in mode 1 until the first dot of line 0)
+  int mode = d->status & 3;
+  if ((d->control & LCD_CONTROL_ENABLE) && (d->ly == 0) &&
+      ((mode == 1) || (mode == 2)))
+    d->render_current_frame = 1;
+  else
+    d->render_requested = 1;
+}
+
+// converts a tile map entry into its index in vram's tile data
+static uint16_t display_tile_index(uint8_t control, uint8_t tile_id,
+    uint8_t attrs) {
+  int index = (control & LCD_CONTROL_BG_WINDOW_TILE_SELECT) ? tile_id :
+      (256 + (int8_t)tile_id);
+  return (attrs & BG_ATTR_VRAM_BANK1) ? (index + 384) : index;
+}
+
+void display_get_scene(const struct display* d, struct display_scene* s) {
+  const uint8_t* vram = d->mem->vram;
+  int x, y, z;
+
+  memset(s, 0, sizeof(*s));
+  s->control = d->control;
+  s->scx = d->scx;
+  s->scy = d->scy;
+  s->wx = d->wx;
+  s->wy = d->wy;
+  s->sprite_height = (d->control & LCD_CONTROL_LARGE_SPRITES) ? 16 : 8;
+  if (!(d->control & LCD_CONTROL_ENABLE))
+    return;
+
+  // on DMG, the bg display bit turns off the window too
+  s->bg_visible = d->cgb_mode || (d->control & LCD_CONTROL_BG_DISPLAY);
+  const uint8_t* bg_map = vram +
+      ((d->control & LCD_CONTROL_BG_TILEMAP_SELECT) ? 0x1C00 : 0x1800);
+  for (y = 0; y < DISPLAY_SCENE_BG_ROWS; y++) {
+    int map_row = ((d->scy / 8) + y) & 31;
+    for (x = 0; x < DISPLAY_SCENE_BG_COLUMNS; x++) {
+      int map_offset = map_row * 32 + (((d->scx / 8) + x) & 31);
+      uint8_t attrs = d->cgb_mode ? bg_map[map_offset + 0x2000] : 0;
+      s->bg_tiles[y][x] = display_tile_index(d->control, bg_map[map_offset],
+          attrs);
+      s->bg_attrs[y][x] = attrs;
+    }
+  }
+
+  s->window_visible = s->bg_visible &&
+      (d->control & LCD_CONTROL_WINDOW_ENABLE) && (d->wy < 144) &&
+      (d->wx < 167);
+  if (s->window_visible) {
+    const uint8_t* window_map = vram +
+        ((d->control & LCD_CONTROL_TILEMAP_SELECT) ? 0x1C00 : 0x1800);
+    int num_rows = (144 - d->wy + 7) / 8, num_columns = (167 - d->wx + 7) / 8;
+    if (num_columns > DISPLAY_SCENE_WINDOW_COLUMNS)
+      num_columns = DISPLAY_SCENE_WINDOW_COLUMNS;
+    for (y = 0; y < num_rows; y++) {
+      for (x = 0; x < num_columns; x++) {
+        uint8_t attrs = d->cgb_mode ? window_map[y * 32 + x + 0x2000] : 0;
+        s->window_tiles[y][x] = display_tile_index(d->control,
+            window_map[y * 32 + x], attrs);
+        s->window_attrs[y][x] = attrs;
+      }
+    }
+  }
 
-  int x, y;
-  float xf, yf;
-  glBegin(GL_QUADS);
-  for (y = 0, yf = 1; y < y_pixels; y++, yf += yfstep) {
-    for (x = 0, xf = -1; x < x_pixels; x++, xf += xfstep) {
-      glColor3f(d->image[y][x][0], d->image[y][x][1], d->image[y][x][2]);
-      glVertex3f(xf, yf, 1.0f);
-      glVertex3f(xf + xfstep, yf, 1.0f);
-      glVertex3f(xf + xfstep, yf + yfstep, 1.0f);
-      glVertex3f(xf, yf + yfstep, 1.0f);
+  if (d->control & LCD_CONTROL_SPRITES_ENABLE) {
+    const struct sprite_info* sprites =
+        (const struct sprite_info*)d->mem->sprite_table;
+    for (z = 0; z < 40; z++) {
+      int sprite_x = sprites[z].x - 8, sprite_y = sprites[z].y - 16;
+      if ((sprite_x <= -8) || (sprite_x >= 160) ||
+          (sprite_y <= -s->sprite_height) || (sprite_y >= 144))
+        continue;
+      struct display_scene_sprite* sprite = &s->sprites[s->num_sprites++];
+      sprite->x = sprite_x;
+      sprite->y = sprite_y;
+      sprite->tile = (s->sprite_height == 16) ? (sprites[z].tile_id & 0xFE) :
+          sprites[z].tile_id;
+      if (d->cgb_mode && (sprites[z].flags & SPRITE_FLAG_VRAM_BANK1))
+        sprite->tile += 384;
+      sprite->flags = sprites[z].flags;
+      sprite->oam_index = z;
     }
   }
-  glEnd();
 }
 
 void display_print(FILE* f, struct display* d) {
@@ -228,91 +546,572 @@ void display_print(FILE* f, struct display* d) {
   fprintf(f, "46_dma      = %02X    47_bg_palette = %02X\n", d->dma, d->bg_palette);
   fprintf(f, "48_palette0 = %02X    49_palette1   = %02X\n", d->palette0, d->palette1);
   fprintf(f, "4A_wy       = %02X    4B_wx         = %02X\n", d->wy, d->wx);
-  fprintf(f, "wait_vblank = %d\n", d->wait_vblank);
-  fprintf(f, "last_vblank_time = %016llX\n", d->last_vblank_time);
-  fprintf(f, "pause_time       = %016llX\n", d->pause_time);
+  fprintf(f, "render_current_frame = %d    render_requested = %d\n",
+      d->render_current_frame, d->render_requested);
+  fprintf(f, "window_line = %d    window_triggered = %d\n", d->window_line,
+      d->window_triggered);
+#ifdef DISPLAY_PIXEL_FIFO
+  fprintf(f, "renderer = pixel fifo (dot = %d, x = %d)\n", d->fifo.dot,
+      d->fifo.x);
+#else
+  fprintf(f, "renderer = scanline\n");
+#endif
 
   const char* terminal_palette = "_!*@";
-  uint8_t tile_data[8][8];
+  uint8_t tile_row[8];
   int x, y, z;
   for (z = 0; z < 192; z++) {
     fprintf(f, "\n>>> tile dump %d\n", z);
-    uint16_t* this_tile_data = (uint16_t*)d->mem->vram + (z * 8);
-    decode_tile(this_tile_data, tile_data);
     for (y = 0; y < 8; y++) {
+      decode_tile_row(d->mem->vram + (z * 16) + (y * 2), 0, tile_row);
       for (x = 0; x < 8; x++)
-        fputc(terminal_palette[tile_data[y][x]], f);
+        fputc(terminal_palette[tile_row[x]], f);
       fputc('\n', f);
     }
   }
 }
 
-void display_update(struct display* d, uint64_t cycles) {
+// copies 16-byte blocks from hdma_source to hdma_dest in the current vram
+// bank. the cpu is stopped while this happens, so the time it takes is added
+// to its cycle count
+static void display_hdma_copy_blocks(struct display* d, int num_blocks) {
+  struct memory* m = d->mem;
+  uint8_t* vram = m->vram_bank;
 
-  int prev_ly = d->ly;
+  int block;
+  for (block = 0; block < num_blocks; block++) {
+    // each block is within one bank of rom, eram or wram, so when the source
+    // is one of those it's contiguous in host memory
+    uint16_t src = d->hdma_source;
+    if ((src < 0x8000) || ((src >= 0xA000) && (src < 0xE000) && valid_ptr(m, src)))
+      memcpy(&vram[d->hdma_dest], ptr(m, src), 0x10);
+    else {
+      int x;
+      for (x = 0; x < 0x10; x++)
+        vram[d->hdma_dest + x] = read8(m, src + x);
+    }
 
-  uint64_t current_period_cycles = (d->control & 0x80) ? (cycles % LCD_CYCLES_PER_FRAME) : 70000;
-  d->ly = current_period_cycles / 456;
+    d->hdma_source += 0x10;
+    d->hdma_dest = (d->hdma_dest + 0x10) & 0x1FF0;
+  }
+  d->hdma_blocks_remaining -= num_blocks;
 
-  int mode, prev_mode = d->status & 0x03;
-  if (d->ly < 144) {
-    int current_hblank_cycles = current_period_cycles % 456;
-    if (current_hblank_cycles < 204)
-      mode = 2; // reading oam
-    else if (current_hblank_cycles < 284)
-      mode = 3; // reading oam & vram
-    else
-      mode = 0; // hblank
-  } else
-    mode = 1; // vblank or display disabled
+  // 8 machine cycles per block, which take twice as long in double speed mode
+  d->cpu->cycles += num_blocks * (is_double_speed_mode(d->cpu) ? 64 : 32);
+}
+
+// updates the mode bits in STAT and raises the STAT interrupt if it's enabled
+// for the new mode
+static void display_enter_mode(struct display* d, int mode) {
   d->status = (d->status & ~3) | mode;
+  if ((mode == 0) && d->hdma_hblank_active && (d->ly < 144)) {
+    display_hdma_copy_blocks(d, 1);
+    if (!d->hdma_blocks_remaining)
+      d->hdma_hblank_active = 0;
+  }
+  if ((mode == 0) && (d->status & 0x08)) // h-blank interrupt
+    signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+  if ((mode == 1) && (d->status & 0x10)) // v-blank interrupt
+    signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+  if ((mode == 2) && (d->status & 0x20)) // oam interrupt
+    signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+}
 
-  if ((prev_ly > 0) && (d->ly == 0)) {
-    int frame_num = cycles / LCD_CYCLES_PER_FRAME;
-    if (d->render_freq && (frame_num % d->render_freq) == 0)
-      d->display_cb(d, d->display_cb_arg);
-    if (d->wait_vblank) {
-      // 16750 us/frame = 59.7 frames/sec
-      d->last_vblank_time += 16750;
-      uint64_t t = now();
-      if (t < d->last_vblank_time)
-        usleep(d->last_vblank_time - t);
-      else
-        fprintf(stderr, "display: emulation is too slow! %llu missing usecs\n",
-            t - d->last_vblank_time);
+// updates LY and the coincidence flag, and raises the LYC and vblank
+// interrupts when appropriate
+static void display_enter_line(struct display* d, int ly) {
+  d->ly = ly;
+
+  // anything logged for a line that wasn't drawn (e.g. because the lcd was
+  // turned off during it) doesn't apply to the new one
+  d->num_reg_writes = 0;
+
+  if (d->ly == d->lyc) {
+    d->status |= 0x04;
+    if (d->status & 0x40)
+      signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+  } else
+    d->status &= ~0x04;
+
+  // TODO: does the vblank interrupt always happen, or is it controlled by
+  // d->status & 0x10? if the latter, does d->status & 0x10 cause LCDSTAT or
+  // VBLANK?
+  if (d->ly == 144)
+    signal_interrupt(d->cpu, INTERRUPT_VBLANK, 1);
+}
+
+// called when LY wraps around to 0
+static void display_end_frame(struct display* d) {
+  if (d->render_current_frame && d->display_cb)
+    d->display_cb(d, d->display_cb_arg);
+  d->num_frames++;
+
+  // decide now whether anyone will see the next frame; if not, we still run
+  // all the mode/ly timing and interrupts but skip drawing its lines. frames
+  // are counted rather than derived from the cycle count, since turning the
+  // lcd off and on restarts the frame at an arbitrary cycle
+  d->render_current_frame = d->render_requested ||
+      (d->render_freq && (d->num_frames % d->render_freq) == 0);
+  d->render_requested = 0;
+
+  d->window_line = 0;
+  d->window_triggered = 0;
+}
+
+#ifndef DISPLAY_PIXEL_FIFO
+
+// the display is a small state machine that only does anything at mode
+// boundaries: each visible line is an oam scan (mode 2), pixel transfer
+// (mode 3; the line is drawn when it ends) and hblank (mode 0), then vblank
+// (mode 1) covers the last 10 lines. each boundary is a scheduled event; LY
+// and STAT are computed from line_start_cycles when they're read
+
+static void display_schedule(struct display* d, uint64_t cycles) {
+  scheduler_schedule(&d->mem->sched, SCHEDULER_EVENT_DISPLAY, cycles);
+}
+
+static int display_current_ly(struct display* d) {
+  if (d->ly < 144)
+    return d->ly;
+  uint64_t line = 144 +
+      (d->cpu->cycles - d->line_start_cycles) / LCD_CYCLES_PER_LINE;
+  return (line > 153) ? 153 : line;
+}
+
+// during vblank nothing happens on each line except possibly an LYC match, so
+// the only events are for that line (if there is one) and the end of the frame
+static void display_schedule_vblank_event(struct display* d) {
+  int ly = display_current_ly(d);
+  if ((d->lyc > ly) && (d->lyc <= 153))
+    display_schedule(d, d->line_start_cycles +
+        (d->lyc - 144) * LCD_CYCLES_PER_LINE);
+  else
+    display_schedule(d, d->line_start_cycles +
+        (154 - 144) * LCD_CYCLES_PER_LINE);
+}
+
+static void display_event(void* context, uint64_t cycles) {
+  struct display* d = (struct display*)context;
+
+  switch (d->status & 3) {
+    case 2: // oam scan -> pixel transfer
+      display_enter_mode(d, 3);
+      display_schedule(d, d->line_start_cycles + LCD_OAM_SCAN_CYCLES +
+          LCD_PIXEL_TRANSFER_CYCLES);
+      break;
+
+    case 3: // pixel transfer -> hblank
+      // draw the line first, since hblank dma may change vram for later lines
+      if (d->render_current_frame) {
+        display_update_line(d, d->ly);
+        if (d->line_cb)
+          d->line_cb(d, d->ly, d->line_cb_arg);
+      }
+      display_enter_mode(d, 0);
+      display_schedule(d, d->line_start_cycles + LCD_CYCLES_PER_LINE);
+      break;
+
+    case 0: // hblank -> next line's oam scan, or vblank
+      d->line_start_cycles += LCD_CYCLES_PER_LINE;
+      display_enter_line(d, d->ly + 1);
+      if (d->ly == 144) {
+        display_enter_mode(d, 1);
+        display_schedule_vblank_event(d);
+      } else {
+        display_enter_mode(d, 2);
+        display_schedule(d, d->line_start_cycles + LCD_OAM_SCAN_CYCLES);
+      }
+      break;
+
+    case 1: { // vblank: either an LYC match or the end of the frame
+      int line = 144 + (cycles - d->line_start_cycles) / LCD_CYCLES_PER_LINE;
+      if (line <= 153) {
+        if (d->lyc == line) {
+          d->status |= 0x04;
+          if (d->status & 0x40)
+            signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+        }
+        display_schedule_vblank_event(d);
+        break;
+      }
+
+      d->line_start_cycles += (154 - 144) * LCD_CYCLES_PER_LINE;
+      display_end_frame(d);
+      display_enter_line(d, 0);
+      display_enter_mode(d, 2);
+      display_schedule(d, d->line_start_cycles + LCD_OAM_SCAN_CYCLES);
+      break;
     }
   }
+}
 
-  // check for interrupts
-  if (prev_mode != mode) {
-    if (mode == 0) // on hblank, draw a line
-      display_update_line(d, d->ly);
-    if ((mode == 0) && (d->status & 0x08)) // h-blank interrupt
-      signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
-    if ((mode == 1) && (d->status & 0x10)) // v-blank interrupt
-      signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
-    if ((mode == 2) && (d->status & 0x20)) // oam interrupt
-      signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
+// called when the lcd is turned on; it starts at the beginning of a frame
+static void display_start(struct display* d) {
+  d->line_start_cycles = d->cpu->cycles;
+  d->window_line = 0;
+  d->window_triggered = 0;
+  display_enter_line(d, 0);
+  display_enter_mode(d, 2);
+  display_schedule(d, d->line_start_cycles + LCD_OAM_SCAN_CYCLES);
+}
+
+// called when the lcd is turned off; it sits at the start of line 0 until
+// it's turned on again
+static void display_stop(struct display* d) {
+  scheduler_cancel(&d->mem->sched, SCHEDULER_EVENT_DISPLAY);
+  d->ly = 0;
+  d->status &= ~3;
+  d->num_reg_writes = 0;
+}
+
+static void display_lyc_changed(struct display* d) {
+  if ((d->control & LCD_CONTROL_ENABLE) && (d->ly >= 144))
+    display_schedule_vblank_event(d);
+}
+
+#else // DISPLAY_PIXEL_FIFO
+
+// this is a dot-by-dot model of the ppu: an oam scan during mode 2, then a
+// background/window fetcher feeding a pixel fifo during mode 3, which stalls
+// for window starts and sprite fetches, so mode 3's length varies as on the
+// real hardware. it's much slower than the scanline renderer, so it's only
+// built when DISPLAY_PIXEL_FIFO is defined (see the Makefile)
+
+#define FIFO_BG_PRIORITY  0x20
+
+static void display_fifo_start_line(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  f->num_line_sprites = 0;
+  f->sprites_fetched = 0;
+  if (d->ly == d->wy)
+    d->window_triggered = 1;
+  display_enter_mode(d, 2);
+}
+
+static void display_fifo_scan_oam_entry(struct display* d, int index) {
+  struct display_fifo* f = &d->fifo;
+  if (f->num_line_sprites >= LCD_MAX_SPRITES_PER_LINE)
+    return;
+
+  const struct sprite_info* sprite =
+      &((const struct sprite_info*)d->mem->sprite_table)[index];
+  int sprite_ysize = (d->control & LCD_CONTROL_LARGE_SPRITES) ? 16 : 8;
+  int line_id = d->ly - (sprite->y - 16);
+  if (line_id >= 0 && line_id < sprite_ysize)
+    f->line_sprites[f->num_line_sprites++] = index;
+}
+
+static void display_fifo_start_pixel_transfer(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  f->x = 0;
+  f->discard = d->scx & 7;
+  f->fetching_window = 0;
+  f->window_used = 0;
+  f->fetcher_delay = 6; // the first fetch of each line is thrown away
+  f->fetcher_step = 0;
+  f->fetcher_x = 0;
+  f->bg_fifo_head = 0;
+  f->bg_fifo_size = 0;
+  f->sprite_fetch_dots = 0;
+  memset(f->sprite_pixels, 0, sizeof(f->sprite_pixels));
+  display_enter_mode(d, 3);
+}
+
+static void display_fifo_fetcher_read(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  const uint8_t* vram = d->mem->vram;
+
+  int map_offset, map_x, map_y;
+  if (f->fetching_window) {
+    map_offset = (d->control & LCD_CONTROL_TILEMAP_SELECT) ? 0x1C00 : 0x1800;
+    map_x = f->fetcher_x;
+    map_y = d->window_line;
+  } else {
+    map_offset = (d->control & LCD_CONTROL_BG_TILEMAP_SELECT) ? 0x1C00 : 0x1800;
+    map_x = ((d->scx >> 3) + f->fetcher_x) & 31;
+    map_y = (d->ly + d->scy) & 0xFF;
+  }
+
+  map_offset += (map_y / 8) * 32 + map_x;
+  if (f->fetcher_step == 2) {
+    f->fetcher_tile_id = vram[map_offset];
+    f->fetcher_attrs = d->cgb_mode ? vram[map_offset + 0x2000] : 0;
+    return;
+  }
+
+  int tile_offset = (d->control & LCD_CONTROL_BG_WINDOW_TILE_SELECT) ?
+      (f->fetcher_tile_id * 16) : (0x1000 + (int8_t)f->fetcher_tile_id * 16);
+  if (f->fetcher_attrs & BG_ATTR_VRAM_BANK1)
+    tile_offset += 0x2000;
+  int row = (f->fetcher_attrs & BG_ATTR_YFLIP) ? (7 - (map_y & 7)) : (map_y & 7);
+  if (f->fetcher_step == 4)
+    f->fetcher_low = vram[tile_offset + row * 2];
+  else
+    f->fetcher_high = vram[tile_offset + row * 2 + 1];
+}
+
+static void display_fifo_push_tile(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  uint8_t row[2] = {f->fetcher_low, f->fetcher_high};
+  uint8_t color_ids[8];
+  decode_tile_row(row, f->fetcher_attrs & BG_ATTR_XFLIP, color_ids);
+
+  // on DMG, the bg display bit blanks the background (and window)
+  int blank = !d->cgb_mode && !(d->control & LCD_CONTROL_BG_DISPLAY);
+  int x;
+  for (x = 0; x < 8; x++) {
+    f->bg_fifo[x] = blank ? 0 : (color_ids[x] |
+        ((f->fetcher_attrs & BG_ATTR_PALETTE) << 2) |
+        ((f->fetcher_attrs & BG_ATTR_PRIORITY) ? FIFO_BG_PRIORITY : 0));
+  }
+  f->bg_fifo_head = 0;
+  f->bg_fifo_size = 8;
+  f->fetcher_x++;
+}
+
+// sprite pixels are kept as color id | (palette << 2) | (flags & 0x80)
+static void display_fifo_fetch_sprite(struct display* d, int line_sprite_index) {
+  struct display_fifo* f = &d->fifo;
+  int oam_index = f->line_sprites[line_sprite_index];
+  const struct sprite_info* sprite =
+      &((const struct sprite_info*)d->mem->sprite_table)[oam_index];
+
+  int sprite_ysize = (d->control & LCD_CONTROL_LARGE_SPRITES) ? 16 : 8;
+  int line_id = d->ly - (sprite->y - 16);
+  if (sprite->flags & SPRITE_FLAG_YFLIP)
+    line_id = sprite_ysize - 1 - line_id;
+  int tile_id = (sprite_ysize == 16) ? (sprite->tile_id & 0xFE) : sprite->tile_id;
+  int tile_offset = tile_id * 16 + line_id * 2;
+  int palette;
+  if (d->cgb_mode) {
+    if (sprite->flags & SPRITE_FLAG_VRAM_BANK1)
+      tile_offset += 0x2000;
+    palette = sprite->flags & SPRITE_FLAG_CGB_PALETTE;
+  } else
+    palette = (sprite->flags & SPRITE_FLAG_USE_PALETTE1) ? 1 : 0;
+
+  uint8_t color_ids[8];
+  decode_tile_row(d->mem->vram + tile_offset, sprite->flags & SPRITE_FLAG_XFLIP,
+      color_ids);
+
+  // an existing sprite pixel is only replaced if it's transparent, or (on
+  // CGB) if the new sprite comes earlier in oam
+  int x;
+  for (x = 0; x < 8; x++) {
+    int pos = sprite->x + x; // sprite_pixels is indexed by screen x + 8
+    if (!color_ids[x])
+      continue;
+    if (f->sprite_pixels[pos] && (!d->cgb_mode ||
+        (f->sprite_pixel_oam_index[pos] < oam_index)))
+      continue;
+    f->sprite_pixels[pos] = color_ids[x] | (palette << 2) |
+        (sprite->flags & SPRITE_FLAG_BEHIND_BG);
+    f->sprite_pixel_oam_index[pos] = oam_index;
+  }
+}
+
+static void display_fifo_output_pixel(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  uint8_t bg = f->bg_fifo[f->bg_fifo_head++];
+  f->bg_fifo_size--;
+  if (f->discard) {
+    f->discard--;
+    return;
+  }
+
+  int bg_color_id = bg & 3;
+  uint8_t sprite = (d->control & LCD_CONTROL_SPRITES_ENABLE) ?
+      f->sprite_pixels[f->x + 8] : 0;
+  int bg_can_win = !d->cgb_mode || (d->control & LCD_CONTROL_BG_DISPLAY);
+  int use_sprite = (sprite & 3) && !(bg_can_win && bg_color_id &&
+      ((bg & FIFO_BG_PRIORITY) || (sprite & SPRITE_FLAG_BEHIND_BG)));
+
+  if (d->render_current_frame) {
+    if (use_sprite) {
+      uint32_t c = d->sprite_host_colors[(sprite >> 2) & 7][sprite & 3];
+      d->image_color_ids[d->ly][f->x] = sprite & 3;
+      d->image[d->ly][f->x] = d->highlight_sprites ?
+          ((c & 0xFF00FF00) | 0x000000FF) : c;
+    } else {
+      d->image_color_ids[d->ly][f->x] = bg_color_id;
+      d->image[d->ly][f->x] = d->bg_host_colors[(bg >> 2) & 7][bg_color_id];
+    }
+  }
+
+  f->x++;
+  if (f->x == 160) {
+    if (f->window_used)
+      d->window_line++;
+    if (d->render_current_frame && d->line_cb)
+      d->line_cb(d, d->ly, d->line_cb_arg);
+    display_enter_mode(d, 0);
+  }
+}
+
+static void display_fifo_pixel_transfer_dot(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+
+  // while a sprite is being fetched, the background fetcher and the pixel
+  // output are both stalled
+  if (f->sprite_fetch_dots) {
+    if (--f->sprite_fetch_dots == 0)
+      display_fifo_fetch_sprite(d, f->sprite_fetch_index);
+    return;
   }
 
-  if (prev_ly != d->ly) {
-    if (d->ly == d->lyc) {
-      d->status |= 0x04;
-      if (d->status & 0x40)
-        signal_interrupt(d->cpu, INTERRUPT_LCDSTAT, 1);
-    } else
-      d->status &= ~0x04;
+  // when the window starts, the fifo is cleared and the fetcher starts over
+  // from the window's first tile
+  if (!f->fetching_window && !f->discard &&
+      (d->control & LCD_CONTROL_WINDOW_ENABLE) && d->window_triggered &&
+      (f->x + 7 >= d->wx)) {
+    f->fetching_window = 1;
+    f->window_used = 1;
+    f->fetcher_step = 0;
+    f->fetcher_x = 0;
+    f->bg_fifo_size = 0;
+  }
+
+  // the fetcher takes 2 dots each to read the tile id and the two data bytes,
+  // then pushes a tile's worth of pixels as soon as the fifo is empty
+  if (f->fetcher_delay)
+    f->fetcher_delay--;
+  else if (f->fetcher_step < 6) {
+    f->fetcher_step++;
+    if (!(f->fetcher_step & 1))
+      display_fifo_fetcher_read(d);
+  } else if (!f->bg_fifo_size) {
+    display_fifo_push_tile(d);
+    f->fetcher_step = 0;
+  }
+
+  // sprite fetches start when the output reaches the sprite's left edge, but
+  // not before the fetcher has something in the fifo. sprites that are
+  // partially off the left edge all become ready at once, so the one with the
+  // lowest x goes first (ties go to the earlier one in oam)
+  if ((d->control & LCD_CONTROL_SPRITES_ENABLE) && f->bg_fifo_size && !f->discard) {
+    const struct sprite_info* sprites = (const struct sprite_info*)d->mem->sprite_table;
+    int z, next = -1;
+    for (z = 0; z < f->num_line_sprites; z++) {
+      if ((f->sprites_fetched & (1 << z)) ||
+          (sprites[f->line_sprites[z]].x > f->x + 8))
+        continue;
+      if ((next < 0) || (sprites[f->line_sprites[z]].x <
+          sprites[f->line_sprites[next]].x))
+        next = z;
+    }
+    if (next >= 0) {
+      f->sprites_fetched |= (1 << next);
+      f->sprite_fetch_index = next;
+      f->sprite_fetch_dots = 6;
+      return;
+    }
+  }
+
+  if (f->bg_fifo_size)
+    display_fifo_output_pixel(d);
+}
+
+static void display_fifo_step(struct display* d, uint64_t cycles) {
+  struct display_fifo* f = &d->fifo;
+
+  if (d->ly < 144) {
+    if (f->dot == 0)
+      display_fifo_start_line(d);
+    if (f->dot < LCD_OAM_SCAN_CYCLES) {
+      // one oam entry is checked every 2 dots
+      if (!(f->dot & 1))
+        display_fifo_scan_oam_entry(d, f->dot / 2);
+    } else {
+      if (f->dot == LCD_OAM_SCAN_CYCLES)
+        display_fifo_start_pixel_transfer(d);
+      if ((d->status & 3) == 3)
+        display_fifo_pixel_transfer_dot(d);
+    }
+  }
+
+  if (++f->dot < LCD_CYCLES_PER_LINE)
+    return;
 
-    // TODO: does the vblank interrupt always happen, or is it controlled by
-    // d->status & 0x10? if the latter, does d->status & 0x10 cause LCDSTAT or
-    // VBLANK?
+  f->dot = 0;
+  if (d->ly == 153) {
+    display_end_frame(d);
+    display_enter_line(d, 0);
+  } else {
+    display_enter_line(d, d->ly + 1);
     if (d->ly == 144)
-      signal_interrupt(d->cpu, INTERRUPT_VBLANK, 1);
+      display_enter_mode(d, 1);
   }
 }
 
+// runs the dots between the last update and the current cycle count
+static void display_fifo_catch_up(struct display* d) {
+  struct display_fifo* f = &d->fifo;
+  uint64_t cycles = d->cpu->cycles;
+  for (; f->last_cycles < cycles; f->last_cycles++)
+    display_fifo_step(d, f->last_cycles);
+}
+
+static int display_current_ly(struct display* d) {
+  display_fifo_catch_up(d);
+  return d->ly;
+}
+
+// something can happen on every dot, so while the lcd is on this event is
+// always due after the next instruction
+static void display_event(void* context, uint64_t cycles) {
+  struct display* d = (struct display*)context;
+  display_fifo_catch_up(d);
+  scheduler_schedule(&d->mem->sched, SCHEDULER_EVENT_DISPLAY,
+      d->cpu->cycles + 1);
+}
+
+static void display_start(struct display* d) {
+  d->fifo.last_cycles = d->cpu->cycles;
+  d->fifo.dot = 0;
+  d->window_line = 0;
+  d->window_triggered = 0;
+  display_enter_line(d, 0);
+  scheduler_schedule(&d->mem->sched, SCHEDULER_EVENT_DISPLAY,
+      d->cpu->cycles + 1);
+}
+
+// while the lcd is off, it sits at the start of line 0
+static void display_stop(struct display* d) {
+  scheduler_cancel(&d->mem->sched, SCHEDULER_EVENT_DISPLAY);
+  d->fifo.dot = 0;
+  d->ly = 0;
+  d->status &= ~3;
+}
+
+// the dot-by-dot model checks LYC on every line, so there's nothing to
+// reschedule
+static void display_lyc_changed(struct display* d) {
+}
+
+#endif // DISPLAY_PIXEL_FIFO
+
 uint8_t read_lcd_reg(struct display* d, uint8_t addr) {
   switch (addr) {
+    case 0x41: {
+      int ly = display_current_ly(d);
+      return (d->status & 0x7B) | ((ly == d->lyc) ? 0x04 : 0);
+    }
+
+    case 0x44:
+      return display_current_ly(d);
+
+    case 0x51:
+    case 0x52:
+    case 0x53:
+    case 0x54:
+      return 0xFF; // write-only
+
+    case 0x55:
+      // bit 7 is set when no hblank dma is running; the rest is the number of
+      // blocks left minus 1 (so this is FF after a transfer finishes)
+      return (d->hdma_hblank_active ? 0x00 : 0x80) |
+          ((d->hdma_blocks_remaining - 1) & 0x7F);
+
     case 0x68:
       return d->bg_color_palette_index;
 
@@ -336,10 +1135,24 @@ uint8_t read_lcd_reg(struct display* d, uint8_t addr) {
 
 void write_lcd_reg(struct display* d, uint8_t addr, uint8_t value) {
 
+#ifndef DISPLAY_PIXEL_FIFO
+  if ((addr == 0x40) || (addr == 0x42) || (addr == 0x43) ||
+      ((addr >= 0x47) && (addr <= 0x4B)))
+    display_log_reg_write(d, addr, value);
+#endif
+
   switch (addr) {
-    case 0x40:
+    case 0x40: {
+      uint8_t prev_control = d->control;
       d->control = value;
+      if ((prev_control ^ value) & LCD_CONTROL_ENABLE) {
+        if (value & LCD_CONTROL_ENABLE)
+          display_start(d);
+        else
+          display_stop(d);
+      }
       break;
+    }
 
     case 0x41:
       // can't write the lower 3 bits
@@ -368,25 +1181,56 @@ void write_lcd_reg(struct display* d, uint8_t addr, uint8_t value) {
 
     case 0x45:
       d->lyc = value;
+      display_lyc_changed(d);
       break;
 
-    case 0x46: {
-      int x, addr = (value << 8);
-      for (x = 0; x < 0xA0; x++)
-        write8(d->mem, 0xFE00 + x, read8(d->mem, addr + x));
+    case 0x46:
+      d->dma = value;
+      start_oam_dma(d->mem, value, d->cpu->cycles);
       break;
-    }
 
     case 0x47:
       d->bg_palette = value;
+      if (!d->cgb_mode)
+        display_update_dmg_palette(d->bg_host_colors[0], value);
       break;
 
     case 0x48:
       d->palette0 = value;
+      if (!d->cgb_mode)
+        display_update_dmg_palette(d->sprite_host_colors[0], value);
       break;
 
     case 0x49:
       d->palette1 = value;
+      if (!d->cgb_mode)
+        display_update_dmg_palette(d->sprite_host_colors[1], value);
+      break;
+
+    case 0x51:
+      d->hdma_source = (value << 8) | (d->hdma_source & 0x00F0);
+      break;
+    case 0x52:
+      d->hdma_source = (d->hdma_source & 0xFF00) | (value & 0xF0);
+      break;
+    case 0x53:
+      d->hdma_dest = ((value & 0x1F) << 8) | (d->hdma_dest & 0x00F0);
+      break;
+    case 0x54:
+      d->hdma_dest = (d->hdma_dest & 0x1F00) | (value & 0xF0);
+      break;
+
+    case 0x55:
+      // writing with bit 7 clear while an hblank dma is running stops it
+      if (d->hdma_hblank_active && !(value & 0x80)) {
+        d->hdma_hblank_active = 0;
+        break;
+      }
+      d->hdma_blocks_remaining = (value & 0x7F) + 1;
+      if (value & 0x80)
+        d->hdma_hblank_active = 1;
+      else
+        display_hdma_copy_blocks(d, d->hdma_blocks_remaining);
       break;
 
     case 0x68:
@@ -394,6 +1238,8 @@ void write_lcd_reg(struct display* d, uint8_t addr, uint8_t value) {
       break;
     case 0x69:
       d->bg_color_palette[d->bg_color_palette_index & 0x3F] = value;
+      display_update_cgb_color(d, d->bg_host_colors, d->bg_colors,
+          d->bg_color_palette_index);
       if (d->bg_color_palette_index & 0x80)
         d->bg_color_palette_index = (d->bg_color_palette_index + 1) & 0xBF;
       break;
@@ -403,6 +1249,8 @@ void write_lcd_reg(struct display* d, uint8_t addr, uint8_t value) {
       break;
     case 0x6B:
       d->sprite_color_palette[d->sprite_color_palette_index & 0x3F] = value;
+      display_update_cgb_color(d, d->sprite_host_colors, d->sprite_colors,
+          d->sprite_color_palette_index);
       if (d->sprite_color_palette_index & 0x80)
         d->sprite_color_palette_index = (d->sprite_color_palette_index + 1) & 0xBF;
       break;
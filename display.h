@@ -15,6 +15,111 @@
 #define LCD_CONTROL_BG_DISPLAY              0x01  // 1 = on
 
 #define LCD_CYCLES_PER_FRAME   70224
+#define LCD_CYCLES_PER_LINE    456
+
+// each visible line starts with an oam scan (mode 2), then pixel transfer
+// (mode 3; this is its shortest length, with no window or sprites), then
+// hblank (mode 0) for the rest of the line
+#define LCD_OAM_SCAN_CYCLES        80
+#define LCD_PIXEL_TRANSFER_CYCLES  172
+
+// the first pixel of a line is output about this many cycles into the line
+// (after the 80-cycle oam scan and the first tile fetch); each later pixel
+// follows one cycle after the previous one
+#define LCD_PIXEL_TRANSFER_START_DOT  92
+
+#define LCD_REG_WRITE_LOG_SIZE  64
+
+#define LCD_MAX_SPRITES_PER_LINE  10
+
+// image pixels are packed as RGBA bytes in memory (the host is little-endian),
+// so the framebuffer can be uploaded directly as a GL_RGBA texture
+#define DISPLAY_PIXEL(r, g, b) \
+  (((uint32_t)(r)) | ((uint32_t)(g) << 8) | ((uint32_t)(b) << 16) | 0xFF000000)
+
+// the background and window as grids of tiles, and the sprites, as they'd
+// be drawn with the current register values. tile numbers are indexes into
+// vram's tile data (offset / 16), so a tile has the same number however it's
+// addressed: 0-383 are in bank 0 and 384-767 in bank 1 (CGB only)
+#define DISPLAY_SCENE_BG_COLUMNS      21
+#define DISPLAY_SCENE_BG_ROWS         19
+#define DISPLAY_SCENE_WINDOW_COLUMNS  21
+#define DISPLAY_SCENE_WINDOW_ROWS     18
+
+struct display_scene_sprite {
+  int16_t x; // screen position of the top-left corner; may be off screen
+  int16_t y;
+  uint16_t tile; // the top tile, for 8x16 sprites
+  uint8_t flags; // as in oam
+  uint8_t oam_index;
+};
+
+struct display_scene {
+  uint8_t control; // FF40
+  uint8_t scx;
+  uint8_t scy;
+  uint8_t wx;
+  uint8_t wy;
+  int sprite_height; // 8 or 16
+
+  // bg_tiles[0][0] is the tile under the top-left pixel of the screen, which
+  // is (scx & 7, scy & 7) pixels into it; the grid wraps around the map like
+  // the background does. attrs are always 0 on DMG
+  int bg_visible;
+  uint16_t bg_tiles[DISPLAY_SCENE_BG_ROWS][DISPLAY_SCENE_BG_COLUMNS];
+  uint8_t bg_attrs[DISPLAY_SCENE_BG_ROWS][DISPLAY_SCENE_BG_COLUMNS];
+
+  // window_tiles[y][x] is drawn at (wx - 7 + x * 8, wy + y * 8); only the
+  // parts that are on screen are filled in
+  int window_visible;
+  uint16_t window_tiles[DISPLAY_SCENE_WINDOW_ROWS][DISPLAY_SCENE_WINDOW_COLUMNS];
+  uint8_t window_attrs[DISPLAY_SCENE_WINDOW_ROWS][DISPLAY_SCENE_WINDOW_COLUMNS];
+
+  // sprites at least partly on screen, in oam order (empty if sprites are
+  // disabled)
+  int num_sprites;
+  struct display_scene_sprite sprites[40];
+};
+
+struct lcd_reg_write {
+  uint8_t x; // first pixel drawn with the new value
+  uint8_t addr;
+  uint8_t value;
+};
+
+// state for the dot-accurate renderer. it's only used when built with
+// DISPLAY_PIXEL_FIFO, but is always present so the struct's layout doesn't
+// depend on the build
+struct display_fifo {
+  uint64_t last_cycles;
+  int dot; // within the current line
+  int x; // next pixel to be output
+  int discard; // pixels left to drop at the start of the line (SCX & 7)
+  int fetching_window;
+  int window_used; // the window was drawn on this line
+
+  uint8_t line_sprites[LCD_MAX_SPRITES_PER_LINE]; // from the oam scan
+  int num_line_sprites;
+  uint16_t sprites_fetched; // bitmask over line_sprites
+  int sprite_fetch_index;
+  int sprite_fetch_dots; // remaining time for the current sprite fetch
+
+  int fetcher_delay;
+  int fetcher_step;
+  int fetcher_x; // tile column
+  uint8_t fetcher_tile_id;
+  uint8_t fetcher_attrs;
+  uint8_t fetcher_low;
+  uint8_t fetcher_high;
+
+  uint8_t bg_fifo[8];
+  int bg_fifo_head;
+  int bg_fifo_size;
+
+  // fetched sprite pixels for the current line, indexed by screen x + 8
+  uint8_t sprite_pixels[176];
+  uint8_t sprite_pixel_oam_index[176];
+};
 
 struct display {
   uint8_t control;    // FF40
@@ -32,6 +137,13 @@ struct display {
   uint8_t bg_color_palette_index; // FF68
   uint8_t sprite_color_palette_index; // FF6A
 
+  // CGB vram dma (FF51-FF55). hblank dma copies one 16-byte block at the start
+  // of each hblank; general-purpose dma copies everything at once
+  uint16_t hdma_source; // FF51-FF52
+  uint16_t hdma_dest;   // FF53-FF54; offset within vram
+  uint8_t hdma_blocks_remaining;
+  uint8_t hdma_hblank_active;
+
   union {
     uint8_t bg_color_palette[0x40];
     uint16_t bg_colors[0x20];
@@ -41,32 +153,66 @@ struct display {
     uint16_t sprite_colors[0x20];
   };
 
+  // palettes converted to host pixels, so drawing a pixel is one lookup. on
+  // DMG, bg_host_colors[0] is BGP and sprite_host_colors[0-1] are OBP0-1
+  int cgb_mode;
+  const uint32_t* color_lut; // RGB555 -> host pixel
+  uint32_t bg_host_colors[8][4];
+  uint32_t sprite_host_colors[8][4];
+
+  // writes to FF40-FF4B made while the current line is being drawn, so it can
+  // be drawn in segments with the values that were in effect for each one.
+  // line_start_regs holds FF40-FF4B from before the first logged write
+  uint8_t line_start_regs[12];
+  int num_reg_writes;
+  struct lcd_reg_write reg_writes[LCD_REG_WRITE_LOG_SIZE];
+
+  // when the current line started. during vblank this is the start of line
+  // 144, and LY is computed from it when it's read
+  uint64_t line_start_cycles;
+
+  // internal window line counter; only advances on lines the window is on
+  int window_line;
+  int window_triggered; // LY has matched WY during this frame
+
+  struct display_fifo fifo;
+
   struct regs* cpu; // for interrupts
   struct memory* mem; // for tile data & rendering
 
-  int wait_vblank;
-  uint64_t last_vblank_time;
-  uint64_t pause_time;
-  uint64_t render_freq;
+  uint64_t render_freq; // 0 = only render frames requested explicitly
+  uint64_t num_frames; // frames completed since the lcd was created
+  int render_current_frame;
+  int render_requested;
   int highlight_sprites;
   void (*display_cb)(struct display* d, void* param);
   void* display_cb_arg;
+  // called as soon as each line of a rendered frame is finished, while it's
+  // still in cache; NULL if not needed
+  void (*line_cb)(struct display* d, int y, void* param);
+  void* line_cb_arg;
 
   uint16_t image_color_ids[144][160];
-  float image[144][160][3];
+  uint32_t image[144][160];
 };
 
 void display_init(struct display* d, struct regs* cpu, struct memory* m,
     uint64_t render_freq, void (*display_cb)(struct display* d, void* param),
     void* cb_arg);
 void display_print(FILE* f, struct display* d);
+void display_set_color_correction(struct display* d, int enable);
+void display_set_line_callback(struct display* d,
+    void (*line_cb)(struct display* d, int y, void* param), void* cb_arg);
 
-void display_pause(struct display* d);
-void display_resume(struct display* d);
-
-void display_render_window_opengl(const struct display* d);
+// renders the current frame if none of it has been drawn yet, or the next one
+// otherwise
+void display_request_render(struct display* d);
+// reads the scene straight from vram and oam, without drawing anything. raster
+// effects (register changes partway through a frame) aren't reflected
+void display_get_scene(const struct display* d, struct display_scene* s);
+// draws a finished frame into the current opengl context (display_opengl.c)
+void display_render_window_opengl(const uint32_t image[144][160]);
 
-void display_update(struct display* d, uint64_t cycles);
 uint8_t read_lcd_reg(struct display* d, uint8_t addr);
 void write_lcd_reg(struct display* d, uint8_t addr, uint8_t value);
 
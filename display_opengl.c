@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef MACOSX
+#include "OpenGL/gl.h"
+#include "OpenGL/glu.h"
+#include "GLUT/glut.h"
+#else
+#define GL_GLEXT_PROTOTYPES
+#include "GL/gl.h"
+#include "GL/glext.h"
+#include "GL/glu.h"
+#include "GL/glut.h"
+#endif
+
+#include "display.h"
+
+// drawing finished frames into an opengl window. this is kept apart from the
+// rest of the display so that headless builds don't need opengl
+
+// the framebuffer is uploaded into the top-left corner of a power-of-two
+// texture, since some older (and software) renderers don't support NPOT
+// textures
+#define DISPLAY_TEXTURE_SIZE 256
+
+static GLuint display_texture = 0;
+static GLuint display_pbo = 0;
+
+static void display_init_opengl() {
+  glGenTextures(1, &display_texture);
+  glBindTexture(GL_TEXTURE_2D, display_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, DISPLAY_TEXTURE_SIZE,
+      DISPLAY_TEXTURE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+  // pixel buffer objects are core in 2.1; without them we just upload straight
+  // from the framebuffer, which is still only one call per frame
+  int major = 0, minor = 0;
+  const char* version = (const char*)glGetString(GL_VERSION);
+  if (version && (sscanf(version, "%d.%d", &major, &minor) == 2) &&
+      ((major > 2) || ((major == 2) && (minor >= 1))))
+    glGenBuffers(1, &display_pbo);
+}
+
+void display_render_window_opengl(const uint32_t image[144][160]) {
+
+  static const float xmax = 160.0f / DISPLAY_TEXTURE_SIZE;
+  static const float ymax = 144.0f / DISPLAY_TEXTURE_SIZE;
+
+  if (!display_texture)
+    display_init_opengl();
+
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, display_texture);
+  glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+  if (display_pbo) {
+    // glBufferData with a new data pointer orphans last frame's buffer, so the
+    // driver never has to wait for the previous upload to finish
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, display_pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, 144 * 160 * sizeof(uint32_t), image,
+        GL_STREAM_DRAW);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 160, 144, GL_RGBA,
+        GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  } else
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 160, 144, GL_RGBA,
+        GL_UNSIGNED_BYTE, image);
+
+  glBegin(GL_QUADS);
+  glTexCoord2f(0.0f, 0.0f);
+  glVertex3f(-1.0f, 1.0f, 1.0f);
+  glTexCoord2f(xmax, 0.0f);
+  glVertex3f(1.0f, 1.0f, 1.0f);
+  glTexCoord2f(xmax, ymax);
+  glVertex3f(1.0f, -1.0f, 1.0f);
+  glTexCoord2f(0.0f, ymax);
+  glVertex3f(-1.0f, -1.0f, 1.0f);
+  glEnd();
+
+  glDisable(GL_TEXTURE_2D);
+}
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_pacer.h"
+
+static uint64_t monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// sleeps until the monotonic clock reaches the given time. an absolute
+// deadline doesn't accumulate error from wakeup latency like usleep does
+static void monotonic_sleep_until(uint64_t t) {
+  struct timespec ts;
+#ifdef MACOSX
+  // no clock_nanosleep here; fall back to a relative sleep
+  uint64_t current = monotonic_now();
+  if (current >= t)
+    return;
+  t -= current;
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  while (nanosleep(&ts, &ts) && (errno == EINTR));
+#else
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+void frame_pacer_init(struct frame_pacer* p, uint64_t period_ns) {
+  memset(p, 0, sizeof(*p));
+  p->period_ns = period_ns;
+  p->spin_ns = 250000;
+  frame_pacer_reset(p);
+}
+
+void frame_pacer_set_clock(struct frame_pacer* p,
+    uint64_t (*clock)(void* arg), void* clock_arg) {
+  p->clock = clock;
+  p->clock_arg = clock_arg;
+  frame_pacer_reset(p);
+}
+
+void frame_pacer_reset(struct frame_pacer* p) {
+  p->last_frame_time = frame_pacer_now(p);
+  p->next_frame_time = p->last_frame_time + p->period_ns;
+  p->drift_ns = 0;
+}
+
+uint64_t frame_pacer_now(const struct frame_pacer* p) {
+  return p->clock ? p->clock(p->clock_arg) : monotonic_now();
+}
+
+void frame_pacer_wait(struct frame_pacer* p) {
+
+  // the pacer's clock may not be the monotonic clock, and it may stop (e.g.
+  // when audio playback stalls), so the wait is also bounded in monotonic
+  // time: if the deadline hasn't come a period after it should have, give up
+  // on it and start a new timeline
+  uint64_t t = frame_pacer_now(p);
+  uint64_t mono_limit = monotonic_now() + p->period_ns;
+  if (t < p->next_frame_time)
+    mono_limit += p->next_frame_time - t;
+  int timed_out = 0;
+  while (t < p->next_frame_time) {
+    uint64_t mono = monotonic_now();
+    if (mono >= mono_limit) {
+      timed_out = 1;
+      break;
+    }
+    // sleep until spin_ns before the deadline, converted to monotonic time;
+    // only busy-wait for the last stretch
+    uint64_t remaining = p->next_frame_time - t;
+    if (remaining > p->spin_ns) {
+      uint64_t wake = mono + remaining - p->spin_ns;
+      monotonic_sleep_until((wake < mono_limit) ? wake : mono_limit);
+    }
+    t = frame_pacer_now(p);
+  }
+
+  p->drift_ns = (int64_t)(t - p->next_frame_time);
+  if (p->drift_ns > (int64_t)(p->period_ns / 2))
+    p->num_late_frames++;
+
+  if (timed_out ||
+      (p->drift_ns > (int64_t)(p->period_ns * FRAME_PACER_MAX_LATE_FRAMES))) {
+    // too far behind to catch up (or the clock stopped); skip ahead instead
+    // of running fast
+    p->next_frame_time = t + p->period_ns;
+    p->num_resyncs++;
+  } else {
+    // advance from the deadline, not from now, so small lateness is made up
+    // on the next frame and the long-term rate stays exact
+    p->next_frame_time += p->period_ns;
+  }
+
+  p->interval_samples[p->next_sample] = (int64_t)(t - p->last_frame_time);
+  p->next_sample = (p->next_sample + 1) % FRAME_PACER_NUM_SAMPLES;
+  if (p->num_samples < FRAME_PACER_NUM_SAMPLES)
+    p->num_samples++;
+  p->last_frame_time = t;
+  p->num_frames++;
+}
+
+static int compare_int64(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+void frame_pacer_print_stats(FILE* f, const struct frame_pacer* p) {
+  fprintf(f, "frame pacer: %llu frames, %llu late, %llu resyncs, period %.3lf ms\n",
+      (unsigned long long)p->num_frames, (unsigned long long)p->num_late_frames,
+      (unsigned long long)p->num_resyncs, (double)p->period_ns / 1000000.0);
+  if (!p->num_samples)
+    return;
+
+  int64_t sorted[FRAME_PACER_NUM_SAMPLES];
+  memcpy(sorted, p->interval_samples, p->num_samples * sizeof(int64_t));
+  qsort(sorted, p->num_samples, sizeof(int64_t), compare_int64);
+
+  // jitter is reported as the frame interval's deviation from the period
+  static const int percentiles[] = {50, 90, 99, 100};
+  int x;
+  fprintf(f, "frame pacer: jitter over last %u frames:", p->num_samples);
+  for (x = 0; x < 4; x++) {
+    uint32_t index = ((p->num_samples - 1) * percentiles[x]) / 100;
+    fprintf(f, " p%d=%+.3lf ms", percentiles[x],
+        (double)(sorted[index] - (int64_t)p->period_ns) / 1000000.0);
+  }
+  fprintf(f, "\n");
+}
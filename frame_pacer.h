@@ -0,0 +1,49 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// number of recent frame intervals kept for the jitter statistics
+#define FRAME_PACER_NUM_SAMPLES  1024
+
+// if a frame is later than this many periods (e.g. after sitting in the
+// debugger), the pacer gives up on catching up and starts a new timeline
+#define FRAME_PACER_MAX_LATE_FRAMES  4
+
+// the emulated hardware's frame rate is 4194304 / 70224 = 59.7275 Hz
+#define FRAME_PACER_EMULATED_PERIOD_NS  16742706
+
+struct frame_pacer {
+  uint64_t period_ns;
+  uint64_t spin_ns; // busy-wait this long at the end of each sleep
+
+  // where time comes from; NULL means CLOCK_MONOTONIC. this can be replaced by
+  // another clock (e.g. the audio device's playback position) to lock the
+  // emulation rate to it instead
+  uint64_t (*clock)(void* arg);
+  void* clock_arg;
+
+  uint64_t next_frame_time;
+  uint64_t last_frame_time;
+  int64_t drift_ns; // how late the last frame was (negative = early)
+
+  uint64_t num_frames;
+  uint64_t num_late_frames;
+  uint64_t num_resyncs;
+  uint32_t num_samples;
+  uint32_t next_sample;
+  int64_t interval_samples[FRAME_PACER_NUM_SAMPLES];
+};
+
+void frame_pacer_init(struct frame_pacer* p, uint64_t period_ns);
+void frame_pacer_set_clock(struct frame_pacer* p,
+    uint64_t (*clock)(void* arg), void* clock_arg);
+void frame_pacer_reset(struct frame_pacer* p);
+
+uint64_t frame_pacer_now(const struct frame_pacer* p);
+void frame_pacer_wait(struct frame_pacer* p);
+
+void frame_pacer_print_stats(FILE* f, const struct frame_pacer* p);
+
+#endif // FRAME_PACER_H
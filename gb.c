@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gb.h"
+
+
+
+struct gb* gb_create(union cart_data* cart) {
+  struct gb* gb = (struct gb*)calloc(1, sizeof(struct gb));
+  if (!gb) {
+    fprintf(stderr, "failed to allocate emulator instance\n");
+    return NULL;
+  }
+  gb->cart = cart;
+
+  gb->mem = create_memory(cart);
+  if (!gb->mem) {
+    fprintf(stderr, "failed to create memory\n");
+    free(gb);
+    return NULL;
+  }
+  gb->cpu = create_cpu();
+  if (!gb->cpu) {
+    fprintf(stderr, "failed to create cpu\n");
+    delete_memory(gb->mem);
+    free(gb);
+    return NULL;
+  }
+
+  // frames are only drawn when gb_step_frames asks for them, and nobody can
+  // hear the audio, so the apu only has to keep its registers right
+  display_init(&gb->lcd, gb->cpu, gb->mem, 0, NULL, NULL);
+  serial_init(&gb->ser, gb->cpu, gb->mem);
+  timer_init(&gb->tim, gb->cpu, gb->mem);
+  audio_init(&gb->aud, gb->cpu, gb->mem);
+  audio_set_mode(&gb->aud, AUDIO_MODE_REGISTERS_ONLY);
+  input_init(&gb->inp, gb->cpu);
+
+  add_device(gb->mem, DEVICE_DISPLAY, &gb->lcd);
+  add_device(gb->mem, DEVICE_SERIAL, &gb->ser);
+  add_device(gb->mem, DEVICE_TIMER, &gb->tim);
+  add_device(gb->mem, DEVICE_AUDIO, &gb->aud);
+  add_device(gb->mem, DEVICE_CPU, gb->cpu);
+  add_device(gb->mem, DEVICE_INPUT, &gb->inp);
+
+  // the views never move, so they're only filled in once
+  gb->frame.image = (const uint32_t (*)[160])gb->lcd.image;
+  gb->frame.color_ids = (const uint16_t (*)[160])gb->lcd.image_color_ids;
+  gb->frame.wram = gb->mem->wram;
+  gb->frame.vram = gb->mem->vram;
+  gb->frame.hram = gb->mem->hram;
+  gb->frame.oam = gb->mem->sprite_table;
+  gb->frame.eram = gb->mem->eram;
+  gb->frame.eram_size = gb->mem->eram ?
+      ram_size_for_ram_size_code(cart->header.ram_size) : 0;
+  return gb;
+}
+
+void gb_delete(struct gb* gb) {
+  if (gb) {
+    serial_link_disconnect(&gb->ser);
+    delete_cpu(gb->cpu);
+    delete_memory(gb->mem);
+    free(gb);
+  }
+}
+
+void gb_set_buttons(struct gb* gb, int buttons) {
+  input_set_keys(&gb->inp, buttons);
+}
+
+// runs until the lcd finishes the current frame. a frame that was in progress
+// when the lcd was turned off is over after LCD_CYCLES_PER_FRAME cycles
+static int gb_run_frame(struct gb* gb) {
+  uint64_t num_frames = gb->lcd.num_frames;
+  uint64_t end_cycles = gb->cpu->cycles + LCD_CYCLES_PER_FRAME;
+  while (gb->lcd.num_frames == num_frames) {
+    if (!(gb->lcd.control & LCD_CONTROL_ENABLE) &&
+        (gb->cpu->cycles >= end_cycles))
+      break;
+    if (run_cycle(gb->cpu, gb->mem))
+      return -1;
+  }
+  return 0;
+}
+
+int gb_run_frames(struct gb* gb, int num_frames, int render) {
+  int x;
+  for (x = 0; x < num_frames; x++) {
+    if (render && (x == num_frames - 1))
+      display_request_render(&gb->lcd);
+    if (gb_run_frame(gb))
+      return -1;
+  }
+  return 0;
+}
+
+const struct gb_frame* gb_step_frames(struct gb* gb, int num_frames) {
+  if (gb_run_frames(gb, num_frames, 1))
+    return NULL;
+
+  gb->frame.frame_num = gb->lcd.num_frames;
+  gb->frame.cycles = gb->cpu->cycles;
+  return &gb->frame;
+}
+
+size_t gb_frame_size(int format) {
+  switch (format) {
+    case GB_FRAME_FORMAT_COLOR_IDS:
+    case GB_FRAME_FORMAT_GRAY8:
+      return GB_FRAME_WIDTH * GB_FRAME_HEIGHT;
+    case GB_FRAME_FORMAT_PACKED2:
+      return GB_FRAME_WIDTH * GB_FRAME_HEIGHT / 4;
+    case GB_FRAME_FORMAT_GRAY8_HALF:
+      return GB_FRAME_WIDTH * GB_FRAME_HEIGHT / 4;
+    case GB_FRAME_FORMAT_GRAY8_QUARTER:
+      return GB_FRAME_WIDTH * GB_FRAME_HEIGHT / 16;
+    default:
+      return 0;
+  }
+}
+
+// image pixels are RGBA bytes; this uses the usual 0.299/0.587/0.114 weights
+// in 8-bit fixed point
+static inline uint8_t gb_gray(uint32_t p) {
+  return ((p & 0xFF) * 77 + ((p >> 8) & 0xFF) * 150 +
+      ((p >> 16) & 0xFF) * 29) >> 8;
+}
+
+// sums the grayscale values of each group of block_size pixels in each of
+// block_size lines ending at line y, and writes their averages. shift is
+// log2(block_size * block_size)
+static void gb_write_gray8_blocks(const struct display* d, int y,
+    int block_size, int shift, uint8_t* dest) {
+  uint16_t sums[GB_FRAME_WIDTH / 2];
+  int num_blocks = GB_FRAME_WIDTH / block_size, x, z, w;
+  memset(sums, 0, sizeof(sums));
+  for (z = y - block_size + 1; z <= y; z++) {
+    const uint32_t* line = d->image[z];
+    for (x = 0; x < num_blocks; x++)
+      for (w = 0; w < block_size; w++)
+        sums[x] += gb_gray(line[x * block_size + w]);
+  }
+  for (x = 0; x < num_blocks; x++)
+    dest[x] = sums[x] >> shift;
+}
+
+// converts line y of the image into the frame at dest. the downsampled
+// formats write each output row when the last line it covers is done, since
+// the lines above it are still in the image by then
+static void gb_write_frame_line(const struct display* d, int format, int y,
+    uint8_t* dest) {
+  const uint16_t* color_ids = d->image_color_ids[y];
+  const uint32_t* line = d->image[y];
+  int x;
+
+  switch (format) {
+    case GB_FRAME_FORMAT_COLOR_IDS:
+      dest += y * GB_FRAME_WIDTH;
+      for (x = 0; x < GB_FRAME_WIDTH; x++)
+        dest[x] = (color_ids[x] > 3) ? 0 : color_ids[x];
+      break;
+
+    case GB_FRAME_FORMAT_GRAY8:
+      dest += y * GB_FRAME_WIDTH;
+      for (x = 0; x < GB_FRAME_WIDTH; x++)
+        dest[x] = gb_gray(line[x]);
+      break;
+
+    case GB_FRAME_FORMAT_PACKED2:
+      dest += y * (GB_FRAME_WIDTH / 4);
+      for (x = 0; x < GB_FRAME_WIDTH / 4; x++) {
+        const uint16_t* ids = &color_ids[x * 4];
+        dest[x] = ((ids[0] > 3) ? 0 : ids[0]) |
+            (((ids[1] > 3) ? 0 : ids[1]) << 2) |
+            (((ids[2] > 3) ? 0 : ids[2]) << 4) |
+            (((ids[3] > 3) ? 0 : ids[3]) << 6);
+      }
+      break;
+
+    case GB_FRAME_FORMAT_GRAY8_HALF:
+      if ((y & 1) == 1)
+        gb_write_gray8_blocks(d, y, 2, 2, dest + (y / 2) * (GB_FRAME_WIDTH / 2));
+      break;
+
+    case GB_FRAME_FORMAT_GRAY8_QUARTER:
+      if ((y & 3) == 3)
+        gb_write_gray8_blocks(d, y, 4, 4, dest + (y / 4) * (GB_FRAME_WIDTH / 4));
+      break;
+  }
+}
+
+static void gb_line_cb(struct display* d, int y, void* arg) {
+  struct gb* gb = (struct gb*)arg;
+  gb_write_frame_line(d, gb->frame_format, y, gb->frame_dest);
+}
+
+void gb_set_frame_output(struct gb* gb, int format, uint8_t* dest) {
+  if (!dest)
+    format = GB_FRAME_FORMAT_NONE;
+  gb->frame_format = format;
+  gb->frame_dest = dest;
+  display_set_line_callback(&gb->lcd,
+      (format == GB_FRAME_FORMAT_NONE) ? NULL : gb_line_cb, gb);
+}
+
+void gb_write_frame(const struct gb* gb, int format, uint8_t* dest) {
+  int y;
+  for (y = 0; y < GB_FRAME_HEIGHT; y++)
+    gb_write_frame_line(&gb->lcd, format, y, dest);
+}
+
+void gb_get_scene(const struct gb* gb, struct display_scene* scene) {
+  display_get_scene(&gb->lcd, scene);
+}
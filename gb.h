@@ -0,0 +1,113 @@
+#ifndef GB_H
+#define GB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cart.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "display.h"
+#include "serial.h"
+#include "timer.h"
+#include "audio.h"
+#include "input.h"
+
+// an emulator instance with no window, audio output or terminal input, for
+// programs that drive the emulator themselves (e.g. bots). it's stepped a
+// whole number of frames at a time with the buttons held in a fixed state:
+//
+//   struct gb* gb = gb_create(cart);
+//   for (;;) {
+//     gb_set_buttons(gb, KEY_A | KEY_RIGHT);
+//     const struct gb_frame* f = gb_step_frames(gb, 4);
+//     ... look at f->image, f->wram, etc. ...
+//   }
+//
+// nothing is copied: all of the pointers in gb_frame point into the
+// instance's own state, and stay valid until it's deleted.
+//
+// two instances can be linked with serial_link_connect(link, &a->ser,
+// &b->ser). they then have to be stepped on separate threads, since each may
+// wait for the other to catch up around a transfer (so they can't be in the
+// same gb_batch_step call either). deleting an instance disconnects it.
+
+// compact frame formats, for gb_set_frame_output and gb_write_frame. rows are
+// stored top to bottom with no padding
+#define GB_FRAME_FORMAT_NONE          0
+#define GB_FRAME_FORMAT_COLOR_IDS     1 // 160x144, one byte per pixel: 0-3,
+                                        // before palettes are applied
+#define GB_FRAME_FORMAT_GRAY8         2 // 160x144, luminance of the displayed
+                                        // colors
+#define GB_FRAME_FORMAT_PACKED2       3 // 160x144 color ids, 4 pixels per byte
+                                        // (leftmost in the low 2 bits)
+#define GB_FRAME_FORMAT_GRAY8_HALF    4 // 80x72, average of each 2x2 block
+#define GB_FRAME_FORMAT_GRAY8_QUARTER 5 // 40x36, average of each 4x4 block
+
+#define GB_FRAME_WIDTH   160
+#define GB_FRAME_HEIGHT  144
+
+// the results of a step. only image and color_ids depend on rendering, and
+// they hold the last frame completed by the step; everything else is live
+struct gb_frame {
+  const uint32_t (*image)[160]; // [144][160]; see DISPLAY_PIXEL
+  const uint16_t (*color_ids)[160]; // [144][160]; before palettes are applied
+  const uint8_t* wram; // 0x8000 bytes (all 8 banks; DMG uses the first 2)
+  const uint8_t* vram; // 0x4000 bytes (both banks)
+  const uint8_t* hram; // 0x80 bytes
+  const uint8_t* oam; // 0xA0 bytes
+  const uint8_t* eram; // NULL if the cart has no ram
+  int eram_size;
+  uint64_t frame_num; // frames completed by the lcd so far
+  uint64_t cycles;
+};
+
+struct gb {
+  struct regs* cpu;
+  struct memory* mem;
+  union cart_data* cart; // not owned; any number of instances can share one
+  struct display lcd;
+  struct serial ser;
+  struct timer tim;
+  struct audio aud;
+  struct input inp;
+  struct gb_frame frame;
+
+  // where rendered lines are converted to, if anywhere
+  int frame_format;
+  uint8_t* frame_dest;
+};
+
+// returns NULL on failure. the cart must outlive the instance
+struct gb* gb_create(union cart_data* cart);
+void gb_delete(struct gb* gb);
+
+// sets which buttons are held (a mask of KEY_* values) from now on. pressing a
+// button raises the joypad interrupt if its group is selected in P1
+void gb_set_buttons(struct gb* gb, int buttons);
+
+// runs until the lcd has completed num_frames frames (while the lcd is off,
+// each LCD_CYCLES_PER_FRAME cycles counts as a frame) and renders only the
+// last one. returns NULL if the cpu hit an invalid opcode
+const struct gb_frame* gb_step_frames(struct gb* gb, int num_frames);
+
+// same as gb_step_frames, but only renders the last frame if render is
+// nonzero. returns 0 on success or -1 if the cpu hit an invalid opcode
+int gb_run_frames(struct gb* gb, int num_frames, int render);
+
+// returns the size of a frame in the given format, in bytes
+size_t gb_frame_size(int format);
+// converts each line of rendered frames into dest (gb_frame_size(format)
+// bytes) as soon as it's drawn, so a step leaves its last frame there with no
+// separate conversion pass. GB_FRAME_FORMAT_NONE (or a NULL dest) turns this
+// off. dest must stay valid until then
+void gb_set_frame_output(struct gb* gb, int format, uint8_t* dest);
+// converts the last rendered frame into the given format after the fact
+void gb_write_frame(const struct gb* gb, int format, uint8_t* dest);
+
+// describes the background, window and sprites in terms of tiles, read
+// straight from vram and oam. this doesn't need the frame to be rendered, so
+// gb_run_frames(gb, n, 0) followed by this is much cheaper than pixels
+void gb_get_scene(const struct gb* gb, struct display_scene* scene);
+
+#endif // GB_H
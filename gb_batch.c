@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gb_batch.h"
+
+
+
+static void gb_batch_run_instance(struct gb_batch* b, int index) {
+  const struct gb_batch_output* out = b->output;
+  struct gb* gb = b->instances[index];
+  int render = out->frames && (out->frame_format != GB_FRAME_FORMAT_NONE);
+
+  // the frame is converted into its slot line by line as it's drawn
+  gb_set_buttons(gb, b->buttons ? b->buttons[index] : 0);
+  if (render)
+    gb_set_frame_output(gb, out->frame_format,
+        out->frames + index * gb_frame_size(out->frame_format));
+  int err = gb_run_frames(gb, b->num_frames, render);
+  if (render)
+    gb_set_frame_output(gb, GB_FRAME_FORMAT_NONE, NULL);
+  if (out->errors)
+    out->errors[index] = err ? 1 : 0;
+  if (err) {
+    atomic_fetch_add(&b->num_errors, 1);
+    return;
+  }
+
+  if (out->scenes)
+    gb_get_scene(gb, &out->scenes[index]);
+  if (out->wram)
+    memcpy(out->wram + index * out->wram_size, gb->mem->wram + out->wram_offset,
+        out->wram_size);
+}
+
+// runs instances until there are none left in the current step
+static void gb_batch_run_instances(struct gb_batch* b) {
+  for (;;) {
+    int start = atomic_fetch_add(&b->next_instance, GB_BATCH_CLAIM_SIZE);
+    if (start >= b->num_instances)
+      break;
+    int end = start + GB_BATCH_CLAIM_SIZE;
+    if (end > b->num_instances)
+      end = b->num_instances;
+    for (; start < end; start++)
+      gb_batch_run_instance(b, start);
+  }
+}
+
+static void* gb_batch_thread_fn(void* arg) {
+  struct gb_batch* b = (struct gb_batch*)arg;
+  uint64_t last_step_num = 0;
+
+  pthread_mutex_lock(&b->lock);
+  for (;;) {
+    while (!b->should_exit && (b->step_num == last_step_num))
+      pthread_cond_wait(&b->step_started, &b->lock);
+    if (b->should_exit)
+      break;
+    last_step_num = b->step_num;
+    pthread_mutex_unlock(&b->lock);
+
+    gb_batch_run_instances(b);
+
+    pthread_mutex_lock(&b->lock);
+    if (--b->num_workers_busy == 0)
+      pthread_cond_signal(&b->step_finished);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+int gb_batch_init(struct gb_batch* b, int num_threads) {
+  memset(b, 0, sizeof(*b));
+  if (num_threads < 0) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (num_cpus > 1) ? (num_cpus - 1) : 0;
+  }
+
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->step_started, NULL);
+  pthread_cond_init(&b->step_finished, NULL);
+  atomic_init(&b->next_instance, 0);
+  atomic_init(&b->num_errors, 0);
+
+  if (num_threads) {
+    b->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (!b->threads) {
+      fprintf(stderr, "failed to allocate batch threads\n");
+      gb_batch_free(b);
+      return -1;
+    }
+  }
+  for (; b->num_threads < num_threads; b->num_threads++) {
+    if (pthread_create(&b->threads[b->num_threads], NULL, gb_batch_thread_fn,
+        b)) {
+      fprintf(stderr, "failed to create batch thread\n");
+      gb_batch_free(b);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void gb_batch_free(struct gb_batch* b) {
+  pthread_mutex_lock(&b->lock);
+  b->should_exit = 1;
+  pthread_cond_broadcast(&b->step_started);
+  pthread_mutex_unlock(&b->lock);
+
+  int x;
+  for (x = 0; x < b->num_threads; x++)
+    pthread_join(b->threads[x], NULL);
+  free(b->threads);
+  b->threads = NULL;
+  b->num_threads = 0;
+
+  pthread_cond_destroy(&b->step_finished);
+  pthread_cond_destroy(&b->step_started);
+  pthread_mutex_destroy(&b->lock);
+}
+
+int gb_batch_step(struct gb_batch* b, struct gb* const* instances,
+    const int* buttons, int num_instances, int num_frames,
+    const struct gb_batch_output* output) {
+  if (output->wram &&
+      ((uint32_t)output->wram_offset + output->wram_size > 0x8000)) {
+    fprintf(stderr, "wram slice %04X+%04X is out of range\n",
+        output->wram_offset, output->wram_size);
+    return -1;
+  }
+
+  b->instances = instances;
+  b->buttons = buttons;
+  b->num_instances = num_instances;
+  b->num_frames = num_frames;
+  b->output = output;
+  atomic_store(&b->next_instance, 0);
+  atomic_store(&b->num_errors, 0);
+
+  // small batches aren't worth waking anyone up for
+  int use_threads = b->num_threads && (num_instances > GB_BATCH_CLAIM_SIZE);
+  if (use_threads) {
+    pthread_mutex_lock(&b->lock);
+    b->step_num++;
+    b->num_workers_busy = b->num_threads;
+    pthread_cond_broadcast(&b->step_started);
+    pthread_mutex_unlock(&b->lock);
+  }
+
+  gb_batch_run_instances(b);
+
+  if (use_threads) {
+    pthread_mutex_lock(&b->lock);
+    while (b->num_workers_busy)
+      pthread_cond_wait(&b->step_finished, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+  }
+
+  return atomic_load(&b->num_errors);
+}
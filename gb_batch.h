@@ -0,0 +1,71 @@
+#ifndef GB_BATCH_H
+#define GB_BATCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gb.h"
+
+// steps many emulator instances at once on a pool of threads, for running
+// lots of environments side by side. each call hands out the instances to the
+// workers (and the calling thread) a few at a time, and returns when all of
+// them are done. the observations go straight into caller-provided arrays
+// with one slot per instance, so nothing is allocated per step.
+
+// instances are claimed this many at a time, so the workers don't all contend
+// on the shared counter when there are thousands of small ones
+#define GB_BATCH_CLAIM_SIZE  8
+
+// where a batch step puts its observations. any array can be NULL to skip it
+struct gb_batch_output {
+  int frame_format; // GB_FRAME_FORMAT_*; converted as each line is drawn
+  uint8_t* frames; // num_instances * gb_frame_size(frame_format) bytes
+
+  // a slice of wram (offset is within all 8 banks, as in gb_frame.wram)
+  uint16_t wram_offset;
+  uint16_t wram_size;
+  uint8_t* wram; // num_instances * wram_size bytes
+
+  struct display_scene* scenes; // num_instances entries
+
+  int8_t* errors; // num_instances entries; 1 if the cpu hit an invalid opcode
+};
+
+struct gb_batch {
+  pthread_t* threads;
+  int num_threads;
+
+  // the current step. workers wait for step_num to change, then claim
+  // instances until there are none left
+  pthread_mutex_t lock;
+  pthread_cond_t step_started;
+  pthread_cond_t step_finished;
+  uint64_t step_num;
+  int num_workers_busy;
+  int should_exit;
+
+  struct gb* const* instances;
+  const int* buttons;
+  int num_instances;
+  int num_frames;
+  const struct gb_batch_output* output;
+  atomic_int next_instance;
+  atomic_int num_errors;
+};
+
+// num_threads is the number of extra threads to start (the calling thread
+// also runs instances during each step); -1 means one per cpu, less one
+int gb_batch_init(struct gb_batch* b, int num_threads);
+void gb_batch_free(struct gb_batch* b);
+
+// sets each instance's buttons to buttons[x] (a mask of KEY_* values), runs it
+// for num_frames frames, and writes its observations into slot x of output.
+// returns the number of instances that hit an invalid opcode, or -1 (without
+// running anything) if the wram slice doesn't fit in wram
+int gb_batch_step(struct gb_batch* b, struct gb* const* instances,
+    const int* buttons, int num_instances, int num_frames,
+    const struct gb_batch_output* output);
+
+#endif // GB_BATCH_H
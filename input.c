@@ -1,7 +1,14 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "input.h"
@@ -12,103 +19,440 @@
 void input_init(struct input* i, struct regs* cpu) {
   memset(i, 0, sizeof(*i));
   i->cpu = cpu;
-}
 
-int input_read_byte(int fd) {
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
+  unsigned int x;
+  for (x = 0; x < INPUT_QUEUE_SIZE; x++)
+    atomic_init(&i->queue[x].seq, x);
+  atomic_init(&i->queue_write_pos, 0);
+  atomic_init(&i->num_dropped_events, 0);
+  atomic_init(&i->pending_releases, 0);
 
-  struct timeval tv;
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  select(fd + 1, &fds, NULL, NULL, &tv);
+  i->tty_fd = -1;
+  i->device_fd = -1;
+  i->wake_fds[0] = -1;
+  i->wake_fds[1] = -1;
+}
 
-  if (!FD_ISSET(fd, &fds)) {
-    return -1;
+// the low 4 bits of P1 (0 = pressed) for whichever button groups are selected
+static uint8_t input_lines(const struct input* i) {
+  int pressed = 0;
+  if (i->selected & SELECTED_KEYS)
+    pressed |= i->keys_pressed & 0x0F;
+  if (i->selected & SELECTED_DIRECTIONS)
+    pressed |= (i->keys_pressed >> 4) & 0x0F;
+  return (~pressed) & 0x0F;
+}
+
+// the joypad interrupt is raised when any of P1's input lines goes from high
+// to low, which can happen either because a button was pressed or because a
+// write to P1 selected a group with a button already held down. this also
+// brings the cpu out of stop mode
+static void input_set_state(struct input* i, int keys_pressed, int selected) {
+  uint8_t prev_lines = input_lines(i);
+  int keys_changed = (keys_pressed != i->keys_pressed);
+  i->keys_pressed = keys_pressed;
+  i->selected = selected;
+  if (prev_lines & ~input_lines(i)) {
+    signal_interrupt(i->cpu, INTERRUPT_JOYPAD, 1);
+    i->cpu->stop = 0;
   }
+  if (keys_changed && i->keys_cb)
+    i->keys_cb(i->keys_cb_arg, keys_pressed);
+}
 
-  int data = 0;
-  if (read(fd, &data, 1) == 0)
-    data = 4;  // ctrl+d
-  return data;
+void input_set_keys(struct input* i, int keys_pressed) {
+  input_set_state(i, keys_pressed & 0xFF, i->selected);
 }
 
 void input_key_press(struct input* i, int key) {
-  if (i->keys_pressed & key)
-    return;
-
-  i->keys_pressed |= key;
-  signal_interrupt(i->cpu, INTERRUPT_JOYPAD, 1);
+  input_set_keys(i, i->keys_pressed | key);
 }
 
 void input_key_release(struct input* i, int key) {
-  if (!(i->keys_pressed & key))
-    return;
+  input_set_keys(i, i->keys_pressed & ~key);
+}
 
-  i->keys_pressed &= ~key;
+void input_set_keys_callback(struct input* i,
+    void (*keys_cb)(void* arg, int keys_pressed), void* cb_arg) {
+  i->keys_cb = keys_cb;
+  i->keys_cb_arg = cb_arg;
 }
 
-void input_update(struct input* i, uint64_t cycles) {
-  if (!i->update_frequency || (cycles % i->update_frequency))
-    return;
+// P1's select bits are active-low: bit 4 selects the directions and bit 5
+// selects the other buttons; both can be selected at once
+uint8_t read_input_register(struct input* i, uint8_t addr) {
+  return 0xC0 | (0x30 & ~(i->selected << 4)) | input_lines(i);
+}
 
-  i->keys_pressed = 0;
+void write_input_register(struct input* i, uint8_t addr, uint8_t value) {
+  input_set_state(i, i->keys_pressed, (~value >> 4) & 0x03);
+}
 
-  if (i->fd < 0)
-    return;
 
-  int x;
-  int data[16];
-  for (x = 0; x < 15; x++)
-    data[x] = input_read_byte(i->fd);
-  data[15] = -1;
 
-  for (x = 0; data[x] != -1; x++) {
-    if (data[x] == 4) // ctrl+d
+///////////////////////////////////////////////////////////////////////////////
+// event queue
+
+int input_push_event(struct input* i, int type, int key) {
+  // a release that didn't fit in the queue is superseded by pressing the key
+  // again, which has to come after it
+  if (type == INPUT_EVENT_PRESS)
+    atomic_fetch_and(&i->pending_releases, ~key);
+
+  // claim the next slot; if another producer gets it first, try the one after
+  unsigned int pos = atomic_load_explicit(&i->queue_write_pos,
+      memory_order_relaxed);
+  struct input_queue_slot* slot;
+  for (;;) {
+    slot = &i->queue[pos & (INPUT_QUEUE_SIZE - 1)];
+    int diff = (int)(atomic_load_explicit(&slot->seq, memory_order_acquire) -
+        pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&i->queue_write_pos, &pos,
+          pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // the consumer hasn't gotten to this slot since it was last filled
+      if (type == INPUT_EVENT_RELEASE) {
+        atomic_fetch_or(&i->pending_releases, key);
+        return 0;
+      }
+      atomic_fetch_add(&i->num_dropped_events, 1);
+      return -1;
+    } else
+      pos = atomic_load_explicit(&i->queue_write_pos, memory_order_relaxed);
+  }
+
+  slot->type = type;
+  slot->key = key;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+void input_process_events(struct input* i) {
+  for (;;) {
+    struct input_queue_slot* slot =
+        &i->queue[i->queue_read_pos & (INPUT_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+        i->queue_read_pos + 1)
+      break;
+
+    if (slot->type == INPUT_EVENT_PRESS)
+      input_key_press(i, slot->key);
+    else if (slot->type == INPUT_EVENT_RELEASE)
+      input_key_release(i, slot->key);
+    else if (slot->type == INPUT_EVENT_DEBUG)
       signal_debug_interrupt(i->cpu, "requested by user");
-    if ((x < 13) && (data[x] == 0x1B) && (data[x + 1] == 0x5B)) {
+
+    // hand the slot back to the producers for the next time around
+    atomic_store_explicit(&slot->seq, i->queue_read_pos + INPUT_QUEUE_SIZE,
+        memory_order_release);
+    i->queue_read_pos++;
+  }
+
+  int released = atomic_exchange(&i->pending_releases, 0);
+  if (released)
+    input_key_release(i, released);
+}
+
+void input_print_stats(FILE* stream, struct input* i) {
+  unsigned int num_dropped = atomic_load(&i->num_dropped_events);
+  if (num_dropped)
+    fprintf(stream, "input: %u events dropped (queue full)\n", num_dropped);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// input thread
+
+static uint64_t input_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// when each key read from the terminal should be released (0 = not held)
+struct input_tty_state {
+  uint64_t release_time[8];
+};
+
+static void input_tty_key(struct input* i, struct input_tty_state* tty,
+    int key) {
+  int index = __builtin_ctz(key);
+  if (!tty->release_time[index])
+    input_push_event(i, INPUT_EVENT_PRESS, key);
+  tty->release_time[index] = input_now() + INPUT_TTY_HOLD_USECS;
+}
+
+// returns -1 at end of file
+static int input_read_tty(struct input* i, struct input_tty_state* tty) {
+  uint8_t data[64];
+  ssize_t bytes_read = read(i->tty_fd, data, sizeof(data));
+  if (bytes_read < 0)
+    return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+  if (bytes_read == 0) {
+    input_push_event(i, INPUT_EVENT_DEBUG, 0); // ctrl+d in canonical mode
+    return -1;
+  }
+
+  int x;
+  for (x = 0; x < bytes_read; x++) {
+    if (data[x] == 4) // ctrl+d
+      input_push_event(i, INPUT_EVENT_DEBUG, 0);
+    if ((x < bytes_read - 2) && (data[x] == 0x1B) && (data[x + 1] == 0x5B)) {
       if (data[x + 2] == 'A')
-        input_key_press(i, KEY_UP);
+        input_tty_key(i, tty, KEY_UP);
       if (data[x + 2] == 'B')
-        input_key_press(i, KEY_DOWN);
+        input_tty_key(i, tty, KEY_DOWN);
       if (data[x + 2] == 'C')
-        input_key_press(i, KEY_RIGHT);
+        input_tty_key(i, tty, KEY_RIGHT);
       if (data[x + 2] == 'D')
-        input_key_press(i, KEY_LEFT);
+        input_tty_key(i, tty, KEY_LEFT);
       x += 2;
     } else {
-    	if (data[x] == ' ')
-        input_key_press(i, KEY_A);
-    	if (data[x] == '\n')
-        input_key_press(i, KEY_START);
-    	if (data[x] == '\t')
-        input_key_press(i, KEY_B);
-    	if (data[x] == 'Z')
-        input_key_press(i, KEY_SELECT);
+      if (data[x] == ' ')
+        input_tty_key(i, tty, KEY_A);
+      if (data[x] == '\n')
+        input_tty_key(i, tty, KEY_START);
+      if (data[x] == '\t')
+        input_tty_key(i, tty, KEY_B);
+      if (data[x] == 'Z')
+        input_tty_key(i, tty, KEY_SELECT);
     }
   }
-  // apparently the interrupt doesn't work with CGB hardware; should we even implement it? lol
+  return 0;
 }
 
-uint8_t read_input_register(struct input* i, uint8_t addr) {
-  if (i->selected == SELECTED_KEYS)
-    return (~i->keys_pressed) & 0x0F;
-  if (i->selected == SELECTED_DIRECTIONS)
-    return ((~i->keys_pressed) >> 4) & 0x0F;
+// releases terminal keys that haven't repeated recently enough, and returns
+// how long poll() can wait before the next one is due (-1 = forever)
+static int input_release_tty_keys(struct input* i,
+    struct input_tty_state* tty) {
+  uint64_t now = input_now(), next_release_time = 0;
+  int x;
+  for (x = 0; x < 8; x++) {
+    if (!tty->release_time[x])
+      continue;
+    if (tty->release_time[x] <= now) {
+      input_push_event(i, INPUT_EVENT_RELEASE, 1 << x);
+      tty->release_time[x] = 0;
+    } else if (!next_release_time || (tty->release_time[x] < next_release_time))
+      next_release_time = tty->release_time[x];
+  }
+  return next_release_time ? (int)((next_release_time - now + 999) / 1000) : -1;
+}
+
+#ifdef __linux__
+
+// linux/input.h can't be included here, since its KEY_* names collide with
+// ours; these are the parts of it we need
+struct input_evdev_event {
+  struct timeval time;
+  uint16_t type;
+  uint16_t code;
+  int32_t value; // 0 = released, 1 = pressed, 2 = autorepeat
+};
+#define INPUT_EVDEV_EV_KEY  0x01
+
+// keyboard keys (same bindings as the window) and gamepad buttons
+static int input_key_for_evdev_code(uint16_t code) {
+  switch (code) {
+    case 103: // KEY_UP
+    case 0x220: // BTN_DPAD_UP
+      return KEY_UP;
+    case 108: // KEY_DOWN
+    case 0x221: // BTN_DPAD_DOWN
+      return KEY_DOWN;
+    case 105: // KEY_LEFT
+    case 0x222: // BTN_DPAD_LEFT
+      return KEY_LEFT;
+    case 106: // KEY_RIGHT
+    case 0x223: // BTN_DPAD_RIGHT
+      return KEY_RIGHT;
+    case 57: // KEY_SPACE
+    case 0x130: // BTN_SOUTH
+      return KEY_A;
+    case 15: // KEY_TAB
+    case 0x131: // BTN_EAST
+      return KEY_B;
+    case 28: // KEY_ENTER
+    case 0x13B: // BTN_START
+      return KEY_START;
+    case 44: // KEY_Z
+    case 0x13A: // BTN_SELECT
+      return KEY_SELECT;
+    default:
+      return 0;
+  }
+}
+
+// returns -1 if the device went away
+static int input_read_device(struct input* i) {
+  struct input_evdev_event events[16];
+  ssize_t bytes_read = read(i->device_fd, events, sizeof(events));
+  if (bytes_read < 0)
+    return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+
+  int x;
+  for (x = 0; x < bytes_read / (ssize_t)sizeof(events[0]); x++) {
+    if ((events[x].type != INPUT_EVDEV_EV_KEY) || (events[x].value == 2))
+      continue;
+    int key = input_key_for_evdev_code(events[x].code);
+    if (key)
+      input_push_event(i, events[x].value ? INPUT_EVENT_PRESS :
+          INPUT_EVENT_RELEASE, key);
+  }
   return 0;
 }
 
-void write_input_register(struct input* i, uint8_t addr, uint8_t value) {
-  switch (value & 0x30) {
-    case 0x30:
-    case 0x00: // not valid: you can't select both
-      i->selected = SELECTED_NOTHING;
+#else // __linux__
+
+static int input_read_device(struct input* i) {
+  return -1;
+}
+
+#endif // __linux__
+
+static void* input_thread_fn(void* arg) {
+  struct input* i = (struct input*)arg;
+  struct input_tty_state tty;
+  memset(&tty, 0, sizeof(tty));
+
+  int tty_fd = i->tty_closed ? -1 : i->tty_fd;
+  int device_fd = i->device_closed ? -1 : i->device_fd;
+  for (;;) {
+    struct pollfd fds[3];
+    fds[0].fd = i->wake_fds[0];
+    fds[1].fd = tty_fd;
+    fds[2].fd = device_fd;
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+    fds[0].revents = fds[1].revents = fds[2].revents = 0;
+
+    // negative fds are ignored by poll()
+    if (poll(fds, 3, input_release_tty_keys(i, &tty)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "failed to poll for input (%d)\n", errno);
       break;
-    case 0x10:
-      i->selected = SELECTED_KEYS;
+    }
+    if (fds[0].revents)
       break;
-    case 0x20:
-      i->selected = SELECTED_DIRECTIONS;
+
+    if (fds[1].revents && input_read_tty(i, &tty)) {
+      fprintf(stderr, "terminal input closed\n");
+      tty_fd = -1;
+      i->tty_closed = 1;
+    }
+    if (fds[2].revents && input_read_device(i)) {
+      fprintf(stderr, "input device closed\n");
+      device_fd = -1;
+      i->device_closed = 1;
+    }
+  }
+
+  // nothing will release keys read from the terminal after this, so release
+  // them now
+  int x;
+  for (x = 0; x < 8; x++)
+    if (tty.release_time[x])
+      input_push_event(i, INPUT_EVENT_RELEASE, 1 << x);
+  return NULL;
+}
+
+// turns off line buffering and echo, so keys arrive as they're pressed
+static void input_set_tty_mode(struct input* i) {
+  struct termios attrs = i->tty_attrs;
+  attrs.c_lflag &= ~(ICANON | ECHO);
+  attrs.c_cc[VMIN] = 1;
+  attrs.c_cc[VTIME] = 0;
+  if (!tcsetattr(i->tty_fd, TCSANOW, &attrs))
+    i->tty_attrs_saved = 1;
+}
+
+// wakes the thread up and waits for it to exit
+static void input_join_thread(struct input* i) {
+  uint8_t data = 0;
+  while ((write(i->wake_fds[1], &data, 1) < 0) && (errno == EINTR));
+  pthread_join(i->thread, NULL);
+  while ((read(i->wake_fds[0], &data, 1) < 0) && (errno == EINTR));
+  i->thread_running = 0;
+}
+
+int input_start_thread(struct input* i, int tty_fd, const char* device_name) {
+  if (device_name) {
+#ifdef __linux__
+    i->device_fd = open(device_name, O_RDONLY | O_NONBLOCK);
+    if (i->device_fd < 0) {
+      fprintf(stderr, "failed to open input device %s (%d)\n", device_name,
+          errno);
+      return -1;
+    }
+#else
+    fprintf(stderr, "input devices aren\'t supported on this platform\n");
+    return -1;
+#endif
+  }
+
+  i->tty_fd = tty_fd;
+  if ((tty_fd >= 0) && isatty(tty_fd) &&
+      !tcgetattr(tty_fd, &i->tty_attrs))
+    input_set_tty_mode(i);
+
+  if (pipe(i->wake_fds)) {
+    fprintf(stderr, "failed to create input thread pipe (%d)\n", errno);
+    i->wake_fds[0] = i->wake_fds[1] = -1;
+    input_stop_thread(i);
+    return -1;
+  }
+  if (pthread_create(&i->thread, NULL, input_thread_fn, i)) {
+    fprintf(stderr, "failed to create input thread\n");
+    input_stop_thread(i);
+    return -1;
+  }
+  i->thread_running = 1;
+  return 0;
+}
+
+void input_pause_thread(struct input* i) {
+  if (!i->thread_running)
+    return;
+  input_join_thread(i);
+  i->thread_paused = 1;
+  if (i->tty_attrs_saved)
+    tcsetattr(i->tty_fd, TCSANOW, &i->tty_attrs);
+}
+
+void input_resume_thread(struct input* i) {
+  if (!i->thread_paused)
+    return;
+  i->thread_paused = 0;
+  if (i->tty_attrs_saved)
+    input_set_tty_mode(i);
+  if (pthread_create(&i->thread, NULL, input_thread_fn, i)) {
+    fprintf(stderr, "failed to restart input thread\n");
+    return;
+  }
+  i->thread_running = 1;
+}
+
+void input_stop_thread(struct input* i) {
+  if (i->thread_running)
+    input_join_thread(i);
+  i->thread_paused = 0;
+
+  if (i->wake_fds[0] >= 0) {
+    close(i->wake_fds[0]);
+    close(i->wake_fds[1]);
+    i->wake_fds[0] = i->wake_fds[1] = -1;
+  }
+  if (i->device_fd >= 0) {
+    close(i->device_fd);
+    i->device_fd = -1;
+  }
+  if (i->tty_attrs_saved) {
+    tcsetattr(i->tty_fd, TCSANOW, &i->tty_attrs);
+    i->tty_attrs_saved = 0;
   }
+  i->tty_fd = -1;
+  i->tty_closed = i->device_closed = 0;
 }
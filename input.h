@@ -1,7 +1,11 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <termios.h>
 
 #include "cpu.h"
 
@@ -18,22 +22,94 @@
 #define SELECTED_DIRECTIONS  0x01
 #define SELECTED_KEYS        0x02
 
+// input sources (the window, a terminal, evdev devices) never touch the
+// joypad state directly. they push events into a lock-free queue from
+// whatever thread they run on, and the emulation thread applies them all at
+// once with input_process_events, e.g. once per frame. the terminal and evdev
+// sources are read by an input thread, so the emulation thread never makes
+// any syscalls for input.
+
+#define INPUT_EVENT_PRESS    0
+#define INPUT_EVENT_RELEASE  1
+#define INPUT_EVENT_DEBUG    2 // break into the debugger (ctrl+d)
+
+#define INPUT_QUEUE_SIZE  256 // must be a power of 2
+
+// terminals only report key presses, so a key read from one is released this
+// long after it was last seen (holding it down makes it repeat before then)
+#define INPUT_TTY_HOLD_USECS  150000
+
+// one entry in the queue. seq says whose turn it is: it's the slot's index
+// (plus some multiple of the queue size) when a producer can fill it, and one
+// more than that once it's filled and the consumer can take it
+struct input_queue_slot {
+  atomic_uint seq;
+  uint8_t type;
+  uint8_t key;
+};
+
 struct input {
-  int fd;
-  int update_cycle;
-  int update_frequency;
   int keys_pressed;
-  int selected;
+  int selected; // SELECTED_DIRECTIONS and/or SELECTED_KEYS
   struct regs* cpu;
+
+  // called whenever keys_pressed changes; NULL if not needed
+  void (*keys_cb)(void* arg, int keys_pressed);
+  void* keys_cb_arg;
+
+  // any number of producers; only the emulation thread consumes
+  struct input_queue_slot queue[INPUT_QUEUE_SIZE];
+  atomic_uint queue_write_pos;
+  unsigned int queue_read_pos;
+  atomic_uint num_dropped_events;
+  // releases that didn't fit in the queue. these are applied after the queue
+  // is emptied, so a key is never left stuck down because the queue was full
+  atomic_int pending_releases;
+
+  // input thread state; the fds are -1 if not used
+  pthread_t thread;
+  int thread_running;
+  int thread_paused; // by input_pause_thread
+  int tty_fd;
+  int device_fd;
+  int tty_closed;    // set by the thread when it stops reading either fd
+  int device_closed;
+  int wake_fds[2]; // written to when the thread should exit
+  int tty_attrs_saved;
+  struct termios tty_attrs;
 };
 
 void input_init(struct input* i, struct regs* cpu);
 
-void input_update(struct input* i, uint64_t cycles);
 uint8_t read_input_register(struct input* i, uint8_t addr);
 void write_input_register(struct input* i, uint8_t addr, uint8_t value);
 
+// sets the state of all buttons at once (a mask of KEY_* values). these apply
+// immediately, so they should only be called on the emulation thread
+void input_set_keys(struct input* i, int keys_pressed);
 void input_key_press(struct input* i, int key);
 void input_key_release(struct input* i, int key);
+void input_set_keys_callback(struct input* i,
+    void (*keys_cb)(void* arg, int keys_pressed), void* cb_arg);
+
+// queues an event; callable from any thread. returns -1 if the queue is full
+// (the event is dropped and counted), except for releases, which are always
+// applied eventually
+int input_push_event(struct input* i, int type, int key);
+// applies all queued events; called on the emulation thread
+void input_process_events(struct input* i);
+// reports how many events were dropped because the queue was full (if any)
+void input_print_stats(FILE* stream, struct input* i);
+
+// starts a thread that reads keys from a terminal (tty_fd; -1 for none) and/or
+// an evdev device (device_name, e.g. /dev/input/event0; NULL for none) and
+// queues them. the terminal is switched to noncanonical mode while it runs
+int input_start_thread(struct input* i, int tty_fd, const char* device_name);
+void input_stop_thread(struct input* i);
+// stop the thread and put the terminal back the way it was for a while (e.g.
+// while the debugger uses it), then start them again. held terminal keys are
+// released. both do nothing if the thread isn't running
+void input_pause_thread(struct input* i);
+void input_resume_thread(struct input* i);
 
 #endif // INPUT_H
@@ -1,6 +1,10 @@
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -11,11 +15,16 @@
 
 #include "display.h"
 #include "serial.h"
+#include "serial_socket.h"
 #include "timer.h"
 #include "audio.h"
+#include "audio_capture.h"
+#include "audio_output.h"
+#include "frame_pacer.h"
 #include "input.h"
 #include "terminal.h"
 #include "opengl.h"
+#include "triple_buffer.h"
 #include "util.h"
 
 #include "gl_text.h"
@@ -29,8 +38,20 @@ struct hardware {
   struct regs* cpu;
   struct memory* mem;
   union cart_data* cart;
-
-  int paused;
+  struct frame_pacer pacer;
+  int wait_vblank;
+  struct audio_output audio_out;
+  int audio_output_type; // -1 if there's no audio output
+  struct audio_capture capture;
+  int capturing_audio;
+  struct serial_socket link;
+  int linked;
+
+  // the emulation thread owns all of the above. the main thread only talks to
+  // it through these fields and the frame buffer
+  atomic_int paused;
+  atomic_int should_exit;
+  struct triple_buffer frames;
 } hw;
 
 
@@ -39,58 +60,179 @@ static void glfw_error_cb(int error, const char* description) {
   fprintf(stderr, "[GLFW %d] %s\n", error, description);
 }
 
+static int key_for_glfw_key(int key) {
+  switch (key) {
+    case GLFW_KEY_TAB:
+      return KEY_B;
+    case GLFW_KEY_SPACE:
+      return KEY_A;
+    case GLFW_KEY_ENTER:
+      return KEY_START;
+    case GLFW_KEY_Z:
+      return KEY_SELECT;
+    case GLFW_KEY_LEFT:
+      return KEY_LEFT;
+    case GLFW_KEY_RIGHT:
+      return KEY_RIGHT;
+    case GLFW_KEY_UP:
+      return KEY_UP;
+    case GLFW_KEY_DOWN:
+      return KEY_DOWN;
+    default:
+      return 0;
+  }
+}
+
 static void glfw_key_cb(GLFWwindow* window, int key, int scancode, int action, int mods) {
   if (action == GLFW_PRESS) {
     if (key == GLFW_KEY_E)
       glfwSetWindowShouldClose(window, 1);
+    else if (key == GLFW_KEY_ESCAPE)
+      atomic_fetch_xor(&hw.paused, 1);
+    else if (key_for_glfw_key(key))
+      input_push_event(&hw.inp, INPUT_EVENT_PRESS, key_for_glfw_key(key));
+
+  } else if ((action == GLFW_RELEASE) && key_for_glfw_key(key))
+    input_push_event(&hw.inp, INPUT_EVENT_RELEASE, key_for_glfw_key(key));
+}
+
+// glfw only reports the display's refresh rate as a whole number of hz, which
+// can be far enough off (60 instead of 59.94) to drop or repeat a frame every
+// several seconds. so with vsync on, this times a run of swaps and takes the
+// slope of a least-squares fit of the swap times to the vblanks they waited
+// for, which averages out the jitter in when each one returns. returns 0 if the swaps don't seem to be
+// waiting for vblank (e.g. the driver ignores the swap interval)
+#define REFRESH_MEASURE_WARMUP_FRAMES  10
+#define REFRESH_MEASURE_FRAMES         120
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t measure_refresh_period_ns(GLFWwindow* window,
+    int nominal_rate) {
+  double times[REFRESH_MEASURE_FRAMES];
+  int x;
+  for (x = 0; x < REFRESH_MEASURE_WARMUP_FRAMES + REFRESH_MEASURE_FRAMES;
+       x++) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glfwSwapBuffers(window);
+    glfwPollEvents();
+    if (x >= REFRESH_MEASURE_WARMUP_FRAMES)
+      times[x - REFRESH_MEASURE_WARMUP_FRAMES] = glfwGetTime();
+  }
+
+  // a swap that misses a vblank shows up as a longer interval, so each swap
+  // is matched to a vblank using the median interval first
+  double intervals[REFRESH_MEASURE_FRAMES - 1];
+  for (x = 0; x < REFRESH_MEASURE_FRAMES - 1; x++)
+    intervals[x] = times[x + 1] - times[x];
+  qsort(intervals, REFRESH_MEASURE_FRAMES - 1, sizeof(double), compare_double);
+  double median = intervals[(REFRESH_MEASURE_FRAMES - 1) / 2];
+  if (median <= 0)
+    return 0;
 
-    else if (key == GLFW_KEY_ESCAPE) {
-      hw.paused = !hw.paused;
-      if (hw.paused)
-        display_pause(&hw.lcd);
-      else
-        display_resume(&hw.lcd);
-
-    } else if (key == GLFW_KEY_TAB)
-      input_key_press(&hw.inp, KEY_B);
-    else if (key == GLFW_KEY_SPACE)
-      input_key_press(&hw.inp, KEY_A);
-    else if (key == GLFW_KEY_ENTER)
-      input_key_press(&hw.inp, KEY_START);
-    else if (key == GLFW_KEY_Z)
-      input_key_press(&hw.inp, KEY_SELECT);
-    else if (key == GLFW_KEY_LEFT)
-      input_key_press(&hw.inp, KEY_LEFT);
-    else if (key == GLFW_KEY_RIGHT)
-      input_key_press(&hw.inp, KEY_RIGHT);
-    else if (key == GLFW_KEY_UP)
-      input_key_press(&hw.inp, KEY_UP);
-    else if (key == GLFW_KEY_DOWN)
-      input_key_press(&hw.inp, KEY_DOWN);
-
-  } else if (action == GLFW_RELEASE) {
-    if (key == GLFW_KEY_TAB)
-      input_key_release(&hw.inp, KEY_B);
-    else if (key == GLFW_KEY_SPACE)
-      input_key_release(&hw.inp, KEY_A);
-    else if (key == GLFW_KEY_ENTER)
-      input_key_release(&hw.inp, KEY_START);
-    else if (key == GLFW_KEY_Z)
-      input_key_release(&hw.inp, KEY_SELECT);
-    else if (key == GLFW_KEY_LEFT)
-      input_key_release(&hw.inp, KEY_LEFT);
-    else if (key == GLFW_KEY_RIGHT)
-      input_key_release(&hw.inp, KEY_RIGHT);
-    else if (key == GLFW_KEY_UP)
-      input_key_release(&hw.inp, KEY_UP);
-    else if (key == GLFW_KEY_DOWN)
-      input_key_release(&hw.inp, KEY_DOWN);
+  double vblanks[REFRESH_MEASURE_FRAMES];
+  double mean_v = 0, mean_t = 0;
+  for (x = 0; x < REFRESH_MEASURE_FRAMES; x++) {
+    vblanks[x] = (double)(int64_t)((times[x] - times[0]) / median + 0.5);
+    mean_v += vblanks[x];
+    mean_t += times[x];
   }
+  mean_v /= REFRESH_MEASURE_FRAMES;
+  mean_t /= REFRESH_MEASURE_FRAMES;
+  double num = 0, den = 0;
+  for (x = 0; x < REFRESH_MEASURE_FRAMES; x++) {
+    num += (vblanks[x] - mean_v) * (times[x] - mean_t);
+    den += (vblanks[x] - mean_v) * (vblanks[x] - mean_v);
+  }
+  double period = num / den;
+
+  // anything far from the reported rate (or from any plausible rate, if
+  // there isn't one) means the swaps weren't paced by the display
+  if (nominal_rate > 0) {
+    if ((period * nominal_rate < 0.95) || (period * nominal_rate > 1.05))
+      return 0;
+  } else if ((period < 1.0 / 500) || (period > 1.0 / 20))
+    return 0;
+  return (uint64_t)(period * 1000000000.0);
+}
+
+// called on the emulation thread with each batch of samples from the apu
+static void audio_sample_cb(void* arg, const int16_t* samples, size_t num_frames) {
+  if (hw.audio_output_type >= 0)
+    audio_output_write(&hw.audio_out, samples, num_frames);
+  if (hw.capturing_audio)
+    audio_capture_write(&hw.capture, samples, num_frames);
 }
 
+// called on the emulation thread at the end of each rendered frame
 static void display_render_cb(struct display* d, void* arg) {
-  display_render_window_opengl(d);
-  glfwSwapBuffers((GLFWwindow*)arg);
+  struct triple_buffer* frames = (struct triple_buffer*)arg;
+  memcpy(triple_buffer_write_buffer(frames), d->image, sizeof(d->image));
+  triple_buffer_publish(frames);
+  glfwPostEmptyEvent(); // wake up the main thread to present it
+}
+
+static void* emulation_thread_fn(void* arg) {
+  int was_paused = 0;
+
+  while (!atomic_load(&hw.should_exit)) {
+    // apply input events queued since the last frame. this happens even while
+    // paused, so the queue doesn't fill up
+    input_process_events(&hw.inp);
+
+    int paused = atomic_load(&hw.paused);
+    if (paused != was_paused) {
+      if (!paused)
+        frame_pacer_reset(&hw.pacer);
+      was_paused = paused;
+    }
+    if (paused) {
+      usleep(10000);
+      continue;
+    }
+
+    // run up to the next frame boundary, so pacing lines up with the frames
+    // the display hands to us
+    run_cycles(hw.cpu, hw.mem,
+        LCD_CYCLES_PER_FRAME - (hw.cpu->cycles % LCD_CYCLES_PER_FRAME));
+    // hand this frame's samples to the output now rather than whenever the apu
+    // would get around to it, so the output sees a steady stream
+    if (hw.audio_output_type >= 0) {
+      audio_flush(&hw.aud);
+      audio_set_rate_adjustment(&hw.aud,
+          audio_output_rate_adjustment(&hw.audio_out));
+    }
+    if (hw.wait_vblank)
+      frame_pacer_wait(&hw.pacer);
+  }
+  return NULL;
+}
+
+// stops and frees everything main() started. every exit after the devices
+// are set up comes through here, so a failure partway through startup still
+// stops the threads, finishes the capture file and closes the link
+static void free_hardware() {
+  input_stop_thread(&hw.inp);
+  input_print_stats(stderr, &hw.inp);
+  if (hw.audio_output_type >= 0) {
+    audio_output_print_stats(stderr, &hw.audio_out);
+    audio_output_close(&hw.audio_out);
+  }
+  if (hw.capturing_audio) {
+    audio_flush(&hw.aud);
+    audio_capture_close(&hw.capture);
+  }
+  if (hw.linked) {
+    serial_socket_print_stats(stderr, &hw.link);
+    serial_socket_free(&hw.link);
+  }
+  triple_buffer_free(&hw.frames);
+  delete_cpu(hw.cpu);
+  delete_memory(hw.mem);
+  delete_cart(hw.cart);
 }
 
 
@@ -104,9 +246,16 @@ int main(int argc, char* argv[]) {
 
   const char* rom_file_name = NULL;
   int debug = 0, do_disassemble = 0, use_debug_cart = 0, wait_vblank = 0,
-      render_freq = 1, opengl_scale = 1, highlight_sprites = 0;
+      render_freq = 1, opengl_scale = 1, highlight_sprites = 0,
+      sync_to_display = 0, color_correction = 0, audio_output_type = -1;
+  const char* audio_device_name = NULL;
+  const char* audio_capture_filename = NULL;
+  const char* input_device_name = NULL;
+  const char* link_listen_path = NULL;
+  const char* link_connect_path = NULL;
+  int tty_input = 0;
   int32_t breakpoint_addr = -1, watchpoint_addr = -1, write_breakpoint_addr = -1, memory_watchpoint_addr = -1;
-  uint64_t stop_after_cycles = 0;
+  uint64_t stop_after_cycles = 0, benchmark_frames = 0;
   int x;
   for (x = 1; x < argc; x++) {
     if (argv[x][0] == '-') {
@@ -128,10 +277,34 @@ int main(int argc, char* argv[]) {
         use_debug_cart = 1;
       else if (!strcmp(argv[x], "--wait-vblank"))
         wait_vblank = 1;
+      else if (!strcmp(argv[x], "--sync-display"))
+        wait_vblank = sync_to_display = 1;
       else if (!strcmp(argv[x], "--highlight-sprites"))
         highlight_sprites = 1;
+      else if (!strcmp(argv[x], "--color-correction"))
+        color_correction = 1;
       else if (!strncmp(argv[x], "--opengl-scale=", 15))
         sscanf(&argv[x][15], "%d", &opengl_scale);
+      else if (!strcmp(argv[x], "--audio=null"))
+        audio_output_type = AUDIO_OUTPUT_NULL;
+      else if (!strcmp(argv[x], "--audio=file"))
+        audio_output_type = AUDIO_OUTPUT_FILE;
+      else if (!strcmp(argv[x], "--audio=alsa"))
+        audio_output_type = AUDIO_OUTPUT_ALSA;
+      else if (!strncmp(argv[x], "--audio-device=", 15))
+        audio_device_name = &argv[x][15];
+      else if (!strncmp(argv[x], "--audio-capture=", 16))
+        audio_capture_filename = &argv[x][16];
+      else if (!strcmp(argv[x], "--tty-input"))
+        tty_input = 1;
+      else if (!strncmp(argv[x], "--input-device=", 15))
+        input_device_name = &argv[x][15];
+      else if (!strncmp(argv[x], "--link-listen=", 14))
+        link_listen_path = &argv[x][14];
+      else if (!strncmp(argv[x], "--link-connect=", 15))
+        link_connect_path = &argv[x][15];
+      else if (!strncmp(argv[x], "--benchmark=", 12))
+        sscanf(&argv[x][12], "%" SCNu64, &benchmark_frames);
       else if (!strncmp(argv[x], "--stop-cycles=", 14))
         sscanf(&argv[x][14], "%016llX", &stop_after_cycles);
     } else {
@@ -163,25 +336,6 @@ int main(int argc, char* argv[]) {
     return 0;
   }
 
-  if (!glfwInit()) {
-    fprintf(stderr, "failed to initialize GLFW\n");
-    return -3;
-  }
-  glfwSetErrorCallback(glfw_error_cb);
-
-  GLFWwindow* window = glfwCreateWindow(160 * opengl_scale, 144 * opengl_scale,
-      "gb", NULL, NULL);
-  glfwSetKeyCallback(window, glfw_key_cb);
-
-  glfwMakeContextCurrent(window);
-
-  glDisable(GL_LIGHTING);
-  glDisable(GL_DEPTH_TEST);
-  glLineWidth(3);
-  glPointSize(12);
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
   // create devices
   hw.mem = create_memory(hw.cart);
   if (!hw.mem) {
@@ -202,13 +356,27 @@ int main(int argc, char* argv[]) {
   // initialize devices
   hw.cpu->debug = debug;
   hw.cpu->ddx = memory_watchpoint_addr;
-  display_init(&hw.lcd, hw.cpu, hw.mem, render_freq, display_render_cb, window);
-  serial_init(&hw.ser, hw.cpu);
-  timer_init(&hw.tim, hw.cpu);
-  audio_init(&hw.aud, hw.cpu);
+  if (triple_buffer_init(&hw.frames, sizeof(hw.lcd.image))) {
+    fprintf(stderr, "failed to create frame buffers\n");
+    delete_cpu(hw.cpu);
+    delete_memory(hw.mem);
+    delete_cart(hw.cart);
+    return -2;
+  }
+  if (benchmark_frames)
+    display_init(&hw.lcd, hw.cpu, hw.mem, 1, NULL, NULL);
+  else
+    display_init(&hw.lcd, hw.cpu, hw.mem, render_freq, display_render_cb,
+        &hw.frames);
+  serial_init(&hw.ser, hw.cpu, hw.mem);
+  timer_init(&hw.tim, hw.cpu, hw.mem);
+  audio_init(&hw.aud, hw.cpu, hw.mem);
   input_init(&hw.inp, hw.cpu);
-  hw.lcd.wait_vblank = wait_vblank;
+  hw.wait_vblank = wait_vblank;
+  hw.audio_output_type = -1;
+
   hw.lcd.highlight_sprites = highlight_sprites;
+  display_set_color_correction(&hw.lcd, color_correction);
 
   // bind devices to memory manager
   add_device(hw.mem, DEVICE_DISPLAY, &hw.lcd);
@@ -218,15 +386,152 @@ int main(int argc, char* argv[]) {
   add_device(hw.mem, DEVICE_CPU, hw.cpu);
   add_device(hw.mem, DEVICE_INPUT, &hw.inp);
 
-  hw.paused = 0;
+  // this may wait a while for the other side to show up, so it's done before
+  // anything that's timed
+  if (link_listen_path || link_connect_path) {
+    int fd = link_listen_path ? serial_socket_listen(link_listen_path) :
+        serial_socket_connect(link_connect_path);
+    if ((fd < 0) || serial_socket_init(&hw.link, &hw.ser, fd)) {
+      free_hardware();
+      return -3;
+    }
+    hw.linked = 1;
+  }
+
+  // the capture records whatever the apu produces, so it works the same in
+  // benchmark mode and when not paced at all
+  if (audio_capture_filename) {
+    if (audio_capture_open(&hw.capture, audio_capture_filename,
+        AUDIO_DEFAULT_SAMPLE_RATE)) {
+      free_hardware();
+      return -3;
+    }
+    hw.capturing_audio = 1;
+  }
+
+  // in benchmark mode, just run the requested number of frames as fast as
+  // possible (rendering all of them) and report the speed; no window needed
+  if (benchmark_frames) {
+    if (hw.capturing_audio)
+      audio_set_output(&hw.aud, AUDIO_DEFAULT_SAMPLE_RATE, audio_sample_cb,
+          NULL);
+    else
+      audio_set_mode(&hw.aud, AUDIO_MODE_REGISTERS_ONLY);
+    uint64_t start_time = now();
+    run_cycles(hw.cpu, hw.mem, benchmark_frames * LCD_CYCLES_PER_FRAME);
+    uint64_t elapsed_usecs = now() - start_time;
+    fprintf(stderr, "%" PRIu64 " frames in %" PRIu64 " usecs (%g frames/sec)\n",
+        benchmark_frames, elapsed_usecs,
+        (double)benchmark_frames * 1000000 / (elapsed_usecs ? elapsed_usecs : 1));
+
+    free_hardware();
+    return 0;
+  }
+
+  if (audio_output_type >= 0) {
+    if (audio_output_type == AUDIO_OUTPUT_FILE && !audio_device_name) {
+      fprintf(stderr, "--audio=file requires --audio-device=<file_name>\n");
+      free_hardware();
+      return -1;
+    }
+    if (audio_output_open(&hw.audio_out, audio_output_type, audio_device_name,
+        AUDIO_DEFAULT_SAMPLE_RATE)) {
+      free_hardware();
+      return -3;
+    }
+    hw.audio_output_type = audio_output_type;
+
+    // with audio on, emulation is always paced (see below)
+    hw.wait_vblank = 1;
+  }
+  if ((audio_output_type >= 0) || hw.capturing_audio)
+    audio_set_output(&hw.aud, AUDIO_DEFAULT_SAMPLE_RATE, audio_sample_cb, NULL);
+  else
+    audio_set_mode(&hw.aud, AUDIO_MODE_REGISTERS_ONLY);
+
+  if (!glfwInit()) {
+    fprintf(stderr, "failed to initialize GLFW\n");
+    free_hardware();
+    return -3;
+  }
+  glfwSetErrorCallback(glfw_error_cb);
+
+  GLFWwindow* window = glfwCreateWindow(160 * opengl_scale, 144 * opengl_scale,
+      "gb", NULL, NULL);
+  glfwSetKeyCallback(window, glfw_key_cb);
+
+  glfwMakeContextCurrent(window);
+
+  glDisable(GL_LIGHTING);
+  glDisable(GL_DEPTH_TEST);
+  glLineWidth(3);
+  glPointSize(12);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  // by default run at the real hardware's frame rate; when syncing to the
+  // display, run at its refresh rate instead so every frame is shown exactly
+  // once (at the cost of running slightly fast or slow)
+  uint64_t frame_period_ns = FRAME_PACER_EMULATED_PERIOD_NS;
+  if (sync_to_display) {
+    glfwSwapInterval(1);
+    const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    int refresh_rate = mode ? mode->refreshRate : 0;
+    uint64_t measured_period_ns = measure_refresh_period_ns(window,
+        refresh_rate);
+    if (measured_period_ns) {
+      frame_period_ns = measured_period_ns;
+      fprintf(stderr, "display refresh period: %.4lf ms\n",
+          (double)frame_period_ns / 1000000.0);
+    } else if (refresh_rate > 0) {
+      fprintf(stderr, "couldn\'t measure the display refresh period; "
+          "using %d Hz\n", refresh_rate);
+      frame_period_ns = 1000000000ULL / refresh_rate;
+    }
+  }
+  frame_pacer_init(&hw.pacer, frame_period_ns);
+
+  // with audio on, pace off the audio device's clock instead, so the two can't
+  // drift apart. dynamic rate control makes up the small difference between
+  // the device's clock and its nominal rate (or between the display's refresh
+  // rate and the hardware's frame rate, when syncing to the display)
+  if ((hw.audio_output_type >= 0) && !sync_to_display)
+    frame_pacer_set_clock(&hw.pacer, audio_output_clock, &hw.audio_out);
+
+  atomic_init(&hw.paused, 0);
+  atomic_init(&hw.should_exit, 0);
+
+  if ((tty_input || input_device_name) &&
+      input_start_thread(&hw.inp, tty_input ? STDIN_FILENO : -1,
+          input_device_name)) {
+    free_hardware();
+    return -3;
+  }
+
+  // emulation runs on its own thread; this thread handles window events and
+  // presents whichever frame was most recently completed, so vsync and driver
+  // stalls never hold up the emulator
+  pthread_t emulation_thread;
+  if (pthread_create(&emulation_thread, NULL, emulation_thread_fn, NULL)) {
+    fprintf(stderr, "failed to create emulation thread\n");
+    free_hardware();
+    return -2;
+  }
 
   while (!glfwWindowShouldClose(window)) {
-    if (!hw.paused)
-      run_cycles(hw.cpu, hw.mem, LCD_CYCLES_PER_FRAME);
+    int is_new_frame;
+    const uint32_t (*image)[160] = triple_buffer_read(&hw.frames, &is_new_frame);
+
+    if (!atomic_load(&hw.paused)) {
+      if (is_new_frame) {
+        display_render_window_opengl(image);
+        glfwSwapBuffers(window);
+      }
+      glfwWaitEvents();
 
-    else {
+    } else {
       glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-      display_render_window_opengl(&hw.lcd);
+      display_render_window_opengl(image);
 
       glBegin(GL_QUADS);
       glColor4f(0.0f, 0.0f, 0.0f, 0.4f);
@@ -259,13 +564,19 @@ int main(int argc, char* argv[]) {
       draw_text(0.0, -0.8, 1.0, 1.0, 1.0, 1.0, 160.0 / 144.0, 0.01, 1, "e: exit");
 
       glfwSwapBuffers(window);
+      glfwPollEvents();
     }
-
-    glfwPollEvents();
   }
 
+  // the emulation thread may be waiting for the other side of the link
+  atomic_store(&hw.should_exit, 1);
+  if (hw.linked)
+    serial_socket_interrupt(&hw.link);
+  pthread_join(emulation_thread, NULL);
+  if (hw.wait_vblank)
+    frame_pacer_print_stats(stderr, &hw.pacer);
+
   // clean up
-  delete_memory(hw.mem);
-  delete_cart(hw.cart);
+  free_hardware();
   return 0;
 }
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "cart.h"
 
@@ -11,7 +12,6 @@
 #include "audio.h"
 #include "input.h"
 #include "debug.h"
-#include "terminal.h"
 
 
 
@@ -105,13 +105,13 @@ static struct {
   {DEVICE_INVALID, NULL, NULL}, // 0x4C
   {DEVICE_CPU,     (io_read8_fn)read_speed_switch, (io_write8_fn)write_speed_switch}, // 0x4D
   {DEVICE_INVALID, NULL, NULL}, // 0x4E
-  {-1,             NULL, NULL}, // 0x4F
+  {DEVICE_MEMORY,  (io_read8_fn)read_vram_bank, (io_write8_fn)write_vram_bank}, // 0x4F
   {DEVICE_INVALID, NULL, NULL}, // 0x50
-  {-1,             NULL, NULL}, // 0x51
-  {-1,             NULL, NULL}, // 0x52
-  {-1,             NULL, NULL}, // 0x53
-  {-1,             NULL, NULL}, // 0x54
-  {-1,             NULL, NULL}, // 0x55
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x51
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x52
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x53
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x54
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x55
   {-1,             NULL, NULL}, // 0x56
   {DEVICE_INVALID, NULL, NULL}, // 0x57
   {DEVICE_INVALID, NULL, NULL}, // 0x58
@@ -130,15 +130,15 @@ static struct {
   {DEVICE_INVALID, NULL, NULL}, // 0x65
   {DEVICE_INVALID, NULL, NULL}, // 0x66
   {DEVICE_INVALID, NULL, NULL}, // 0x67
-  {-1,             NULL, NULL}, // 0x68
-  {-1,             NULL, NULL}, // 0x69
-  {-1,             NULL, NULL}, // 0x6A
-  {-1,             NULL, NULL}, // 0x6B
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x68
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x69
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x6A
+  {DEVICE_DISPLAY, (io_read8_fn)read_lcd_reg, (io_write8_fn)write_lcd_reg}, // 0x6B
   {-1,             NULL, NULL}, // 0x6C
   {DEVICE_INVALID, NULL, NULL}, // 0x6D
   {DEVICE_INVALID, NULL, NULL}, // 0x6E
   {DEVICE_INVALID, NULL, NULL}, // 0x6F
-  {-1,             NULL, NULL}, // 0x70
+  {DEVICE_MEMORY,  (io_read8_fn)read_wram_bank, (io_write8_fn)write_wram_bank}, // 0x70
   {DEVICE_INVALID, NULL, NULL}, // 0x71
   {-1,             NULL, NULL}, // 0x72
   {-1,             NULL, NULL}, // 0x73
@@ -222,15 +222,15 @@ void* ptr(struct memory* m, uint16_t addr) {
   if (addr < 0x4000)
     return &m->cart->data[addr]; // rom bank 0
   if (addr < 0x8000)
-    return &m->cart->data[addr - 0x4000 + m->cart_rom_bank_num * 0x4000]; // rom bank 01-7F
+    return &m->cart_rom_bank[addr - 0x4000]; // rom bank 01-7F
   if (addr < 0xA000)
-    return &m->vram[addr - 0x8000 + m->vram_bank_num * 0x2000];
+    return &m->vram_bank[addr - 0x8000];
   if (addr < 0xC000)
-    return m->eram ? &m->eram[addr - 0xA000 + m->eram_bank_num * 0x2000] : NULL;
+    return m->eram ? &m->eram_bank[addr - 0xA000] : NULL;
   if (addr < 0xD000)
     return &m->wram[addr - 0xC000];
   if (addr < 0xE000)
-    return &m->wram[addr - 0xD000 + m->wram_bank_num * 0x1000];
+    return &m->wram_bank[addr - 0xD000];
   if (addr < 0xFE00)
     return NULL; // unsupported for now
   if (addr < 0xFEA0)
@@ -285,6 +285,34 @@ void write16(struct memory* m, uint16_t addr, uint16_t data) {
   m->write16(m, addr, data);
 }
 
+// while an oam dma transfer is running, the cpu's own accesses outside hram and
+// the io registers see an idle bus. other readers (the hdma unit, the
+// debugger) aren't affected
+
+uint8_t cpu_read8(struct memory* m, uint16_t addr) {
+  if (m->oam_dma_active && (addr < 0xFF00))
+    return 0xFF;
+  return read8(m, addr);
+}
+
+uint16_t cpu_read16(struct memory* m, uint16_t addr) {
+  if (m->oam_dma_active && (addr < 0xFF00))
+    return 0xFFFF;
+  return read16(m, addr);
+}
+
+void cpu_write8(struct memory* m, uint16_t addr, uint8_t data) {
+  if (m->oam_dma_active && (addr < 0xFF00))
+    return;
+  write8(m, addr, data);
+}
+
+void cpu_write16(struct memory* m, uint16_t addr, uint16_t data) {
+  if (m->oam_dma_active && (addr < 0xFF00))
+    return;
+  write16(m, addr, data);
+}
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -335,11 +363,12 @@ struct mbc1_data {
 void mbc1_set_bank_numbers(struct memory* m) {
   if (MBC1_REGS(m)->rom_ram_mode_select) {
     m->cart_rom_bank_num = MBC1_REGS(m)->rom_bank_num_low;
-    m->wram_bank_num = MBC1_REGS(m)->rom_bank_num_high;
+    m->eram_bank_num = MBC1_REGS(m)->rom_bank_num_high;
   } else {
     m->cart_rom_bank_num = MBC1_REGS(m)->rom_bank_num_low | (MBC1_REGS(m)->rom_bank_num_high << 5);
-    m->wram_bank_num = 1;
+    m->eram_bank_num = 0;
   }
+  set_bank_pointers(m);
 }
 
 #define mbc1_read8 default_mbc_read8
@@ -379,6 +408,88 @@ void mbc1_write16(struct memory* m, uint16_t addr, uint16_t data) {
 
 
 
+///////////////////////////////////////////////////////////////////////////////
+// banking
+
+void set_bank_pointers(struct memory* m) {
+  // out-of-range bank numbers wrap around, as they do on the real hardware
+  int num_rom_banks = rom_size_for_rom_size_code(m->cart->header.rom_size) / 0x4000;
+  int num_eram_banks = ram_size_for_ram_size_code(m->cart->header.ram_size) / 0x2000;
+
+  m->cart_rom_bank = &m->cart->data[(num_rom_banks ?
+      (m->cart_rom_bank_num % num_rom_banks) : m->cart_rom_bank_num) * 0x4000];
+  m->vram_bank = &m->vram[(m->vram_bank_num & 1) * 0x2000];
+  m->eram_bank = m->eram ? &m->eram[(num_eram_banks ?
+      (m->eram_bank_num % num_eram_banks) : 0) * 0x2000] : NULL;
+  m->wram_bank = &m->wram[(m->wram_bank_num & 7) * 0x1000];
+}
+
+// FF4F and FF70 only exist on CGB; on DMG they read as FF and ignore writes
+
+uint8_t read_vram_bank(struct memory* m, uint8_t addr) {
+  if (!(m->cart->header.cgb_flag & 0x80))
+    return 0xFF;
+  return 0xFE | m->vram_bank_num;
+}
+
+void write_vram_bank(struct memory* m, uint8_t addr, uint8_t value) {
+  if (!(m->cart->header.cgb_flag & 0x80))
+    return;
+  m->vram_bank_num = value & 1;
+  m->vram_bank = &m->vram[m->vram_bank_num * 0x2000];
+}
+
+uint8_t read_wram_bank(struct memory* m, uint8_t addr) {
+  if (!(m->cart->header.cgb_flag & 0x80))
+    return 0xFF;
+  return 0xF8 | m->wram_bank_num;
+}
+
+void write_wram_bank(struct memory* m, uint8_t addr, uint8_t value) {
+  if (!(m->cart->header.cgb_flag & 0x80))
+    return;
+  // bank 0 can't be mapped at D000; selecting it selects bank 1 instead
+  m->wram_bank_num = (value & 7) ? (value & 7) : 1;
+  m->wram_bank = &m->wram[m->wram_bank_num * 0x1000];
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// OAM DMA
+
+// the transfer takes 160 machine cycles (one per byte)
+#define OAM_DMA_CYCLES  (0xA0 * 4)
+
+static void oam_dma_end(void* context, uint64_t cycles) {
+  ((struct memory*)context)->oam_dma_active = 0;
+}
+
+// the cpu can't read oam while the transfer is running, so doing the whole copy
+// when it starts isn't observable; the rest of the transfer just keeps the cpu
+// off the bus until the end event
+void start_oam_dma(struct memory* m, uint8_t source_page, uint64_t cycles) {
+  uint16_t addr = source_page << 8;
+  m->oam_dma_active = 0;
+
+  // rom, vram, eram and wram banks are all aligned to at least 0x1000 bytes,
+  // so the source is contiguous in host memory
+  const uint8_t* src = (addr < 0xFE00) ? (const uint8_t*)ptr(m, addr) : NULL;
+  if (src)
+    memcpy(m->sprite_table, src, 0xA0);
+  else {
+    int x;
+    for (x = 0; x < 0xA0; x++)
+      m->sprite_table[x] = read8(m, addr + x);
+  }
+
+  m->oam_dma_active = 1;
+  scheduler_schedule(&m->sched, SCHEDULER_EVENT_OAM_DMA,
+      cycles + OAM_DMA_CYCLES);
+}
+
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // global management functions
 
@@ -398,7 +509,12 @@ struct memory* create_memory(union cart_data* cart) {
   m->sprite_table = (uint8_t*)calloc(1, 0xA0);
   m->hram = (uint8_t*)calloc(1, 0x80);
 
+  set_bank_pointers(m);
+
   m->write_breakpoint_addr = 0x10000;
+  scheduler_init(&m->sched);
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_OAM_DMA, oam_dma_end, m);
+  m->devices[DEVICE_MEMORY] = m; // for FF4F and FF70
 
   if (type_info->class_id == CART_CLASS_SIMPLE) {
     m->read8 = default_mbc_read8;
@@ -407,6 +523,7 @@ struct memory* create_memory(union cart_data* cart) {
     m->write16 = default_mbc_write16;
   } else if (type_info->class_id == CART_CLASS_MBC1) {
     m->mbc_data = malloc(sizeof(struct mbc1_data));
+    m->mbc_data_size = sizeof(struct mbc1_data);
     m->read8 = mbc1_read8;
     m->read16 = mbc1_read16;
     m->write8 = mbc1_write8;
@@ -441,12 +558,76 @@ void add_device(struct memory* m, int device_id, void* device) {
 }
 
 void update_devices(struct memory* m, uint64_t cycles) {
-  if (m->devices[DEVICE_DISPLAY])
-    display_update(m->devices[DEVICE_DISPLAY], cycles);
-  if (m->devices[DEVICE_TIMER])
-    timer_update(m->devices[DEVICE_TIMER], cycles);
-  if (m->devices[DEVICE_INPUT])
-    input_update(m->devices[DEVICE_INPUT], cycles);
+  scheduler_update(&m->sched, cycles);
+}
+
+static void print_data(FILE* out, uint64_t address, const void* _data, uint64_t data_size) {
+
+  if (data_size == 0)
+    return;
+
+  // if color is disabled or no diff source is given, disable diffing
+  const uint8_t* data = (const uint8_t*)_data;
+
+  char data_ascii[20];
+
+  // start_offset is how many blank spaces to print before the first byte
+  int start_offset = address & 0x0F;
+  address &= ~0x0F;
+  data_size += start_offset;
+
+  // if nonzero, print the address here (the loop won't do it for the 1st line)
+  if (start_offset)
+    fprintf(out, "%016llX | ", address);
+
+  // print initial spaces, if any
+  unsigned long long x, y;
+  for (x = 0; x < start_offset; x++) {
+    fprintf(out, "   ");
+    data_ascii[x] = ' ';
+  }
+
+  // print the data
+  for (; x < data_size; x++) {
+
+    int line_offset = x & 0x0F;
+    int data_offset = x - start_offset;
+    data_ascii[line_offset] = data[data_offset];
+
+    // first byte on the line? then print the address
+    if ((x & 0x0F) == 0)
+      fprintf(out, "%016llX | ", address + x);
+
+    // print the byte itself
+    fprintf(out, "%02X ", data[data_offset]);
+
+    // last byte on the line? then print the ascii view and a \n
+    if ((x & 0x0F) == 0x0F) {
+      fprintf(out, "| ");
+      for (y = 0; y < 16; y++) {
+        if (data_ascii[y] < 0x20 || data_ascii[y] == 0x7F)
+          putc('?', out);
+        else
+          putc(data_ascii[y], out);
+      }
+
+      fprintf(out, "\n");
+    }
+  }
+
+  // if the last line is a partial line, print the remaining ascii chars
+  if (x & 0x0F) {
+    for (y = x; y & 0x0F; y++)
+      fprintf(out, "   ");
+    fprintf(out, "| ");
+    for (y = 0; y < (x & 0x0F); y++) {
+      if (data_ascii[y] < 0x20 || data_ascii[y] == 0x7F)
+        putc('?', out);
+      else
+        putc(data_ascii[y], out);
+    }
+    fprintf(out, "\n");
+  }
 }
 
 void print_memory_debug(FILE* out, struct memory* m) {
@@ -454,21 +635,21 @@ void print_memory_debug(FILE* out, struct memory* m) {
   print_data(out, 0x0000, m->cart->data, 0x4000);
 
   fprintf(out, "\n>>> rom %d\n", m->cart_rom_bank_num);
-  print_data(out, 0x4000, &m->cart->data[m->cart_rom_bank_num * 0x4000], 0x4000);
+  print_data(out, 0x4000, m->cart_rom_bank, 0x4000);
 
   fprintf(out, "\n>>> vram\n");
-  print_data(out, 0x8000, m->vram, 0x2000);
+  print_data(out, 0x8000, m->vram_bank, 0x2000);
 
   if (m->eram) {
     fprintf(out, "\n>>> eram %d\n", m->eram_bank_num);
-    print_data(out, 0xA000, &m->eram[m->eram_bank_num * 0x2000], 0x2000);
+    print_data(out, 0xA000, m->eram_bank, 0x2000);
   }
 
   fprintf(out, "\n>>> wram 0\n");
   print_data(out, 0xC000, m->wram, 0x1000);
 
   fprintf(out, "\n>>> wram %d\n", m->wram_bank_num);
-  print_data(out, 0xD000, &m->wram[m->wram_bank_num * 0x1000], 0x1000);
+  print_data(out, 0xD000, m->wram_bank, 0x1000);
 
   fprintf(out, "\n>>> sprite table\n");
   print_data(out, 0xFE00, m->sprite_table, 0xA0);
@@ -1,15 +1,19 @@
 #ifndef MMU_H
 #define MMU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "scheduler.h"
+
 #define DEVICE_DISPLAY   0
 #define DEVICE_SERIAL    1
 #define DEVICE_TIMER     2
 #define DEVICE_CPU       3
 #define DEVICE_AUDIO     4
 #define DEVICE_INPUT     5
-#define DEVICE_INVALID   6
+#define DEVICE_MEMORY    6
+#define DEVICE_INVALID   7
 #define NUM_DEVICE_TYPES DEVICE_INVALID
 
 struct memory {
@@ -20,6 +24,14 @@ struct memory {
   uint8_t eram_bank_num;
   uint8_t wram_bank_num;
 
+  // the currently-mapped banks, so accesses don't have to compute their
+  // addresses from the bank numbers. set_bank_pointers updates these whenever
+  // a bank number changes
+  uint8_t* cart_rom_bank; // 0x4000-0x7FFF
+  uint8_t* vram_bank;     // 0x8000-0x9FFF
+  uint8_t* eram_bank;     // 0xA000-0xBFFF
+  uint8_t* wram_bank;     // 0xD000-0xDFFF
+
   uint8_t* vram; // video ram (2 banks of 0x2000 each)
   uint8_t* eram; // external ram (# banks determined by cart)
   uint8_t* wram; // work ram (8 banks of 0x1000 each)
@@ -27,10 +39,16 @@ struct memory {
   uint8_t* hram; // high ram (0x80 bytes; byte 0x7F is the interrupt flag register)
 
   void* devices[NUM_DEVICE_TYPES];
+  struct scheduler sched; // timed events for the devices
+
+  // while an oam dma transfer is running, the cpu can only access hram and the
+  // io registers (see cpu_read8 etc.)
+  uint8_t oam_dma_active;
 
   uint32_t write_breakpoint_addr;
 
   void* mbc_data;
+  size_t mbc_data_size;
   uint8_t (*read8)(struct memory* m, uint16_t addr);
   uint16_t (*read16)(struct memory* m, uint16_t addr);
   void (*write8)(struct memory* m, uint16_t addr, uint8_t data);
@@ -43,10 +61,23 @@ uint8_t read8(struct memory* m, uint16_t addr);
 uint16_t read16(struct memory* m, uint16_t addr);
 void write8(struct memory* m, uint16_t addr, uint8_t data);
 void write16(struct memory* m, uint16_t addr, uint16_t data);
+// the same, for the cpu's instructions; these honor the oam dma bus lock
+uint8_t cpu_read8(struct memory* m, uint16_t addr);
+uint16_t cpu_read16(struct memory* m, uint16_t addr);
+void cpu_write8(struct memory* m, uint16_t addr, uint8_t data);
+void cpu_write16(struct memory* m, uint16_t addr, uint16_t data);
 
 struct memory* create_memory(union cart_data* cart);
 void delete_memory(struct memory* m);
 
+void set_bank_pointers(struct memory* m);
+uint8_t read_vram_bank(struct memory* m, uint8_t addr);
+void write_vram_bank(struct memory* m, uint8_t addr, uint8_t value);
+uint8_t read_wram_bank(struct memory* m, uint8_t addr);
+void write_wram_bank(struct memory* m, uint8_t addr, uint8_t value);
+
+void start_oam_dma(struct memory* m, uint8_t source_page, uint64_t cycles);
+
 void add_device(struct memory* m, int device_type, void* device);
 void update_devices(struct memory* m, uint64_t cycles);
 
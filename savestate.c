@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+#include "savestate.h"
+#include "serial.h"
+
+int savestate_init(struct savestate* st, const struct memory* m) {
+  memset(st, 0, sizeof(*st));
+  st->eram_size = m->eram ?
+      ram_size_for_ram_size_code(m->cart->header.ram_size) : 0;
+  st->mbc_data_size = m->mbc_data ? m->mbc_data_size : 0;
+
+  if (st->eram_size && !(st->eram = (uint8_t*)malloc(st->eram_size))) {
+    fprintf(stderr, "failed to allocate savestate eram\n");
+    return -1;
+  }
+  if (st->mbc_data_size &&
+      !(st->mbc_data = (uint8_t*)malloc(st->mbc_data_size))) {
+    fprintf(stderr, "failed to allocate savestate mbc data\n");
+    free(st->eram);
+    return -1;
+  }
+  return 0;
+}
+
+void savestate_free(struct savestate* st) {
+  free(st->eram);
+  free(st->mbc_data);
+}
+
+void savestate_save(struct savestate* st, const struct regs* cpu,
+    const struct memory* m) {
+  st->cpu = *cpu;
+
+  st->cart_rom_bank_num = m->cart_rom_bank_num;
+  st->vram_bank_num = m->vram_bank_num;
+  st->eram_bank_num = m->eram_bank_num;
+  st->wram_bank_num = m->wram_bank_num;
+  st->oam_dma_active = m->oam_dma_active;
+  memcpy(st->vram, m->vram, sizeof(st->vram));
+  memcpy(st->wram, m->wram, sizeof(st->wram));
+  memcpy(st->sprite_table, m->sprite_table, sizeof(st->sprite_table));
+  memcpy(st->hram, m->hram, sizeof(st->hram));
+  if (st->eram_size)
+    memcpy(st->eram, m->eram, st->eram_size);
+  if (st->mbc_data_size)
+    memcpy(st->mbc_data, m->mbc_data, st->mbc_data_size);
+  memcpy(st->event_cycles, m->sched.event_cycles, sizeof(st->event_cycles));
+
+  const struct display* d = (const struct display*)m->devices[DEVICE_DISPLAY];
+  if (d)
+    st->lcd = *d;
+  const struct timer* t = (const struct timer*)m->devices[DEVICE_TIMER];
+  if (t)
+    st->tim = *t;
+  const struct audio* a = (const struct audio*)m->devices[DEVICE_AUDIO];
+  if (a)
+    st->aud = *a;
+  const struct serial* s = (const struct serial*)m->devices[DEVICE_SERIAL];
+  if (s) {
+    st->serial_data = s->data;
+    st->serial_control = s->control;
+    st->serial_transfer_end_time = s->transfer_end_time;
+  }
+  const struct input* i = (const struct input*)m->devices[DEVICE_INPUT];
+  if (i) {
+    st->input_keys_pressed = i->keys_pressed;
+    st->input_selected = i->selected;
+  }
+}
+
+void savestate_restore(const struct savestate* st, struct regs* cpu,
+    struct memory* m) {
+  // keep the debugger's settings
+  struct regs prev_cpu = *cpu;
+  *cpu = st->cpu;
+  cpu->debug_interrupt_reason = prev_cpu.debug_interrupt_reason;
+  cpu->stop_after_cycles = prev_cpu.stop_after_cycles;
+  cpu->debug = prev_cpu.debug;
+  cpu->ddx = prev_cpu.ddx;
+
+  m->cart_rom_bank_num = st->cart_rom_bank_num;
+  m->vram_bank_num = st->vram_bank_num;
+  m->eram_bank_num = st->eram_bank_num;
+  m->wram_bank_num = st->wram_bank_num;
+  m->oam_dma_active = st->oam_dma_active;
+  memcpy(m->vram, st->vram, sizeof(st->vram));
+  memcpy(m->wram, st->wram, sizeof(st->wram));
+  memcpy(m->sprite_table, st->sprite_table, sizeof(st->sprite_table));
+  memcpy(m->hram, st->hram, sizeof(st->hram));
+  if (st->eram_size)
+    memcpy(m->eram, st->eram, st->eram_size);
+  if (st->mbc_data_size)
+    memcpy(m->mbc_data, st->mbc_data, st->mbc_data_size);
+  set_bank_pointers(m);
+
+  // the handlers and their contexts don't change, so only the times are
+  // restored
+  int x;
+  m->sched.next_event_cycles = SCHEDULER_NEVER;
+  for (x = 0; x < NUM_SCHEDULER_EVENTS; x++) {
+    m->sched.event_cycles[x] = st->event_cycles[x];
+    if (st->event_cycles[x] < m->sched.next_event_cycles)
+      m->sched.next_event_cycles = st->event_cycles[x];
+  }
+  scheduler_set_run_limit(&m->sched, cpu->cycles);
+
+  struct display* d = (struct display*)m->devices[DEVICE_DISPLAY];
+  if (d) {
+    void (*display_cb)(struct display*, void*) = d->display_cb;
+    void* display_cb_arg = d->display_cb_arg;
+    void (*line_cb)(struct display*, int, void*) = d->line_cb;
+    void* line_cb_arg = d->line_cb_arg;
+    *d = st->lcd;
+    d->display_cb = display_cb;
+    d->display_cb_arg = display_cb_arg;
+    d->line_cb = line_cb;
+    d->line_cb_arg = line_cb_arg;
+  }
+  struct timer* t = (struct timer*)m->devices[DEVICE_TIMER];
+  if (t)
+    *t = st->tim;
+  struct audio* a = (struct audio*)m->devices[DEVICE_AUDIO];
+  if (a) {
+    uint64_t output_cycles = a->blip_start_cycles;
+    void (*sample_cb)(void*, const int16_t*, size_t) = a->sample_cb;
+    void* sample_cb_arg = a->sample_cb_arg;
+    int rate_adjust_ppm = a->rate_adjust_ppm;
+    *a = st->aud;
+    a->sample_cb = sample_cb;
+    a->sample_cb_arg = sample_cb_arg;
+    a->rate_adjust_ppm = rate_adjust_ppm;
+    audio_skip_output(a, output_cycles);
+  }
+  struct serial* s = (struct serial*)m->devices[DEVICE_SERIAL];
+  if (s) {
+    s->data = st->serial_data;
+    s->control = st->serial_control;
+    s->transfer_end_time = st->serial_transfer_end_time;
+  }
+  struct input* i = (struct input*)m->devices[DEVICE_INPUT];
+  if (i) {
+    i->keys_pressed = st->input_keys_pressed;
+    i->selected = st->input_selected;
+  }
+}
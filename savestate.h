@@ -0,0 +1,63 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio.h"
+#include "cpu.h"
+#include "display.h"
+#include "mmu.h"
+#include "timer.h"
+
+// a copy of everything the emulated machine's future depends on, for going
+// back to an earlier point in the same instance (e.g. to redo a stretch of
+// emulation differently). the devices are found through the memory's device
+// table, so all of them must be added before a savestate is made. savestates
+// hold pointers into the instance they were made from, so they can't be
+// moved to another instance or written to a file.
+//
+// host-side state is left alone when restoring: callbacks, debugger settings,
+// the input queue and the serial link. audio that was already output isn't
+// output again; the samples for the redone stretch are dropped up to where
+// output had gotten to.
+struct savestate {
+  struct regs cpu;
+
+  uint8_t cart_rom_bank_num;
+  uint8_t vram_bank_num;
+  uint8_t eram_bank_num;
+  uint8_t wram_bank_num;
+  uint8_t oam_dma_active;
+  uint8_t vram[0x4000];
+  uint8_t wram[0x8000];
+  uint8_t sprite_table[0xA0];
+  uint8_t hram[0x80];
+  uint8_t* eram; // eram_size bytes
+  size_t eram_size;
+  uint8_t* mbc_data; // mbc_data_size bytes
+  size_t mbc_data_size;
+  uint64_t event_cycles[NUM_SCHEDULER_EVENTS];
+
+  struct display lcd;
+  struct timer tim;
+  struct audio aud;
+  uint8_t serial_data;
+  uint8_t serial_control;
+  uint64_t serial_transfer_end_time;
+  int input_keys_pressed;
+  int input_selected;
+};
+
+// allocates the parts of the savestate whose size depends on the cart
+int savestate_init(struct savestate* st, const struct memory* m);
+void savestate_free(struct savestate* st);
+
+void savestate_save(struct savestate* st, const struct regs* cpu,
+    const struct memory* m);
+// this can be called from a scheduler event handler; the events due at the
+// restored time run next, as they would have when the savestate was made
+void savestate_restore(const struct savestate* st, struct regs* cpu,
+    struct memory* m);
+
+#endif // SAVESTATE_H
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+
+static void scheduler_update_next_event(struct scheduler* s) {
+  s->next_event_cycles = SCHEDULER_NEVER;
+  int x;
+  for (x = 0; x < NUM_SCHEDULER_EVENTS; x++)
+    if (s->event_cycles[x] < s->next_event_cycles)
+      s->next_event_cycles = s->event_cycles[x];
+}
+
+void scheduler_init(struct scheduler* s) {
+  memset(s, 0, sizeof(*s));
+  int x;
+  for (x = 0; x < NUM_SCHEDULER_EVENTS; x++)
+    s->event_cycles[x] = SCHEDULER_NEVER;
+  s->next_event_cycles = SCHEDULER_NEVER;
+}
+
+void scheduler_set_handler(struct scheduler* s, int event,
+    scheduler_event_fn fn, void* context) {
+  s->event_fns[event] = fn;
+  s->event_contexts[event] = context;
+}
+
+void scheduler_schedule(struct scheduler* s, int event, uint64_t cycles) {
+  s->event_cycles[event] = cycles;
+  if (cycles < s->next_event_cycles)
+    s->next_event_cycles = cycles;
+  else
+    scheduler_update_next_event(s);
+}
+
+void scheduler_cancel(struct scheduler* s, int event) {
+  s->event_cycles[event] = SCHEDULER_NEVER;
+  scheduler_update_next_event(s);
+}
+
+void scheduler_run_events(struct scheduler* s, uint64_t cycles) {
+  s->run_until_cycles = cycles;
+  while (s->next_event_cycles <= s->run_until_cycles) {
+    // find the earliest event (the first one, for ties, so events scheduled
+    // for the same cycle always run in the same order)
+    int x, event = 0;
+    for (x = 1; x < NUM_SCHEDULER_EVENTS; x++)
+      if (s->event_cycles[x] < s->event_cycles[event])
+        event = x;
+
+    // the handler may reschedule the event, so unschedule it first
+    uint64_t event_cycles = s->event_cycles[event];
+    s->event_cycles[event] = SCHEDULER_NEVER;
+    scheduler_update_next_event(s);
+    if (s->event_fns[event])
+      s->event_fns[event](s->event_contexts[event], event_cycles);
+  }
+}
+
+void scheduler_set_run_limit(struct scheduler* s, uint64_t cycles) {
+  s->run_until_cycles = cycles;
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+// devices that only change state at known times (e.g. the display at mode
+// boundaries) schedule an event for that time instead of checking the cycle
+// count after every instruction. each event type has at most one pending
+// occurrence; scheduling it again replaces the previous one.
+
+#define SCHEDULER_EVENT_DISPLAY      0
+#define SCHEDULER_EVENT_OAM_DMA      1
+#define SCHEDULER_EVENT_TIMER        2
+#define SCHEDULER_EVENT_AUDIO        3
+#define SCHEDULER_EVENT_AUDIO_SYNTH  4
+#define SCHEDULER_EVENT_SERIAL       5
+#define NUM_SCHEDULER_EVENTS         6
+
+#define SCHEDULER_NEVER  UINT64_MAX
+
+// called with the cycle count the event was scheduled for, which may be
+// slightly earlier than the current cycle count (events are only checked
+// between instructions). handlers that reschedule themselves should do so
+// relative to this value so they don't drift
+typedef void (*scheduler_event_fn)(void* context, uint64_t cycles);
+
+struct scheduler {
+  uint64_t next_event_cycles; // earliest of event_cycles
+  uint64_t event_cycles[NUM_SCHEDULER_EVENTS];
+  scheduler_event_fn event_fns[NUM_SCHEDULER_EVENTS];
+  void* event_contexts[NUM_SCHEDULER_EVENTS];
+  uint64_t run_until_cycles; // while scheduler_run_events is running
+};
+
+void scheduler_init(struct scheduler* s);
+void scheduler_set_handler(struct scheduler* s, int event,
+    scheduler_event_fn fn, void* context);
+
+void scheduler_schedule(struct scheduler* s, int event, uint64_t cycles);
+void scheduler_cancel(struct scheduler* s, int event);
+
+// runs all events that are due at or before the given cycle count, in order
+void scheduler_run_events(struct scheduler* s, uint64_t cycles);
+// when called from an event handler, changes the cycle count that the running
+// scheduler_run_events call runs events up to. for handlers that replace the
+// whole machine state (e.g. by restoring a savestate), after which the cycle
+// count it was called with no longer applies
+void scheduler_set_run_limit(struct scheduler* s, uint64_t cycles);
+
+static inline void scheduler_update(struct scheduler* s, uint64_t cycles) {
+  if (cycles >= s->next_event_cycles)
+    scheduler_run_events(s, cycles);
+}
+
+#endif // SCHEDULER_H
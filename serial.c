@@ -1,16 +1,210 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "serial.h"
+#include "serial_socket.h"
 
-void serial_init(struct serial* s, struct regs* cpu) {
+static void serial_event(void* context, uint64_t cycles);
+
+void serial_init(struct serial* s, struct regs* cpu, struct memory* m) {
   memset(s, 0, sizeof(*s));
   s->cpu = cpu;
+  s->mem = m;
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_SERIAL, serial_event, s);
+}
+
+uint64_t serial_transfer_cycles(uint8_t control) {
+  return (control & SERIAL_CONTROL_FAST) ? SERIAL_FAST_TRANSFER_CYCLES :
+      SERIAL_TRANSFER_CYCLES;
+}
+
+static inline uint64_t serial_add_saturating(uint64_t a, uint64_t b) {
+  return (a > UINT64_MAX - b) ? UINT64_MAX : (a + b);
+}
+
+void serial_finish_transfer(struct serial* s, uint8_t received) {
+  s->data = received;
+  s->control &= ~SERIAL_CONTROL_TRANSFER;
+  s->transfer_end_time = 0;
+  signal_interrupt(s->cpu, INTERRUPT_SERIAL, 1);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// link cable. everything in the link struct is protected by its lock; a side's
+// serial struct is only touched by the other side while it's waiting for the
+// link (with the lock released by pthread_cond_wait)
+
+void serial_link_init(struct serial_link* l) {
+  memset(l, 0, sizeof(*l));
+  pthread_mutex_init(&l->lock, NULL);
+  pthread_cond_init(&l->time_advanced, NULL);
+}
+
+void serial_link_free(struct serial_link* l) {
+  pthread_cond_destroy(&l->time_advanced);
+  pthread_mutex_destroy(&l->lock);
+}
+
+// how far a side waiting on an external clock can run: up to the end of the
+// other side's transfer if it has one, or else the earliest time one it
+// started now could end
+static uint64_t serial_link_external_limit(const struct serial_link* l,
+    int side, uint64_t time) {
+  int other = side ^ 1;
+  if (l->transfer_end_time[other] >= time)
+    return l->transfer_end_time[other];
+  return serial_add_saturating(l->time[other], SERIAL_FAST_TRANSFER_CYCLES);
 }
 
-void serial_update(struct serial* s, int cycles) { } // TODO
+// publishes this side's transfer state after a write to SC. called with the
+// lock held
+static void serial_link_update_state(struct serial* s, uint64_t time) {
+  struct serial_link* l = s->link;
+  int side = s->link_side;
+  l->time[side] = time;
+  l->transfer_end_time[side] = s->transfer_end_time;
+  l->external_since[side] = ((s->control & (SERIAL_CONTROL_TRANSFER |
+      SERIAL_CONTROL_INTERNAL)) == SERIAL_CONTROL_TRANSFER) ? time : UINT64_MAX;
+  pthread_cond_broadcast(&l->time_advanced);
+}
+
+// schedules the next time this side has to check in with the link. called
+// with the lock held
+static void serial_link_schedule(struct serial* s, uint64_t time) {
+  struct serial_link* l = s->link;
+  uint64_t next_time = time + SERIAL_LINK_SYNC_CYCLES;
+  if (s->transfer_end_time && (s->transfer_end_time < next_time))
+    next_time = s->transfer_end_time;
+  if (l->external_since[s->link_side] != UINT64_MAX) {
+    uint64_t limit = serial_link_external_limit(l, s->link_side, time);
+    if (limit < next_time)
+      next_time = (limit > time) ? limit : time;
+  }
+  scheduler_schedule(&s->mem->sched, SCHEDULER_EVENT_SERIAL,
+      next_time + s->link_start_cycles);
+}
+
+// finishes this side's internally-clocked transfer, once the other side has
+// caught up to the time it ends. called with the lock held
+static void serial_link_transfer(struct serial* s) {
+  struct serial_link* l = s->link;
+  int side = s->link_side, other = side ^ 1;
+  uint64_t end_time = s->transfer_end_time;
+  while (l->time[other] < end_time)
+    pthread_cond_wait(&l->time_advanced, &l->lock);
+
+  // if the other side started waiting on an external clock before end_time,
+  // it's stopped at end_time (see serial_link_external_limit), so its state
+  // can be changed here. one that wrote SC at exactly end_time is still
+  // running, and its transfer starts too late for this one anyway (as with
+  // serial_socket). otherwise, nothing is connected as far as this side can
+  // tell
+  uint8_t received = 0xFF;
+  if (l->external_since[other] < end_time) {
+    struct serial* o = l->ends[other];
+    received = o->data;
+    serial_finish_transfer(o, s->data);
+    l->external_since[other] = UINT64_MAX;
+  }
+  serial_finish_transfer(s, received);
+  l->transfer_end_time[side] = 0;
+  pthread_cond_broadcast(&l->time_advanced);
+}
+
+static void serial_link_event(struct serial* s, uint64_t cycles) {
+  struct serial_link* l = s->link;
+  int side = s->link_side;
+  uint64_t time = cycles - s->link_start_cycles;
+
+  pthread_mutex_lock(&l->lock);
+  l->time[side] = time;
+  pthread_cond_broadcast(&l->time_advanced);
+
+  if (s->transfer_end_time && (s->transfer_end_time <= time))
+    serial_link_transfer(s);
+
+  // wait until either the other side finishes the transfer, or it's far
+  // enough along that this side can't miss it by running a bit further
+  while ((l->external_since[side] != UINT64_MAX) &&
+         (serial_link_external_limit(l, side, time) <= time))
+    pthread_cond_wait(&l->time_advanced, &l->lock);
+
+  serial_link_schedule(s, time);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void serial_link_connect(struct serial_link* l, struct serial* a,
+    struct serial* b) {
+  struct serial* ends[2] = {a, b};
+  int side;
+  pthread_mutex_lock(&l->lock);
+  for (side = 0; side < 2; side++) {
+    struct serial* s = ends[side];
+    l->ends[side] = s;
+    s->link = l;
+    s->link_side = side;
+    s->link_start_cycles = s->cpu->cycles;
+    if (s->transfer_end_time)
+      s->transfer_end_time = (s->transfer_end_time > s->cpu->cycles) ?
+          (s->transfer_end_time - s->cpu->cycles) : 1;
+    serial_link_update_state(s, 0);
+  }
+  for (side = 0; side < 2; side++)
+    serial_link_schedule(ends[side], 0);
+  pthread_mutex_unlock(&l->lock);
+}
+
+void serial_link_disconnect(struct serial* s) {
+  struct serial_link* l = s->link;
+  if (!l)
+    return;
+
+  pthread_mutex_lock(&l->lock);
+  l->time[s->link_side] = UINT64_MAX;
+  l->transfer_end_time[s->link_side] = 0;
+  l->external_since[s->link_side] = UINT64_MAX;
+  l->ends[s->link_side] = NULL;
+  pthread_cond_broadcast(&l->time_advanced);
+  pthread_mutex_unlock(&l->lock);
+
+  s->link = NULL;
+  if (s->transfer_end_time) {
+    s->transfer_end_time += s->link_start_cycles;
+    scheduler_schedule(&s->mem->sched, SCHEDULER_EVENT_SERIAL,
+        s->transfer_end_time);
+  } else
+    scheduler_cancel(&s->mem->sched, SCHEDULER_EVENT_SERIAL);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// registers
+
+// with nothing connected, an internally-clocked transfer shifts in all 1s
+// (the line is pulled high), and an externally-clocked one never finishes
+static void serial_event(void* context, uint64_t cycles) {
+  struct serial* s = (struct serial*)context;
+  if (s->link) {
+    serial_link_event(s, cycles);
+    return;
+  }
+  if (s->socket) {
+    serial_socket_event(s->socket, cycles);
+    return;
+  }
+
+  if (s->data >= 0x20 && s->data <= 0x7F)
+    fprintf(stderr, "serial out: %02X \'%c\'\n", s->data, s->data);
+  else
+    fprintf(stderr, "serial out: %02X\n", s->data);
+  serial_finish_transfer(s, 0xFF);
+}
 
 inline uint8_t read_serial_data(struct serial* s, uint8_t addr) {
   return s->data;
@@ -18,20 +212,39 @@ inline uint8_t read_serial_data(struct serial* s, uint8_t addr) {
 
 inline void write_serial_data(struct serial* s, uint8_t addr, uint8_t value) {
   s->data = value;
+  if (s->socket)
+    serial_socket_register_written(s->socket, SERIAL_SOCKET_MSG_DATA);
 }
 
+// the fast clock bit only exists on CGB; on DMG it reads as 1 and is ignored
+
 inline uint8_t read_serial_control(struct serial* s, uint8_t addr) {
-  return s->control;
-}
-
-inline void write_serial_control(struct serial* s, uint8_t addr, uint8_t value) {
-  s->control = value;
-  if (s->control & 0x80) {
-    if (s->data >= 0x20 && s->data <= 0x7F)
-      fprintf(stderr, "serial out: %02X \'%c\'\n", s->data, s->data);
-    else
-      fprintf(stderr, "serial out: %02X\n", s->data);
-    s->data = 0x00;
-    signal_interrupt(s->cpu, INTERRUPT_SERIAL, 1);
-  }
+  if (!(s->mem->cart->header.cgb_flag & 0x80))
+    return s->control | 0x7E;
+  return s->control | 0x7C;
+}
+
+void write_serial_control(struct serial* s, uint8_t addr, uint8_t value) {
+  s->control = value & ((s->mem->cart->header.cgb_flag & 0x80) ? 0x83 : 0x81);
+
+  uint64_t now = (s->link || s->socket) ?
+      (s->cpu->cycles - s->link_start_cycles) : s->cpu->cycles;
+  if ((s->control & (SERIAL_CONTROL_TRANSFER | SERIAL_CONTROL_INTERNAL)) ==
+      (SERIAL_CONTROL_TRANSFER | SERIAL_CONTROL_INTERNAL))
+    s->transfer_end_time = now + serial_transfer_cycles(s->control);
+  else
+    s->transfer_end_time = 0;
+
+  if (s->link) {
+    pthread_mutex_lock(&s->link->lock);
+    serial_link_update_state(s, now);
+    serial_link_schedule(s, now);
+    pthread_mutex_unlock(&s->link->lock);
+  } else if (s->socket)
+    serial_socket_register_written(s->socket, SERIAL_SOCKET_MSG_CONTROL);
+  else if (s->transfer_end_time)
+    scheduler_schedule(&s->mem->sched, SCHEDULER_EVENT_SERIAL,
+        s->transfer_end_time);
+  else
+    scheduler_cancel(&s->mem->sched, SCHEDULER_EVENT_SERIAL);
 }
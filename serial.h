@@ -1,22 +1,88 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include "cpu.h"
+#include "mmu.h"
+
+#define SERIAL_CONTROL_TRANSFER  0x80 // 1 = transfer requested or in progress
+#define SERIAL_CONTROL_FAST      0x02 // CGB only: 32x faster internal clock
+#define SERIAL_CONTROL_INTERNAL  0x01 // 1 = this side drives the clock
+
+// the internal clock runs at 8192 Hz (262144 Hz in fast mode), and a transfer
+// is 8 bits. in double speed mode the clock doubles too, so these are the
+// same in cpu cycles either way
+#define SERIAL_TRANSFER_CYCLES       4096
+#define SERIAL_FAST_TRANSFER_CYCLES  128
+
+// while linked, each side syncs with the link at least this often, so a side
+// that's waiting on the other never has to wait long for it to catch up
+#define SERIAL_LINK_SYNC_CYCLES  4096
+
+struct serial_link;
+struct serial_socket;
 
 struct serial {
   struct regs* cpu;
-  uint8_t data;
-  uint8_t control;
+  struct memory* mem; // for scheduling transfer and sync events
+  uint8_t data;       // FF01
+  uint8_t control;    // FF02
+
+  // when the current internally-clocked transfer finishes, in link time (or
+  // in cpu cycles, if not linked by either kind of link); 0 if there isn't one
+  uint64_t transfer_end_time;
+
+  struct serial_link* link;
+  int link_side;
+  struct serial_socket* socket; // see serial_socket.h; NULL if not used
+  uint64_t link_start_cycles; // cpu cycles when link time was 0
 };
 
-void serial_init(struct serial* s, struct regs* cpu);
+// two serial ports connected by a cable, each in an instance running on its
+// own thread. both sides' clocks are measured in link time (cpu cycles since
+// they were connected), which is assumed to run at the same rate on both.
+//
+// the sides only wait for each other around transfers. a side with an
+// internally-clocked transfer stops when it ends and waits for the other side
+// to get there, then exchanges bytes with it if it's waiting on an external
+// clock. a side waiting on an external clock can't run ahead of the point
+// where the other side could finish a transfer, so it never misses one. a
+// side with nothing pending never waits; it just reports its time every
+// SERIAL_LINK_SYNC_CYCLES so the other side can make progress.
+struct serial_link {
+  pthread_mutex_t lock;
+  pthread_cond_t time_advanced;
+  struct serial* ends[2];
+
+  uint64_t time[2]; // how far each side has run; UINT64_MAX if disconnected
+  uint64_t transfer_end_time[2]; // each side's internal transfer; 0 if none
+  uint64_t external_since[2]; // when each side started waiting on an
+                              // external clock; UINT64_MAX if it isn't
+};
+
+void serial_init(struct serial* s, struct regs* cpu, struct memory* m);
+
+// how long an internally-clocked transfer started with this SC value takes
+uint64_t serial_transfer_cycles(uint8_t control);
+// ends the current transfer with the given byte shifted in (for the links)
+void serial_finish_transfer(struct serial* s, uint8_t received);
 
-void serial_update(struct serial* s, int cycles);
 uint8_t read_serial_data(struct serial* s, uint8_t addr);
 void write_serial_data(struct serial* s, uint8_t addr, uint8_t value);
 uint8_t read_serial_control(struct serial* s, uint8_t addr);
 void write_serial_control(struct serial* s, uint8_t addr, uint8_t value);
 
+void serial_link_init(struct serial_link* l);
+void serial_link_free(struct serial_link* l);
+
+// connects the two ports. this must be done while neither instance is running;
+// their current cycle counts become link time 0. a side must be disconnected
+// (from its own thread, or while it's not running) before it stops running for
+// good, or the other side may wait for it forever
+void serial_link_connect(struct serial_link* l, struct serial* a,
+    struct serial* b);
+void serial_link_disconnect(struct serial* s);
+
 #endif // SERIAL_H
@@ -0,0 +1,882 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "serial_socket.h"
+
+// linux reports a closed socket through send's return value only with this;
+// elsewhere SO_NOSIGPIPE is set on the socket instead
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void serial_socket_keys_cb(void* arg, int keys_pressed);
+
+static inline uint64_t serial_socket_now(const struct serial_socket* l) {
+  return l->ser->cpu->cycles - l->ser->link_start_cycles;
+}
+
+static inline int serial_socket_is_waiting(uint8_t control) {
+  return (control & (SERIAL_CONTROL_TRANSFER | SERIAL_CONTROL_INTERNAL)) ==
+      SERIAL_CONTROL_TRANSFER;
+}
+
+static inline uint64_t serial_socket_min(uint64_t a, uint64_t b) {
+  return (a < b) ? a : b;
+}
+
+static inline uint64_t serial_socket_max(uint64_t a, uint64_t b) {
+  return (a > b) ? a : b;
+}
+
+// stops using the link for good (e.g. if the other side went away); this side
+// keeps running as if the cable was pulled out. anything it guessed stays as
+// it is
+static void serial_socket_unlink(struct serial_socket* l, const char* reason) {
+  struct serial* s = l->ser;
+  if (l->fd < 0)
+    return;
+
+  if (reason)
+    fprintf(stderr, "link %s; continuing without it\n", reason);
+  close(l->fd);
+  l->fd = -1;
+  l->num_snapshots = 0;
+  l->num_decisions = 0;
+  l->key_replay_pos = l->num_key_events;
+  if (l->inp)
+    input_set_keys_callback(l->inp, NULL, NULL);
+
+  s->socket = NULL;
+  if (s->transfer_end_time) {
+    s->transfer_end_time += s->link_start_cycles;
+    scheduler_schedule(&s->mem->sched, SCHEDULER_EVENT_SERIAL,
+        s->transfer_end_time);
+  } else
+    scheduler_cancel(&s->mem->sched, SCHEDULER_EVENT_SERIAL);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// messages
+
+// reads whatever has arrived, without waiting. returns -1 if the link is gone
+static int serial_socket_receive(struct serial_socket* l) {
+  for (;;) {
+    if (l->recv_capacity - l->recv_size < 0x1000) {
+      size_t new_capacity = l->recv_capacity ? (l->recv_capacity * 2) : 0x1000;
+      uint8_t* new_buf = (uint8_t*)realloc(l->recv_buf, new_capacity);
+      if (!new_buf) {
+        serial_socket_unlink(l, "failed to allocate receive buffer");
+        return -1;
+      }
+      l->recv_buf = new_buf;
+      l->recv_capacity = new_capacity;
+    }
+
+    ssize_t bytes = recv(l->fd, l->recv_buf + l->recv_size,
+        l->recv_capacity - l->recv_size, MSG_DONTWAIT);
+    if (bytes > 0)
+      l->recv_size += bytes;
+    else if (bytes == 0) {
+      serial_socket_unlink(l, "disconnected");
+      return -1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    else if (errno != EINTR) {
+      serial_socket_unlink(l, "failed to receive");
+      return -1;
+    }
+  }
+}
+
+// waits until the socket is ready for events, or until serial_socket_interrupt
+// is called, in which case the link is dropped. returns -1 if the link is gone
+static int serial_socket_poll(struct serial_socket* l, short events,
+    short* revents) {
+  struct pollfd fds[2];
+  fds[0].fd = l->fd;
+  fds[1].fd = l->wake_fds[0];
+  fds[0].events = events;
+  fds[1].events = POLLIN;
+  fds[0].revents = fds[1].revents = 0;
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) {
+      serial_socket_unlink(l, "failed to wait for the other side");
+      return -1;
+    }
+  }
+  if (fds[1].revents) {
+    serial_socket_unlink(l, "interrupted while waiting for the other side");
+    return -1;
+  }
+  *revents = fds[0].revents;
+  return 0;
+}
+
+static int serial_socket_send_raw(struct serial_socket* l,
+    const struct serial_socket_message* msg) {
+  const uint8_t* data = (const uint8_t*)msg;
+  size_t remaining = sizeof(*msg);
+  while (remaining) {
+    ssize_t bytes = send(l->fd, data, remaining, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes > 0) {
+      data += bytes;
+      remaining -= bytes;
+
+    } else if ((bytes < 0) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // the other side isn't reading right now. it may be stuck sending to
+      // this side too, so keep reading while waiting
+      short revents;
+      if (serial_socket_poll(l, POLLIN | POLLOUT, &revents) < 0)
+        return -1;
+      if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+          (serial_socket_receive(l) < 0))
+        return -1;
+
+    } else if ((bytes < 0) && (errno == EINTR))
+      continue;
+    else {
+      serial_socket_unlink(l, "failed to send");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// sends a change to this side's SC or SB, as of time
+static void serial_socket_send(struct serial_socket* l, uint8_t type,
+    uint64_t time) {
+  if (time < l->last_sent_time)
+    time = l->last_sent_time;
+  l->last_sent_time = time;
+  if (time < l->resend_time)
+    return;
+
+  struct serial_socket_message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = type;
+  msg.control = l->ser->control;
+  msg.data = l->ser->data;
+  msg.time = time;
+  serial_socket_send_raw(l, &msg);
+}
+
+static void serial_socket_send_sync(struct serial_socket* l, uint64_t now) {
+  struct serial_socket_message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SERIAL_SOCKET_MSG_SYNC;
+  msg.time = serial_socket_max(serial_socket_max(now, l->last_sent_time),
+      l->resend_time);
+  msg.floor = l->floor;
+  l->last_sync_time = now;
+  serial_socket_send_raw(l, &msg);
+}
+
+static void serial_socket_add_peer_event(struct serial_socket* l,
+    const struct serial_socket_message* msg) {
+  if (l->num_peer_events == l->peer_events_capacity) {
+    size_t new_capacity = l->peer_events_capacity ?
+        (l->peer_events_capacity * 2) : 0x40;
+    struct serial_socket_peer_event* new_events =
+        (struct serial_socket_peer_event*)realloc(l->peer_events,
+            new_capacity * sizeof(*new_events));
+    if (!new_events) {
+      serial_socket_unlink(l, "failed to allocate peer history");
+      return;
+    }
+    l->peer_events = new_events;
+    l->peer_events_capacity = new_capacity;
+  }
+
+  struct serial_socket_peer_event* ev = &l->peer_events[l->num_peer_events++];
+  ev->time = msg->time;
+  ev->type = msg->type;
+  ev->control = msg->control;
+  ev->data = msg->data;
+}
+
+static void serial_socket_process_messages(struct serial_socket* l) {
+  size_t offset = 0, x;
+  while ((l->fd >= 0) &&
+         (l->recv_size - offset >= sizeof(struct serial_socket_message))) {
+    struct serial_socket_message msg;
+    memcpy(&msg, l->recv_buf + offset, sizeof(msg));
+    offset += sizeof(msg);
+
+    switch (msg.type) {
+      case SERIAL_SOCKET_MSG_ROLLBACK:
+        while (l->num_peer_events &&
+               (l->peer_events[l->num_peer_events - 1].time >= msg.time))
+          l->num_peer_events--;
+        if (l->peer_time > msg.time)
+          l->peer_time = msg.time;
+        // the other side's transfers after then may have changed, so look at
+        // them again (here and in any snapshot this side goes back to)
+        if (l->peer_transfers_done > msg.time)
+          l->peer_transfers_done = msg.time;
+        for (x = 0; x < l->num_snapshots; x++)
+          if (l->snapshots[x]->peer_transfers_done > msg.time)
+            l->snapshots[x]->peer_transfers_done = msg.time;
+        break;
+
+      case SERIAL_SOCKET_MSG_SYNC:
+        l->peer_time = serial_socket_max(l->peer_time, msg.time);
+        l->peer_floor = serial_socket_max(l->peer_floor, msg.floor);
+        break;
+
+      case SERIAL_SOCKET_MSG_CONTROL:
+      case SERIAL_SOCKET_MSG_DATA:
+      case SERIAL_SOCKET_MSG_DONE:
+        serial_socket_add_peer_event(l, &msg);
+        l->peer_time = serial_socket_max(l->peer_time, msg.time);
+        break;
+
+      default:
+        fprintf(stderr, "link received unknown message type %02X\n", msg.type);
+    }
+  }
+
+  if (l->fd >= 0) {
+    l->recv_size -= offset;
+    memmove(l->recv_buf, l->recv_buf + offset, l->recv_size);
+  }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// the other side's history
+
+// the other side's SC and SB just before time, as far as this side knows
+static void serial_socket_peer_state(const struct serial_socket* l,
+    uint64_t time, uint8_t* control, uint8_t* data) {
+  *control = 0;
+  *data = 0xFF;
+  size_t x;
+  for (x = 0; (x < l->num_peer_events) && (l->peer_events[x].time < time);
+       x++) {
+    const struct serial_socket_peer_event* ev = &l->peer_events[x];
+    if (ev->type != SERIAL_SOCKET_MSG_DATA)
+      *control = ev->control;
+    *data = ev->data;
+  }
+}
+
+// the end of the first of the other side's internally-clocked transfers that
+// ends after time after (UINT64_MAX if there isn't one), and the byte it sends
+static uint64_t serial_socket_next_peer_transfer(const struct serial_socket* l,
+    uint64_t after, uint8_t* data) {
+  uint64_t ret = UINT64_MAX;
+  size_t x, y;
+  for (x = 0; x < l->num_peer_events; x++) {
+    const struct serial_socket_peer_event* ev = &l->peer_events[x];
+    if ((ev->type != SERIAL_SOCKET_MSG_CONTROL) ||
+        ((ev->control & (SERIAL_CONTROL_TRANSFER | SERIAL_CONTROL_INTERNAL)) !=
+          (SERIAL_CONTROL_TRANSFER | SERIAL_CONTROL_INTERNAL)))
+      continue;
+    uint64_t end_time = ev->time + serial_transfer_cycles(ev->control);
+    if ((end_time <= after) || (end_time >= ret))
+      continue;
+
+    // writing SC again before it ends cancels it
+    for (y = x + 1; (y < l->num_peer_events) &&
+         (l->peer_events[y].type == SERIAL_SOCKET_MSG_DATA); y++);
+    if ((y < l->num_peer_events) && (l->peer_events[y].time < end_time))
+      continue;
+
+    uint8_t control;
+    serial_socket_peer_state(l, end_time, &control, data);
+    ret = end_time;
+  }
+  return ret;
+}
+
+// drops the other side's messages from before time, except what's needed to
+// know its state at that time
+static void serial_socket_trim_peer_events(struct serial_socket* l,
+    uint64_t time) {
+  size_t x, first = 0;
+  for (x = 0; (x < l->num_peer_events) && (l->peer_events[x].time < time); x++)
+    if (l->peer_events[x].type != SERIAL_SOCKET_MSG_DATA)
+      first = x;
+  if (first) {
+    l->num_peer_events -= first;
+    memmove(l->peer_events, l->peer_events + first,
+        l->num_peer_events * sizeof(*l->peer_events));
+  }
+}
+
+
+
+// the earliest time a transfer on the other side that this side doesn't know
+// about yet could end. the other side only goes back because of something
+// that depends on this side: one of its own transfers (which depends on
+// whether this side was waiting) or one of this side's. it redoes everything
+// before that the same way, so until the first of those after its floor,
+// what it sent is as good as final, and a new transfer can't start before its
+// newest messages. otherwise, it may go back to its floor and start one there
+static uint64_t serial_socket_peer_quiet_time(const struct serial_socket* l) {
+  uint64_t time = l->peer_floor;
+  if (l->own_transfer_end < l->peer_floor) {
+    uint8_t data;
+    time = serial_socket_min(l->peer_time, serial_socket_next_peer_transfer(l,
+        l->peer_floor ? (l->peer_floor - 1) : 0, &data));
+    time = serial_socket_max(time, l->peer_floor);
+  }
+  return time + SERIAL_FAST_TRANSFER_CYCLES;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// guessing and going back
+
+static uint64_t serial_socket_floor(const struct serial_socket* l,
+    uint64_t now) {
+  uint64_t floor = now;
+  if (l->num_decisions)
+    floor = serial_socket_min(floor, l->decisions[0].time);
+  if (l->wait_start != UINT64_MAX)
+    floor = serial_socket_min(floor, serial_socket_max(l->wait_start,
+        serial_socket_peer_quiet_time(l)));
+  return serial_socket_max(floor, l->floor);
+}
+
+static void serial_socket_take_snapshot(struct serial_socket* l,
+    uint64_t due_time) {
+  struct serial_socket_snapshot* snap = l->snapshots[l->num_snapshots++];
+  savestate_save(&snap->state, l->ser->cpu, l->ser->mem);
+  snap->time = serial_socket_now(l);
+  snap->due_time = due_time;
+  snap->last_sent_time = l->last_sent_time;
+  snap->peer_transfers_done = l->peer_transfers_done;
+}
+
+// goes back to the snapshot at index. everything this side sent after that
+// (or after its floor, whichever is later) is retracted, and anything
+// guessed since then is forgotten. returns the snapshot's event time
+static uint64_t serial_socket_roll_back(struct serial_socket* l,
+    size_t index) {
+  struct serial* s = l->ser;
+  struct serial_socket_snapshot* snap = l->snapshots[index];
+  uint64_t now = serial_socket_now(l);
+
+  savestate_restore(&snap->state, s->cpu, s->mem);
+  l->last_sent_time = snap->last_sent_time;
+  l->peer_transfers_done = snap->peer_transfers_done;
+  l->num_rollbacks++;
+  l->num_rollback_cycles += now - snap->time;
+
+  l->num_snapshots = index;
+  while (l->num_decisions &&
+         (l->decisions[l->num_decisions - 1].snapshot_time >= snap->time))
+    l->num_decisions--;
+  if ((l->wait_start != UINT64_MAX) && (l->wait_start >= snap->due_time))
+    l->wait_start = l->wait_end = UINT64_MAX;
+  else if (serial_socket_is_waiting(s->control))
+    l->wait_end = UINT64_MAX;
+
+  for (l->key_replay_pos = 0; (l->key_replay_pos < l->num_key_events) &&
+       (l->key_log[l->key_replay_pos].time < snap->time); l->key_replay_pos++);
+
+  struct serial_socket_message msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = SERIAL_SOCKET_MSG_ROLLBACK;
+  msg.time = serial_socket_max(snap->time, l->floor);
+  l->resend_time = msg.time;
+  serial_socket_send_raw(l, &msg);
+  return snap->due_time;
+}
+
+// goes back if anything this side did turned out to be wrong, given what the
+// other side has sent. due_time is when the current event was scheduled for;
+// the other side's transfers that ended before then were missed, and matter
+// only if this side was waiting for one then. it's updated if this side goes
+// back
+static void serial_socket_check(struct serial_socket* l, uint64_t* due_time) {
+  while (l->fd >= 0) {
+    size_t rollback_index = l->num_snapshots;
+
+    // guesses that were wrong. they're in order, so the first one is the
+    // furthest back
+    size_t x;
+    for (x = 0; x < l->num_decisions; x++) {
+      const struct serial_socket_decision* d = &l->decisions[x];
+      if (l->peer_time < d->time)
+        break;
+
+      uint8_t control, data;
+      if (d->own) {
+        serial_socket_peer_state(l, d->time, &control, &data);
+        int peer_waiting = serial_socket_is_waiting(control);
+        if ((peer_waiting == d->peer_waiting) &&
+            (!peer_waiting || (data == d->data)))
+          continue;
+      } else if ((serial_socket_next_peer_transfer(l, d->time - 1, &data) ==
+          d->time) && (data == d->data))
+        continue;
+
+      for (rollback_index = 0;
+           l->snapshots[rollback_index]->time != d->snapshot_time;
+           rollback_index++);
+      break;
+    }
+
+    // the other side's transfers that this side didn't know about in time
+    uint8_t data;
+    uint64_t end_time;
+    while ((end_time = serial_socket_next_peer_transfer(l,
+        l->peer_transfers_done, &data)) < *due_time) {
+      if ((end_time >= l->wait_start) && (end_time <= l->wait_end)) {
+        for (x = 0; (x + 1 < l->num_snapshots) &&
+             (l->snapshots[x + 1]->due_time <= end_time); x++);
+        if (x < rollback_index)
+          rollback_index = x;
+        break;
+      }
+      l->peer_transfers_done = end_time;
+    }
+
+    if (rollback_index == l->num_snapshots)
+      break;
+    *due_time = serial_socket_roll_back(l, rollback_index);
+  }
+}
+
+// forgets whatever the other side's floor has made final
+static void serial_socket_resolve(struct serial_socket* l, uint64_t now) {
+  size_t x = 0;
+  while ((x < l->num_decisions) && (l->decisions[x].time <= l->peer_floor))
+    x++;
+  if (x) {
+    l->num_decisions -= x;
+    memmove(l->decisions, l->decisions + x,
+        l->num_decisions * sizeof(*l->decisions));
+  }
+
+  // a transfer the other side hasn't sent yet can't end while this side was
+  // waiting if that was over before it could
+  uint64_t quiet_time = serial_socket_peer_quiet_time(l);
+  if ((l->wait_start != UINT64_MAX) &&
+      !serial_socket_is_waiting(l->ser->control) &&
+      (l->wait_end < quiet_time))
+    l->wait_start = l->wait_end = UINT64_MAX;
+
+  // keep the snapshots that the remaining guesses could go back to
+  size_t keep_index = l->num_snapshots;
+  if (l->num_decisions)
+    for (keep_index = 0;
+         l->snapshots[keep_index]->time != l->decisions[0].snapshot_time;
+         keep_index++);
+  if (l->wait_start != UINT64_MAX) {
+    uint64_t time = serial_socket_max(l->wait_start, quiet_time);
+    for (x = 0; (x + 1 < l->num_snapshots) &&
+         (l->snapshots[x + 1]->due_time <= time); x++);
+    keep_index = serial_socket_min(keep_index, x);
+  }
+  if (keep_index) {
+    struct serial_socket_snapshot* dropped[SERIAL_SOCKET_MAX_SNAPSHOTS];
+    memcpy(dropped, l->snapshots, keep_index * sizeof(dropped[0]));
+    memmove(l->snapshots, l->snapshots + keep_index,
+        (SERIAL_SOCKET_MAX_SNAPSHOTS - keep_index) * sizeof(l->snapshots[0]));
+    memcpy(l->snapshots + SERIAL_SOCKET_MAX_SNAPSHOTS - keep_index, dropped,
+        keep_index * sizeof(dropped[0]));
+    l->num_snapshots -= keep_index;
+  }
+
+  // and what going back to them would need
+  uint64_t oldest_time = l->num_snapshots ? l->snapshots[0]->time : now;
+  for (x = 0; (x < l->key_replay_pos) && (l->key_log[x].time < oldest_time);
+       x++);
+  if (x) {
+    l->num_key_events -= x;
+    l->key_replay_pos -= x;
+    memmove(l->key_log, l->key_log + x,
+        l->num_key_events * sizeof(l->key_log[0]));
+  }
+  if (oldest_time > 2 * SERIAL_TRANSFER_CYCLES)
+    serial_socket_trim_peer_events(l, oldest_time - 2 * SERIAL_TRANSFER_CYCLES);
+}
+
+// sends this side's floor, then waits for the other side to send something and
+// deals with it. returns -1 if the link is gone
+static int serial_socket_wait_for_peer(struct serial_socket* l,
+    uint64_t* due_time) {
+  uint64_t now = serial_socket_now(l);
+  l->floor = serial_socket_floor(l, now);
+  serial_socket_send_sync(l, now);
+  if (l->fd < 0)
+    return -1;
+
+  short revents;
+  if ((serial_socket_poll(l, POLLIN, &revents) < 0) ||
+      (serial_socket_receive(l) < 0))
+    return -1;
+  serial_socket_process_messages(l);
+  serial_socket_check(l, due_time);
+  if (l->fd < 0)
+    return -1;
+  serial_socket_resolve(l, serial_socket_now(l));
+  return 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// events
+
+// a snapshot is needed before acting on anything the other side may still
+// change, and periodically while waiting past where its next transfer could
+// end
+static int serial_socket_needs_snapshot(const struct serial_socket* l,
+    uint64_t now) {
+  const struct serial* s = l->ser;
+  if (s->transfer_end_time && (s->transfer_end_time <= now) &&
+      (l->peer_floor < s->transfer_end_time))
+    return 1;
+  if (!serial_socket_is_waiting(s->control))
+    return 0;
+
+  uint8_t data;
+  uint64_t end_time = serial_socket_next_peer_transfer(l,
+      l->peer_transfers_done, &data);
+  if ((end_time <= now) && (l->peer_floor < end_time))
+    return 1;
+  if (now < serial_socket_peer_quiet_time(l))
+    return 0;
+  return (l->wait_start == UINT64_MAX) || !l->num_snapshots ||
+      (now >= l->snapshots[l->num_snapshots - 1]->time +
+        SERIAL_SOCKET_SNAPSHOT_CYCLES);
+}
+
+// does everything due by now: transfers ending on either side, in order, then
+// replayed keys
+static void serial_socket_run_due(struct serial_socket* l, uint64_t now) {
+  struct serial* s = l->ser;
+  uint64_t snapshot_time = l->num_snapshots ?
+      l->snapshots[l->num_snapshots - 1]->time : 0;
+
+  for (;;) {
+    uint8_t peer_data, peer_control;
+    uint64_t peer_end_time = serial_socket_next_peer_transfer(l,
+        l->peer_transfers_done, &peer_data);
+    uint64_t own_end_time = s->transfer_end_time ? s->transfer_end_time :
+        UINT64_MAX;
+
+    if ((own_end_time <= now) && (own_end_time <= peer_end_time)) {
+      // this side's transfer: exchange bytes if the other side was waiting
+      serial_socket_peer_state(l, own_end_time, &peer_control, &peer_data);
+      int peer_waiting = serial_socket_is_waiting(peer_control);
+      if (l->peer_floor < own_end_time) {
+        struct serial_socket_decision* d = &l->decisions[l->num_decisions++];
+        d->time = own_end_time;
+        d->snapshot_time = snapshot_time;
+        d->own = 1;
+        d->peer_waiting = peer_waiting;
+        d->data = peer_data;
+      }
+      serial_finish_transfer(s, peer_waiting ? peer_data : 0xFF);
+      l->own_transfer_end = own_end_time;
+      serial_socket_send(l, SERIAL_SOCKET_MSG_DONE, own_end_time);
+
+    } else if (peer_end_time <= now) {
+      // the other side's transfer: take its byte if this side is waiting
+      if (serial_socket_is_waiting(s->control)) {
+        if (l->peer_floor < peer_end_time) {
+          struct serial_socket_decision* d = &l->decisions[l->num_decisions++];
+          d->time = peer_end_time;
+          d->snapshot_time = snapshot_time;
+          d->own = 0;
+          d->peer_waiting = 0;
+          d->data = peer_data;
+        }
+        serial_finish_transfer(s, peer_data);
+        serial_socket_send(l, SERIAL_SOCKET_MSG_DONE, peer_end_time);
+        if ((l->wait_start != UINT64_MAX) && (l->wait_end == UINT64_MAX))
+          l->wait_end = peer_end_time;
+      }
+      l->peer_transfers_done = peer_end_time;
+
+    } else
+      break;
+
+    if (l->fd < 0)
+      return;
+  }
+
+  if (l->inp) {
+    l->replaying_keys = 1;
+    while ((l->key_replay_pos < l->num_key_events) &&
+           (l->key_log[l->key_replay_pos].time <= now))
+      input_set_keys(l->inp, l->key_log[l->key_replay_pos++].keys_pressed);
+    l->replaying_keys = 0;
+  }
+}
+
+// schedules the next event: the next time anything is due, or a sync
+static void serial_socket_schedule(struct serial_socket* l, uint64_t now,
+    uint64_t earliest_time) {
+  struct serial* s = l->ser;
+  uint64_t next_time = now + SERIAL_LINK_SYNC_CYCLES;
+  if (s->transfer_end_time)
+    next_time = serial_socket_min(next_time, s->transfer_end_time);
+
+  uint8_t data;
+  next_time = serial_socket_min(next_time, serial_socket_next_peer_transfer(l,
+      l->peer_transfers_done, &data));
+  if (serial_socket_is_waiting(s->control)) {
+    // no snapshots are needed before the quiet time, even if the last one was
+    // long ago
+    uint64_t snapshot_time = serial_socket_peer_quiet_time(l);
+    if ((l->wait_start != UINT64_MAX) && l->num_snapshots)
+      snapshot_time = serial_socket_max(snapshot_time,
+          l->snapshots[l->num_snapshots - 1]->time +
+            SERIAL_SOCKET_SNAPSHOT_CYCLES);
+    next_time = serial_socket_min(next_time, snapshot_time);
+  }
+  if (l->key_replay_pos < l->num_key_events)
+    next_time = serial_socket_min(next_time,
+        l->key_log[l->key_replay_pos].time);
+
+  next_time = serial_socket_max(next_time, earliest_time);
+  scheduler_schedule(&s->mem->sched, SCHEDULER_EVENT_SERIAL,
+      next_time + s->link_start_cycles);
+}
+
+void serial_socket_event(struct serial_socket* l, uint64_t cycles) {
+  uint64_t due_time = cycles - l->ser->link_start_cycles;
+  if (serial_socket_receive(l) < 0)
+    return;
+  serial_socket_process_messages(l);
+  serial_socket_check(l, &due_time);
+  if (l->fd < 0)
+    return;
+  serial_socket_resolve(l, serial_socket_now(l));
+
+  // if this side is too far ahead of what it knows about the other side to
+  // make another snapshot, it waits for the other side to catch up. this may
+  // go back, so the time is checked again after
+  while (serial_socket_needs_snapshot(l, serial_socket_now(l))) {
+    if (l->num_snapshots < SERIAL_SOCKET_MAX_SNAPSHOTS) {
+      serial_socket_take_snapshot(l, due_time);
+      if (serial_socket_is_waiting(l->ser->control) &&
+          (l->wait_start == UINT64_MAX)) {
+        l->wait_start = due_time;
+        l->wait_end = UINT64_MAX;
+      }
+      break;
+    }
+    if (serial_socket_wait_for_peer(l, &due_time) < 0)
+      return;
+  }
+
+  uint64_t now = serial_socket_now(l);
+  serial_socket_run_due(l, now);
+  if (l->fd < 0)
+    return;
+
+  // a new floor is sent soon, but not right away every time: while both sides
+  // are waiting on an external clock, each one's floor follows the other's
+  // time, so that would send a sync for every one received
+  uint64_t floor = serial_socket_floor(l, now);
+  if ((now < l->last_sync_time) ||
+      (now >= l->last_sync_time + SERIAL_LINK_SYNC_CYCLES) ||
+      ((floor != l->floor) &&
+       (now >= l->last_sync_time + SERIAL_SOCKET_FLOOR_SYNC_CYCLES))) {
+    l->floor = floor;
+    serial_socket_send_sync(l, now);
+    if (l->fd < 0)
+      return;
+  }
+  serial_socket_schedule(l, now, now + 1);
+}
+
+void serial_socket_register_written(struct serial_socket* l, int msg_type) {
+  struct serial* s = l->ser;
+  uint64_t now = serial_socket_now(l);
+  if (msg_type == SERIAL_SOCKET_MSG_CONTROL) {
+    if (serial_socket_is_waiting(s->control)) {
+      if (l->wait_start != UINT64_MAX)
+        l->wait_end = UINT64_MAX;
+    } else if ((l->wait_start != UINT64_MAX) && (l->wait_end == UINT64_MAX))
+      l->wait_end = now;
+  }
+
+  serial_socket_send(l, msg_type, now);
+  if (l->fd >= 0)
+    serial_socket_schedule(l, now, now);
+}
+
+static void serial_socket_keys_cb(void* arg, int keys_pressed) {
+  struct serial_socket* l = (struct serial_socket*)arg;
+  if (l->replaying_keys)
+    return;
+
+  // anything not yet replayed didn't happen after all
+  l->num_key_events = l->key_replay_pos;
+  if (l->num_key_events == SERIAL_SOCKET_KEY_LOG_SIZE) {
+    l->num_key_events--;
+    memmove(l->key_log, l->key_log + 1,
+        l->num_key_events * sizeof(l->key_log[0]));
+  }
+  l->key_log[l->num_key_events].time = serial_socket_now(l);
+  l->key_log[l->num_key_events].keys_pressed = keys_pressed;
+  l->key_replay_pos = ++l->num_key_events;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// setup
+
+int serial_socket_init(struct serial_socket* l, struct serial* s, int fd) {
+  memset(l, 0, sizeof(*l));
+  l->ser = s;
+  l->fd = fd;
+  l->wait_start = l->wait_end = UINT64_MAX;
+  l->wake_fds[0] = l->wake_fds[1] = -1;
+  if (s->link || s->socket) {
+    fprintf(stderr, "serial port is already linked\n");
+    close(fd);
+    return -1;
+  }
+  if (pipe(l->wake_fds)) {
+    fprintf(stderr, "failed to create link wake pipe (%d)\n", errno);
+    l->wake_fds[0] = l->wake_fds[1] = -1;
+    close(fd);
+    return -1;
+  }
+
+  int x;
+  for (x = 0; x < SERIAL_SOCKET_MAX_SNAPSHOTS; x++) {
+    l->snapshots[x] = (struct serial_socket_snapshot*)malloc(
+        sizeof(struct serial_socket_snapshot));
+    if (!l->snapshots[x] || savestate_init(&l->snapshots[x]->state, s->mem)) {
+      fprintf(stderr, "failed to allocate link snapshots\n");
+      free(l->snapshots[x]);
+      l->snapshots[x] = NULL;
+      close(l->fd);
+      l->fd = -1;
+      serial_socket_free(l);
+      return -1;
+    }
+  }
+
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+  l->inp = (struct input*)s->mem->devices[DEVICE_INPUT];
+  if (l->inp)
+    input_set_keys_callback(l->inp, serial_socket_keys_cb, l);
+
+  s->socket = l;
+  s->link_start_cycles = s->cpu->cycles;
+  if (s->transfer_end_time)
+    s->transfer_end_time = (s->transfer_end_time > s->cpu->cycles) ?
+        (s->transfer_end_time - s->cpu->cycles) : 1;
+
+  // the other side starts out knowing nothing about this side's registers
+  serial_socket_send(l, SERIAL_SOCKET_MSG_CONTROL, 0);
+  if (l->fd < 0)
+    return -1;
+  serial_socket_schedule(l, 0, 0);
+  return 0;
+}
+
+void serial_socket_free(struct serial_socket* l) {
+  serial_socket_unlink(l, NULL);
+  if (l->wake_fds[0] >= 0) {
+    close(l->wake_fds[0]);
+    close(l->wake_fds[1]);
+    l->wake_fds[0] = l->wake_fds[1] = -1;
+  }
+  int x;
+  for (x = 0; x < SERIAL_SOCKET_MAX_SNAPSHOTS; x++) {
+    if (l->snapshots[x]) {
+      savestate_free(&l->snapshots[x]->state);
+      free(l->snapshots[x]);
+      l->snapshots[x] = NULL;
+    }
+  }
+  free(l->recv_buf);
+  l->recv_buf = NULL;
+  free(l->peer_events);
+  l->peer_events = NULL;
+}
+
+void serial_socket_interrupt(struct serial_socket* l) {
+  uint8_t data = 0;
+  while ((write(l->wake_fds[1], &data, 1) < 0) && (errno == EINTR));
+}
+
+static int serial_socket_address(struct sockaddr_un* addr, const char* path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "link socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int serial_socket_listen(const char* path) {
+  struct sockaddr_un addr;
+  if (serial_socket_address(&addr, path))
+    return -1;
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    fprintf(stderr, "failed to create link socket\n");
+    return -1;
+  }
+  unlink(path); // left over from an earlier run, if any
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listen_fd, 1)) {
+    fprintf(stderr, "failed to listen on link socket %s\n", path);
+    close(listen_fd);
+    return -1;
+  }
+
+  fprintf(stderr, "waiting for the other side to connect to %s\n", path);
+  int fd;
+  while (((fd = accept(listen_fd, NULL, NULL)) < 0) && (errno == EINTR));
+  if (fd < 0)
+    fprintf(stderr, "failed to accept link connection\n");
+  close(listen_fd);
+  unlink(path);
+  return fd;
+}
+
+int serial_socket_connect(const char* path) {
+  struct sockaddr_un addr;
+  if (serial_socket_address(&addr, path))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "failed to create link socket\n");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "failed to connect to link socket %s\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void serial_socket_print_stats(FILE* stream, const struct serial_socket* l) {
+  fprintf(stream, "link: %" PRIu64 " rollbacks, %" PRIu64 " cycles redone\n",
+      l->num_rollbacks, l->num_rollback_cycles);
+}
@@ -0,0 +1,180 @@
+#ifndef SERIAL_SOCKET_H
+#define SERIAL_SOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "input.h"
+#include "savestate.h"
+#include "serial.h"
+
+// a link cable between instances in different processes, over a unix domain
+// socket. as with serial_link, both sides measure time in link time (cpu
+// cycles since they were connected), and every message is stamped with the
+// link time it happened at. the sides never wait for each other's messages to
+// arrive; instead, each one guesses what the other side did and runs ahead,
+// and goes back to a savestate and redoes the stretch if it guessed wrong.
+//
+// only transfers need guessing. when this side's internally-clocked transfer
+// ends, it exchanges bytes with the other side if that side was waiting on an
+// external clock at that time, according to the newest messages it has. when
+// the other side's transfer ends, this side takes its byte if it's waiting
+// (which it knows for sure). each side tells the other which of its messages
+// are final (its floor: it won't go back before that time), and a guess
+// based on messages from before the other side's floor can't be wrong.
+// otherwise, a savestate is made before acting on it, and it's checked once
+// the messages for its time have arrived. a side that's waiting on an
+// external clock past the point where a transfer it doesn't know about yet
+// could end also makes savestates as it goes. that point is usually just
+// after the newest messages from the other side, but if the other side could
+// still go back and start a transfer earlier, it's just after its floor.
+//
+// when a side goes back, it tells the other side that everything it sent from
+// then on no longer happened, which may make the other side go back too. since
+// a side can't go back past its floor, this always settles. keys pressed
+// during the redone stretch are replayed at the times they were first pressed,
+// so the result is the same as if the guess had been right all along.
+
+#define SERIAL_SOCKET_MSG_CONTROL   0 // SC was written
+#define SERIAL_SOCKET_MSG_DATA      1 // SB was written
+#define SERIAL_SOCKET_MSG_DONE      2 // a transfer ended, changing SC and SB
+#define SERIAL_SOCKET_MSG_SYNC      3 // the sender's time and floor
+#define SERIAL_SOCKET_MSG_ROLLBACK  4 // messages from time on are void
+
+// at most this many savestates are kept. if a side gets this far ahead of
+// what it knows about the other, it waits for the other to catch up
+#define SERIAL_SOCKET_MAX_SNAPSHOTS  32
+// how often a side makes savestates while waiting on an external clock
+#define SERIAL_SOCKET_SNAPSHOT_CYCLES  16384
+// a change to a side's floor is sent to the other side at most this often
+// (unless it's waiting for the other side)
+#define SERIAL_SOCKET_FLOOR_SYNC_CYCLES  128
+#define SERIAL_SOCKET_MAX_DECISIONS  (SERIAL_SOCKET_MAX_SNAPSHOTS * 2)
+#define SERIAL_SOCKET_KEY_LOG_SIZE  1024
+
+// both ends are on the same host, so this is sent as is
+struct serial_socket_message {
+  uint8_t type;
+  uint8_t control; // SC after the change (CONTROL, DONE)
+  uint8_t data;    // SB after the change (CONTROL, DATA, DONE)
+  uint8_t unused[5];
+  uint64_t time;
+  uint64_t floor;  // SYNC only
+};
+
+// a message from the other side, kept for as long as guesses may need it
+struct serial_socket_peer_event {
+  uint64_t time;
+  uint8_t type;
+  uint8_t control;
+  uint8_t data;
+};
+
+// a transfer that ended before the other side's messages for its time were
+// final. own is 1 for this side's transfer (the other side may or may not
+// have been waiting) and 0 for the other side's (this side was waiting, and
+// took the byte)
+struct serial_socket_decision {
+  uint64_t time;
+  uint64_t snapshot_time; // the savestate to go back to if it was wrong
+  int own;
+  int peer_waiting;
+  uint8_t data;
+};
+
+struct serial_socket_snapshot {
+  struct savestate state;
+  uint64_t time;
+  uint64_t due_time; // when the event it was made in was scheduled for
+  // the link's own state that goes with the savestate
+  uint64_t last_sent_time;
+  uint64_t peer_transfers_done;
+};
+
+struct serial_socket_key_event {
+  uint64_t time;
+  int keys_pressed;
+};
+
+struct serial_socket {
+  struct serial* ser;
+  struct input* inp; // for replaying keys; NULL if there's no input device
+  int fd;
+  int wake_fds[2]; // written to by serial_socket_interrupt
+
+  // bytes received but not yet parsed into whole messages
+  uint8_t* recv_buf;
+  size_t recv_size;
+  size_t recv_capacity;
+
+  // the other side's history, oldest first
+  struct serial_socket_peer_event* peer_events;
+  size_t num_peer_events;
+  size_t peer_events_capacity;
+  uint64_t peer_time;  // all of the other side's messages before this are here
+  uint64_t peer_floor; // ... and are final before this
+  // the end of the last of the other side's transfers that this side has
+  // gotten to (whether it took the byte or not)
+  uint64_t peer_transfers_done;
+  // the end of the last of this side's own transfers. this isn't put back when
+  // going back; being too late only makes the link more careful
+  uint64_t own_transfer_end;
+
+  // this side's guesses
+  struct serial_socket_snapshot* snapshots[SERIAL_SOCKET_MAX_SNAPSHOTS];
+  size_t num_snapshots; // oldest first
+  struct serial_socket_decision decisions[SERIAL_SOCKET_MAX_DECISIONS];
+  size_t num_decisions; // oldest first
+
+  // the stretch where this side was waiting on an external clock without
+  // knowing everything the other side did, if any (both are UINT64_MAX if
+  // not; wait_end is UINT64_MAX while it's still going). wait_start is the
+  // due time of the event that made its first snapshot
+  uint64_t wait_start;
+  uint64_t wait_end;
+
+  uint64_t floor;          // the last floor sent
+  uint64_t last_sent_time; // messages are stamped in nondecreasing order
+  uint64_t last_sync_time;
+  // messages stamped before this were sent before going back, so they aren't
+  // sent again while redoing the stretch
+  uint64_t resend_time;
+
+  // keys pressed on this side, for replaying them after going back
+  struct serial_socket_key_event key_log[SERIAL_SOCKET_KEY_LOG_SIZE];
+  size_t num_key_events;
+  size_t key_replay_pos; // the next one to replay; num_key_events if none
+  int replaying_keys;
+
+  uint64_t num_rollbacks;
+  uint64_t num_rollback_cycles; // total length of the redone stretches
+};
+
+// links the serial port to the other side over fd (a connected stream
+// socket), which the link takes ownership of. this must be done while the
+// instance isn't running, after all its devices are added; its current cycle
+// count becomes link time 0. returns -1 (and closes fd) on failure
+int serial_socket_init(struct serial_socket* l, struct serial* s, int fd);
+// unlinks (if still linked) and frees everything
+void serial_socket_free(struct serial_socket* l);
+
+// the two ends of a link made from the command line: one side listens on a
+// socket at path and waits for the other to connect to it. both return a
+// connected fd, or -1 on failure
+int serial_socket_listen(const char* path);
+int serial_socket_connect(const char* path);
+
+// called by the serial port when SC or SB is written (msg_type is CONTROL or
+// DATA), and at its events
+void serial_socket_register_written(struct serial_socket* l, int msg_type);
+void serial_socket_event(struct serial_socket* l, uint64_t cycles);
+
+// makes the link stop waiting for the other side (if it is, or whenever it
+// next would) and drop it, so the instance can be stopped even if the other
+// side is stuck. callable from any thread, until serial_socket_free
+void serial_socket_interrupt(struct serial_socket* l);
+
+void serial_socket_print_stats(FILE* stream, const struct serial_socket* l);
+
+#endif // SERIAL_SOCKET_H
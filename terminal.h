@@ -29,6 +29,4 @@
 int write_change_color(char* fmt, int color, ...);
 void change_color(int color, ...);
 
-void print_data(FILE* out, uint64_t address, const void* _data, uint64_t data_size);
-
 #endif // TERMINAL_H
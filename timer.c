@@ -5,55 +5,109 @@
 
 #include "timer.h"
 #include "cpu.h"
+#include "mmu.h"
 
 
-static int timer_freq[4] = {
-	4096,
-	262144,
-	65536,
-	16384,
+// cycles per TIMA increment for each TAC frequency setting (4096, 262144,
+// 65536 and 16384 Hz at normal speed). this is twice the period of the counter
+// bit that drives it. the counter counts cpu cycles, so all of these are
+// automatically twice as fast in double speed mode
+static const uint64_t timer_period[4] = {
+  1024,
+  16,
+  64,
+  256,
 };
 
-void timer_init(struct timer* t, struct regs* cpu) {
-  memset(t, 0, sizeof(*t));
-  t->cpu = cpu;
+static uint64_t timer_counter(struct timer* t, uint64_t cycles) {
+  return cycles - t->counter_reset_cycles;
 }
 
-void timer_update(struct timer* t, uint64_t cycles) {
+// the input to TIMA's edge detector: the selected counter bit, if enabled
+static int timer_signal(struct timer* t, uint8_t control, uint64_t cycles) {
+  if (!(control & 0x04))
+    return 0;
+  uint64_t period = timer_period[control & 3];
+  return (timer_counter(t, cycles) & (period / 2)) ? 1 : 0;
+}
 
-  uint64_t cycles_per_increment = CPU_CYCLES_PER_SEC / (is_double_speed_mode(t->cpu) ? 32768 : 16384);
-  if (cycles - t->divider_last_incremented_at_cycles > cycles_per_increment) {
-    t->divider_last_incremented_at_cycles += cycles_per_increment;
-    t->divider++;
+static void timer_add(struct timer* t, uint64_t ticks) {
+  while (ticks) {
+    uint64_t ticks_to_overflow = 0x100 - t->timer;
+    if (ticks < ticks_to_overflow) {
+      t->timer += ticks;
+      return;
+    }
+    ticks -= ticks_to_overflow;
+    t->timer = t->timer_mod;
+    signal_interrupt(t->cpu, INTERRUPT_TIMER, 1);
   }
+}
 
+// brings TIMA up to date with the given cycle count. the overflow event keeps
+// the gaps between these short, so the loop in timer_add rarely runs more
+// than once
+static void timer_sync(struct timer* t, uint64_t cycles) {
   if (t->control & 0x04) {
-    cycles_per_increment = CPU_CYCLES_PER_SEC / (is_double_speed_mode(t->cpu) ? (2 * timer_freq[t->control & 3]) : timer_freq[t->control & 3]);
-    if (cycles - t->timer_last_incremented_at_cycles > cycles_per_increment) {
-      t->timer_last_incremented_at_cycles += cycles_per_increment;
-      if (t->timer == 0xFF) {
-        signal_interrupt(t->cpu, INTERRUPT_TIMER, 1);
-        t->timer = t->timer_mod;
-      } else
-        t->timer++;
-    }
+    uint64_t period = timer_period[t->control & 3];
+    timer_add(t, timer_counter(t, cycles) / period -
+        timer_counter(t, t->timer_cycles) / period);
+  }
+  t->timer_cycles = cycles;
+}
+
+static void timer_schedule_overflow(struct timer* t) {
+  if (!(t->control & 0x04)) {
+    scheduler_cancel(&t->mem->sched, SCHEDULER_EVENT_TIMER);
+    return;
   }
+
+  uint64_t period = timer_period[t->control & 3];
+  uint64_t ticks_to_overflow = 0x100 - t->timer;
+  uint64_t overflow_counter =
+      (timer_counter(t, t->timer_cycles) / period + ticks_to_overflow) * period;
+  scheduler_schedule(&t->mem->sched, SCHEDULER_EVENT_TIMER,
+      t->counter_reset_cycles + overflow_counter);
+}
+
+static void timer_overflow_event(void* context, uint64_t cycles) {
+  struct timer* t = (struct timer*)context;
+  timer_sync(t, cycles);
+  timer_schedule_overflow(t);
+}
+
+void timer_init(struct timer* t, struct regs* cpu, struct memory* m) {
+  memset(t, 0, sizeof(*t));
+  t->cpu = cpu;
+  t->mem = m;
+  t->counter_reset_cycles = cpu->cycles;
+  t->timer_cycles = cpu->cycles;
+  scheduler_set_handler(&m->sched, SCHEDULER_EVENT_TIMER, timer_overflow_event, t);
 }
 
 uint8_t read_divider(struct timer* t, uint8_t addr) {
-  return t->divider;
+  return timer_counter(t, t->cpu->cycles) >> 8;
 }
 
 void write_divider(struct timer* t, uint8_t addr, uint8_t value) {
-  t->divider = 0;
+  // resetting the counter is a falling edge if the selected bit was set
+  uint64_t cycles = t->cpu->cycles;
+  timer_sync(t, cycles);
+  if (timer_signal(t, t->control, cycles))
+    timer_add(t, 1);
+  t->counter_reset_cycles = cycles;
+  timer_schedule_overflow(t);
 }
 
 uint8_t read_timer(struct timer* t, uint8_t addr) {
+  timer_sync(t, t->cpu->cycles);
   return t->timer;
 }
 
 void write_timer(struct timer* t, uint8_t addr, uint8_t value) {
+  timer_sync(t, t->cpu->cycles);
   t->timer = value;
+  timer_schedule_overflow(t);
 }
 
 uint8_t read_timer_mod(struct timer* t, uint8_t addr) {
@@ -61,13 +115,21 @@ uint8_t read_timer_mod(struct timer* t, uint8_t addr) {
 }
 
 void write_timer_mod(struct timer* t, uint8_t addr, uint8_t value) {
+  timer_sync(t, t->cpu->cycles);
   t->timer_mod = value;
 }
 
 uint8_t read_timer_control(struct timer* t, uint8_t addr) {
-  return t->control;
+  return 0xF8 | t->control;
 }
 
 void write_timer_control(struct timer* t, uint8_t addr, uint8_t value) {
-  t->control = value;
+  // disabling the timer or switching to a bit that's 0 is a falling edge if
+  // the previously-selected bit was set
+  uint64_t cycles = t->cpu->cycles;
+  timer_sync(t, cycles);
+  if (timer_signal(t, t->control, cycles) && !timer_signal(t, value, cycles))
+    timer_add(t, 1);
+  t->control = value & 0x07;
+  timer_schedule_overflow(t);
 }
@@ -5,20 +5,24 @@
 
 #include "cpu.h"
 
+// the timer is driven by a 16-bit system counter that counts cpu cycles; DIV
+// is its high byte, and TIMA increments whenever the counter bit selected by
+// TAC goes from 1 to 0. nothing here runs per instruction: DIV and TIMA are
+// computed from the cpu's cycle count when they're read, and the only
+// scheduled event is the next TIMA overflow.
 struct timer {
-  uint8_t divider;
-  uint8_t timer;
-  uint8_t timer_mod;
-  uint8_t control;
+  uint8_t timer;     // FF05; current as of timer_cycles
+  uint8_t timer_mod; // FF06
+  uint8_t control;   // FF07
 
   struct regs* cpu;
-  uint64_t divider_last_incremented_at_cycles;
-  uint64_t timer_last_incremented_at_cycles;
+  struct memory* mem; // for scheduling overflow events
+  uint64_t counter_reset_cycles; // when the system counter was last 0
+  uint64_t timer_cycles;
 };
 
-void timer_init(struct timer* t, struct regs* cpu);
+void timer_init(struct timer* t, struct regs* cpu, struct memory* m);
 
-void timer_update(struct timer* t, uint64_t cycles);
 uint8_t read_divider(struct timer* t, uint8_t addr);
 void write_divider(struct timer* t, uint8_t addr, uint8_t value);
 uint8_t read_timer(struct timer* t, uint8_t addr);
@@ -0,0 +1,55 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "triple_buffer.h"
+
+int triple_buffer_init(struct triple_buffer* b, size_t size) {
+  memset(b, 0, sizeof(*b));
+
+  int x;
+  for (x = 0; x < 3; x++) {
+    b->buffers[x] = calloc(1, size);
+    if (!b->buffers[x]) {
+      triple_buffer_free(b);
+      return -1;
+    }
+  }
+
+  b->write_index = 0;
+  atomic_init(&b->shared, 1);
+  b->read_index = 2;
+  return 0;
+}
+
+void triple_buffer_free(struct triple_buffer* b) {
+  int x;
+  for (x = 0; x < 3; x++) {
+    free(b->buffers[x]);
+    b->buffers[x] = NULL;
+  }
+}
+
+void* triple_buffer_write_buffer(struct triple_buffer* b) {
+  return b->buffers[b->write_index];
+}
+
+void triple_buffer_publish(struct triple_buffer* b) {
+  // release so the consumer sees the buffer's contents when it takes it
+  int prev = atomic_exchange_explicit(&b->shared,
+      b->write_index | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+  b->write_index = prev & TRIPLE_BUFFER_INDEX_MASK;
+}
+
+const void* triple_buffer_read(struct triple_buffer* b, int* is_new) {
+  int new_frame = 0;
+  if (atomic_load_explicit(&b->shared, memory_order_relaxed) & TRIPLE_BUFFER_FRESH) {
+    int prev = atomic_exchange_explicit(&b->shared, b->read_index,
+        memory_order_acq_rel);
+    b->read_index = prev & TRIPLE_BUFFER_INDEX_MASK;
+    new_frame = 1;
+  }
+  if (is_new)
+    *is_new = new_frame;
+  return b->buffers[b->read_index];
+}
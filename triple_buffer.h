@@ -0,0 +1,34 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// lock-free single-producer/single-consumer triple buffer. the producer always
+// has a buffer to write into and the consumer always has a complete buffer to
+// read from; neither ever waits for the other. if the producer publishes
+// faster than the consumer reads, intermediate buffers are dropped and the
+// consumer just gets the most recent one.
+
+#define TRIPLE_BUFFER_INDEX_MASK  0x03
+#define TRIPLE_BUFFER_FRESH       0x04 // shared buffer hasn't been read yet
+
+struct triple_buffer {
+  void* buffers[3];
+  atomic_int shared; // index of the buffer not owned by either side
+  int write_index; // only used by the producer
+  int read_index; // only used by the consumer
+};
+
+int triple_buffer_init(struct triple_buffer* b, size_t size);
+void triple_buffer_free(struct triple_buffer* b);
+
+// producer side
+void* triple_buffer_write_buffer(struct triple_buffer* b);
+void triple_buffer_publish(struct triple_buffer* b);
+
+// consumer side. returns the most recently published buffer (or the previous
+// one again, if nothing was published since); *is_new is set accordingly
+const void* triple_buffer_read(struct triple_buffer* b, int* is_new);
+
+#endif // TRIPLE_BUFFER_H